@@ -0,0 +1,664 @@
+
+// Benchmarks. Run from the build directory:
+//
+//      ./bench [-o results.jsonl] [--diff sizeMB] [--validate sizeMB] [--query sizeMB] [--batch] [--overlay]
+//              [--include] [--numbers count] [corpus files or directories...]
+//
+// Corpora are written by `create_tests.py --bench-corpus`. For each corpus, every phase (lex, parse, get,
+// as, toVector/toMap, serialize) is timed separately, and reported as one JSON object per line with its
+// throughput, time per operation, allocations and the peak RSS so far.
+
+#include "yaml_parse.hpp"
+#include <chrono>
+#include <numeric>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sys/resource.h>
+
+using namespace syaml;
+
+// Count allocations.
+namespace {
+	std::atomic<uint64_t> allocCount { 0 };
+	std::atomic<uint64_t> allocBytes { 0 };
+}
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(size_t n) {
+	allocCount.fetch_add(1, std::memory_order_relaxed);
+	allocBytes.fetch_add(n, std::memory_order_relaxed);
+	if (void* p = malloc(n ? n : 1)) return p;
+	throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+	free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+// The records of the `rows` corpus, decoded one by one.
+struct Row {
+	int64_t id;
+	std::string_view name;
+	double score;
+	bool ok;
+	std::vector<std::string> tags;
+};
+namespace syaml {
+	template <> struct Decode<Row> : FromKey {
+		static constexpr Schema schema { Field<int64_t> { "id" }, Field<std::string_view> { "name" }, Field<double> { "score" },
+			                             Field<bool> { "ok" }, Field<std::vector<std::string>> { "tags" } };
+		static Row decode(const DictNode* d) {
+			auto b = schema.bind_(d);
+			if (!b.ok()) throw std::runtime_error(b.error());
+			return { schema.as_<0>(b), schema.as_<1>(b), schema.as_<2>(b), schema.as_<3>(b), schema.as_<4>(b) };
+		}
+	};
+}
+
+namespace {
+
+	template <class F> double timeMs(F&& f) {
+		auto t0 = std::chrono::steady_clock::now();
+		f();
+		auto t1 = std::chrono::steady_clock::now();
+		return std::chrono::duration<double, std::milli>(t1 - t0).count();
+	}
+
+	long peakRssKb() {
+		rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		return ru.ru_maxrss;
+	}
+
+	FILE* results = stdout;
+
+	struct Measured {
+		double ms;
+		uint64_t allocs;
+		uint64_t allocBytes;
+	};
+
+	template <class F> Measured measure(F&& f) {
+		uint64_t c0 = allocCount, b0 = allocBytes;
+		double ms   = timeMs(f);
+		return { ms, allocCount - c0, allocBytes - b0 };
+	}
+
+	// Report a phase that did `ops` operations over `bytes` bytes.
+	void report(const std::string& corpus, const char* phase, uint64_t bytes, uint64_t ops, const Measured& m) {
+		fprintf(results,
+		        "{\"corpus\": \"%s\", \"phase\": \"%s\", \"bytes\": %lu, \"ops\": %lu, \"ms\": %.3f, "
+		        "\"mb_per_s\": %.2f, \"ns_per_op\": %.2f, \"allocs\": %lu, \"alloc_bytes\": %lu, "
+		        "\"peak_rss_kb\": %ld}\n",
+		        corpus.c_str(), phase, bytes, ops, m.ms, bytes / (1024. * 1024.) / (m.ms / 1000.),
+		        ops ? m.ms * 1e6 / ops : 0., m.allocs, m.allocBytes, peakRssKb());
+		fflush(results);
+	}
+
+	// Measure `f`, which returns how many operations it did, and report it.
+	template <class F> void phase(const std::string& corpus, const char* name, uint64_t bytes, F&& f) {
+		uint64_t ops = 0;
+		auto m       = measure([&]() { ops = f(); });
+		report(corpus, name, bytes, ops, m);
+	}
+
+	// One step of a `get()` chain.
+	struct PathStep {
+		std::string key;
+		uint32_t index;
+	};
+
+	// All paths from the root to a leaf, and the containers whose children are all scalars.
+	struct Shape {
+		uint64_t nodes = 0;
+		std::vector<std::vector<PathStep>> leafPaths;
+		std::vector<const ScalarNode*> scalars;
+		std::vector<const ListNode*> scalarLists;
+		std::vector<const DictNode*> scalarDicts;
+
+		void walk(const Node* n, std::vector<PathStep>& path) {
+			nodes++;
+			bool allScalars = true;
+			if (auto d = dynamic_cast<const DictNode*>(n)) {
+				for (auto& kv : d->children) {
+					path.push_back({ kv.first, 0 });
+					walk(kv.second, path);
+					path.pop_back();
+					allScalars &= dynamic_cast<const ScalarNode*>(kv.second) != nullptr;
+				}
+				if (allScalars and d->children.size()) scalarDicts.push_back(d);
+			} else if (auto l = dynamic_cast<const ListNode*>(n)) {
+				for (uint32_t i = 0; i < l->children.size(); i++) {
+					path.push_back({ "", i });
+					walk(l->children[i], path);
+					path.pop_back();
+					allScalars &= dynamic_cast<const ScalarNode*>(l->children[i]) != nullptr;
+				}
+				if (allScalars and l->children.size()) scalarLists.push_back(l);
+			} else {
+				leafPaths.push_back(path);
+				if (auto s = dynamic_cast<const ScalarNode*>(n)) scalars.push_back(s);
+			}
+		}
+	};
+
+	constexpr auto& rowSchema = Decode<Row>::schema;
+
+	void benchCorpus(const std::string& path) {
+		std::ifstream ifs(path);
+		std::stringstream ss;
+		ss << ifs.rdbuf();
+		std::string corpus = std::filesystem::path(path).filename().string();
+		Document doc(ss.str());
+		uint64_t bytes = doc.src.length();
+
+		TokenizedDoc tdoc;
+		phase(corpus, "lex", bytes, [&]() {
+			tdoc = lex(&doc);
+			return tdoc.size();
+		});
+
+		std::unique_ptr<RootNode> root;
+		auto parsed = measure([&]() { root.reset(Parser {}.parse(&tdoc)); });
+
+		Shape shape;
+		std::vector<PathStep> p;
+		shape.walk(root.get(), p);
+		report(corpus, "parse", bytes, shape.nodes, parsed);
+
+		// Eight plugins loading the same file, each for itself and through a shared DocumentCache. The
+		// allocations are the memory the copies cost.
+		phase(corpus, "from_file_8_times", bytes * 8, [&]() {
+			std::vector<std::shared_ptr<const ParsedDocument>> docs;
+			for (int i = 0; i < 8; i++) docs.push_back(ParsedDocument::fromFile(path));
+			return (uint64_t)docs.size();
+		});
+		phase(corpus, "document_cache_8_times", bytes * 8, [&]() {
+			DocumentCache cache;
+			std::vector<std::shared_ptr<const RootNode>> docs;
+			for (int i = 0; i < 8; i++) docs.push_back(cache.get(path));
+			return (uint64_t)docs.size();
+		});
+
+		// JSON can be lexed and parsed in one pass instead, see Parser::parseJson(). Compare with lex + parse.
+		if (looksLikeJson(doc.src)) {
+			TokenizedDoc jdoc;
+			jdoc.doc = &doc;
+			std::unique_ptr<RootNode> jroot;
+			phase(corpus, "lex_parse_json", bytes, [&]() {
+				jroot.reset(Parser {}.parseJson(&jdoc));
+				return shape.nodes;
+			});
+		}
+
+		phase(corpus, "get", bytes, [&]() {
+			uint64_t ops = 0;
+			for (auto& leafPath : shape.leafPaths) {
+				Node* n = root.get();
+				for (auto& step : leafPath) n = step.key.length() ? n->get(step.key.c_str()) : n->get(step.index);
+				ops += leafPath.size();
+			}
+			return ops;
+		});
+
+		// The same lookups with keys interned at parse time: each Key caches its number in the document's
+		// KeyTable, so DictNode::find() compares integers instead of strings.
+		std::unique_ptr<RootNode> iroot;
+		phase(corpus, "parse_interned", bytes, [&]() {
+			Parser parser;
+			parser.internKeys = true;
+			iroot.reset(parser.parse(&tdoc));
+			return shape.nodes;
+		});
+		std::vector<std::vector<Key>> leafKeys;
+		for (auto& leafPath : shape.leafPaths) {
+			leafKeys.emplace_back();
+			for (auto& step : leafPath) leafKeys.back().emplace_back(step.key);
+		}
+		phase(corpus, "get_interned", bytes, [&]() {
+			uint64_t ops = 0;
+			for (size_t i = 0; i < shape.leafPaths.size(); i++) {
+				Node* n = iroot.get();
+				for (size_t j = 0; j < leafKeys[i].size(); j++)
+					n = leafKeys[i][j].str().length() ? n->get(leafKeys[i][j]) : n->get(shape.leafPaths[i][j].index);
+				ops += leafKeys[i].size();
+			}
+			return ops;
+		});
+		iroot.reset();
+
+		phase(corpus, "as", bytes, [&]() {
+			uint64_t sum = 0;
+			for (auto s : shape.scalars) {
+				auto lexeme = (*s->tdoc)[s->tokRange.end - 1].lexeme;
+				if (lexeme == Tok::eNumber)
+					sum += (uint64_t)s->as<double>();
+				else
+					sum += s->as<std::string>().length();
+			}
+			volatile uint64_t sink = sum;
+			(void)sink;
+			return (uint64_t)shape.scalars.size();
+		});
+
+		// The same strings, without copying them out of the source.
+		phase(corpus, "as_string_view", bytes, [&]() {
+			uint64_t sum = 0;
+			for (auto s : shape.scalars) sum += s->as<std::string_view>().length();
+			volatile uint64_t sink = sum;
+			(void)sink;
+			return (uint64_t)shape.scalars.size();
+		});
+
+		phase(corpus, "toVector_toMap", bytes, [&]() {
+			uint64_t ops = 0;
+			for (auto l : shape.scalarLists) ops += l->as<std::vector<std::string>>().size();
+			for (auto d : shape.scalarDicts) ops += d->as<Map<std::string>>().size();
+			return ops;
+		});
+
+		phase(corpus, "serialize", bytes, [&]() { return (uint64_t)serialize(root.get()).length(); });
+
+		// Straight from the tree into a small buffer, which is thrown away when full.
+		static char outBuf[64 << 10];
+		auto discard = [](std::string_view) {};
+		phase(corpus, "to_json", bytes, [&]() {
+			OutBuffer out(outBuf, sizeof(outBuf), discard);
+			return (uint64_t)toJson(root.get(), out);
+		});
+		phase(corpus, "to_msgpack", bytes, [&]() {
+			OutBuffer out(outBuf, sizeof(outBuf), discard);
+			return (uint64_t)toMsgPack(root.get(), out);
+		});
+
+		// Looking up the fields of each record, with get() (a scan of the children per field) and with a
+		// compile-time Schema (one pass over the children per record). Converting the values costs the
+		// same either way, so it is left out.
+		if (auto rows = dynamic_cast<const ListNode*>(root->find("rows"))) {
+			const char* keys[] = { "id", "name", "score", "ok", "tags" };
+			phase(corpus, "fields_get", bytes, [&]() {
+				uintptr_t sum = 0;
+				for (auto r : rows->children)
+					for (auto k : keys) sum += (uintptr_t)r->get(k);
+				volatile uintptr_t sink = sum;
+				(void)sink;
+				return (uint64_t)rows->children.size();
+			});
+			phase(corpus, "fields_schema", bytes, [&]() {
+				uintptr_t sum = 0;
+				for (auto r : rows->children) {
+					auto b = rowSchema.bind(r);
+					for (auto n : b.nodes) sum += (uintptr_t)n;
+				}
+				volatile uintptr_t sink = sum;
+				(void)sink;
+				return (uint64_t)rows->children.size();
+			});
+
+			// Decoding the records into a vector of structs, and into one array per field.
+			phase(corpus, "to_vector_rows", bytes, [&]() { return (uint64_t)rows->as<std::vector<Row>>().size(); });
+			phase(corpus, "columns", bytes, [&]() { return (uint64_t)std::get<0>(rowSchema.columns(rows)).size(); });
+
+			Rule row = Rule::dict({ { "id", Rule::integer().range(0, 1e9) }, { "name", Rule::string() },
+			                        { "score", Rule::number() }, { "ok", Rule::boolean() },
+			                        { "tags", Rule::list(Rule::string()).length(0, 8) } })
+			               .closed();
+			phase(corpus, "validate", bytes, [&]() {
+				validate(root.get(), Rule::dict({ { "rows", Rule::list(row) } }));
+				return (uint64_t)rows->children.size();
+			});
+
+			// The same selection with a query (one lock, no per-row lookups by the caller) and with the
+			// loop one would write by hand.
+			Query q("rows[?ok == true].score");
+			auto sum = [](const std::vector<double>& v) {
+				volatile double sink = std::accumulate(v.begin(), v.end(), 0.0);
+				(void)sink;
+				return (uint64_t)v.size();
+			};
+			phase(corpus, "query", bytes, [&]() { return sum(q.values<double>(root.get())); });
+			phase(corpus, "query_loop", bytes, [&]() {
+				std::vector<double> out;
+				for (auto r : rows->children)
+					if (r->get("ok")->as<bool>()) out.push_back(r->get("score")->as<double>());
+				return sum(out);
+			});
+			q.minParallel = 1024;
+			phase(corpus, "query_4_threads", bytes, [&]() { return sum(q.values<double>(root.get(), 4)); });
+
+			// Computing values and writing them back, then reading them again.
+			phase(corpus, "set_as", bytes, [&]() {
+				double total = 0;
+				for (auto r : rows->children) {
+					r->set("score", r->get("id")->as<int64_t>() * 0.5);
+					total += r->get("score")->as<double>();
+				}
+				volatile double sink = total;
+				(void)sink;
+				return (uint64_t)rows->children.size();
+			});
+		}
+	}
+
+	// A dict of `bytes` worth of small records, like an inventory.
+	std::string makeRecords(size_t bytes) {
+		const char* words[] = { "the", "lazy", "brown", "fox", "jumped", "over", "whatever" };
+		std::string out;
+		out.reserve(bytes + 256);
+		char buf[256];
+		for (uint32_t i = 0; out.length() < bytes; i++) {
+			snprintf(buf, sizeof(buf),
+			         "k%08u:\n    name: \"%s\"\n    weight: %u.5\n    enabled: %s\n    ports: [%u, %u, %u]\n",
+			         i, words[i % 7], i % 1000, i % 3 ? "true" : "false", i % 65536, (i * 7) % 65536,
+			         (i * 13) % 65536);
+			out += buf;
+		}
+		return out;
+	}
+
+	void benchDiff(size_t mb) {
+		std::string src = makeRecords(mb << 20);
+
+		// Change a single line in the middle.
+		std::string src2 = src;
+		size_t at        = src2.find("weight: ", src2.length() / 2) + 8;
+		src2[at]         = src2[at] == '9' ? '8' : '9';
+
+		std::string corpus = "records_" + std::to_string(mb) + "MB_one_line_changed";
+		std::unique_ptr<ParsedDocument> a, b;
+		phase(corpus, "parse", src.length(), [&]() {
+			a = std::make_unique<ParsedDocument>(src);
+			return (uint64_t)1;
+		});
+		b = std::make_unique<ParsedDocument>(src2);
+
+		std::vector<DiffEntry> d;
+		phase(corpus, "diff", src.length(), [&]() {
+			d = diff(a->root.get(), b->root.get());
+			return (uint64_t)d.size();
+		});
+		phase(corpus, "hash", src.length() * 2, [&]() {
+			a->root->hash(), b->root->hash();
+			return (uint64_t)2;
+		});
+		phase(corpus, "diff_cached_hashes", src.length(), [&]() {
+			d = diff(a->root.get(), b->root.get());
+			return (uint64_t)d.size();
+		});
+		phase(corpus, "serialize_and_compare", src.length(), [&]() {
+			return (uint64_t)(serialize(a->root.get()) == serialize(b->root.get()));
+		});
+	}
+
+	// Checking every record against a rule, in one walk, should cost well under parsing it.
+	void benchValidate(size_t mb) {
+		std::string src    = makeRecords(mb << 20);
+		std::string corpus = "records_" + std::to_string(mb) + "MB";
+		std::unique_ptr<ParsedDocument> a;
+		phase(corpus, "parse", src.length(), [&]() {
+			a = std::make_unique<ParsedDocument>(src);
+			return (uint64_t)1;
+		});
+
+		Rule record = Rule::dict({ { "name", Rule::string().oneOf({ "the", "lazy", "brown", "fox", "jumped", "over", "whatever" }) },
+		                           { "weight", Rule::number().range(0, 1000) },
+		                           { "enabled", Rule::boolean() },
+		                           { "ports", Rule::list(Rule::integer().range(0, 65535)).length(1, 8) } })
+		                  .closed();
+		phase(corpus, "validate", src.length(), [&]() {
+			return (uint64_t)validate(a->root.get(), Rule::map(record)).size();
+		});
+	}
+
+	// Selecting nodes with a query and with a loop, where the cost is the walk and the locking; and
+	// converting them too, where as<int>() costs most of the time.
+	void benchQuery(size_t mb) {
+		std::string src    = makeRecords(mb << 20);
+		std::string corpus = "records_" + std::to_string(mb) + "MB";
+		ParsedDocument a(src);
+
+		Query ports("[?enabled == true].ports[*]");
+		phase(corpus, "query_nodes", src.length(), [&]() { return (uint64_t)ports.nodes(a.root.get()).size(); });
+		phase(corpus, "query_nodes_loop", src.length(), [&]() {
+			std::vector<const Node*> out;
+			for (auto& kv : a.root->asDict()->children)
+				if (kv.second->get("enabled")->as<std::string_view>() == "true")
+					for (auto p : kv.second->get("ports")->asList()->children) out.push_back(p);
+			return (uint64_t)out.size();
+		});
+		phase(corpus, "query_nodes_4_threads", src.length(), [&]() { return (uint64_t)ports.nodes(a.root.get(), 4).size(); });
+		phase(corpus, "query", src.length(), [&]() { return (uint64_t)ports.values<int>(a.root.get()).size(); });
+		phase(corpus, "query_loop", src.length(), [&]() {
+			std::vector<int> out;
+			for (auto& kv : a.root->asDict()->children)
+				if (kv.second->get("enabled")->as<bool>())
+					for (auto p : kv.second->get("ports")->asList()->children) out.push_back(p->as<int>());
+			return (uint64_t)out.size();
+		});
+	}
+
+	// 10000 keys spread over the first `records` records of makeRecords().
+	std::vector<std::string> overrideKeys(size_t records) {
+		std::vector<std::string> keys;
+		char key[16];
+		for (size_t i = 0; i < 10000; i++) {
+			snprintf(key, sizeof(key), "k%08u", (unsigned)(i * 7919 % records));
+			keys.push_back(key);
+		}
+		return keys;
+	}
+
+	// Applying overrides to 4MB of records, each with set() (a scan of the big dict per change) and
+	// all in one Batch.
+	void benchBatch() {
+		std::string small = makeRecords(4 << 20);
+		ParsedDocument viaSet(small), viaBatch(small);
+		auto keys          = overrideKeys(viaSet.root->children.size());
+		std::string corpus = "records_4MB_10000_overrides";
+		phase(corpus, "set_loop", small.length(), [&]() {
+			for (size_t i = 0; i < keys.size(); i++) viaSet.root->get(keys[i].c_str())->set("weight", (int)i);
+			return (uint64_t)keys.size();
+		});
+		phase(corpus, "batch", small.length(), [&]() {
+			Batch batch(viaBatch.root.get());
+			for (size_t i = 0; i < keys.size(); i++) batch.set(keys[i] + ".weight", (int)i);
+			batch.commit();
+			return (uint64_t)keys.size();
+		});
+		if (viaSet.root->hash() != viaBatch.root->hash()) fprintf(stderr, "set() and Batch disagree\n");
+	}
+
+	// The overrides of benchBatch() as a second document on top of the records, merged by set() calls
+	// for each of their values, and with an Overlay.
+	void benchOverlay() {
+		std::string small = makeRecords(4 << 20);
+		auto base         = std::make_shared<ParsedDocument>(small);
+		auto keys         = overrideKeys(base->root->children.size());
+		std::string overrides;
+		for (size_t i = 0; i < keys.size(); i++) overrides += keys[i] + ":\n    weight: " + std::to_string(i) + "\n";
+		auto layer = std::make_shared<ParsedDocument>(overrides);
+		ParsedDocument merged(small);
+		std::string corpus = "records_4MB_10000_overrides";
+		phase(corpus, "merge_by_set", small.length(), [&]() {
+			for (auto& kv : layer->root->children)
+				for (auto& field : kv.second->asDict()->children)
+					merged.root->get(kv.first.c_str())->set(field.first.c_str(), field.second->as<std::string>());
+			return (uint64_t)layer->root->children.size();
+		});
+		// Reading through the overlay costs a lookup per layer: with dicts this big, as much as get() on
+		// each of them.
+		phase(corpus, "merged_get", small.length(), [&]() {
+			double sum = 0;
+			for (auto& k : keys) sum += merged.root->get(k.c_str())->get("weight")->as<double>();
+			volatile double sink = sum;
+			(void)sink;
+			return (uint64_t)keys.size();
+		});
+		Overlay overlay;
+		overlay.push(base).push(layer);
+		phase(corpus, "overlay_get", small.length(), [&]() {
+			double sum = 0;
+			for (auto& k : keys) sum += overlay.get(k.c_str()).get("weight").as<double>();
+			volatile double sink = sum;
+			(void)sink;
+			return (uint64_t)keys.size();
+		});
+		phase(corpus, "overlay_flatten", small.length(), [&]() { return (uint64_t)overlay.flatten()->children.size(); });
+	}
+
+	// A file included from 200 places, pasted in by a textual preprocessor and parsed whole, and
+	// with `!include`, which parses it once and copies its nodes once per document. While a document
+	// holding it is alive, further documents only copy.
+	void benchInclude() {
+		auto dir = std::filesystem::temp_directory_path() / "syaml_bench_include";
+		std::filesystem::create_directories(dir);
+		std::string shared = makeRecords(64 << 10);
+		std::ofstream((dir / "shared.yaml").string()) << shared;
+		std::string indented, including, pasted;
+		for (size_t i = 0, j; i < shared.length(); i = j + 1) {
+			j = shared.find('\n', i);
+			indented += "    " + shared.substr(i, j - i + 1);
+		}
+		for (int i = 0; i < 200; i++) {
+			std::string key = "i" + std::to_string(i) + ":";
+			including += key + " !include \"shared.yaml\"\n";
+			pasted += key + "\n" + indented;
+		}
+		auto expansion     = std::make_shared<Expansion>();
+		std::string main   = (dir / "main.yaml").string();
+		std::string corpus = "records_64KB_included_200_times";
+		phase(corpus, "textual_include", pasted.length(), [&]() {
+			return (uint64_t)ParsedDocument(pasted).root->children.size();
+		});
+		phase(corpus, "include", pasted.length(), [&]() {
+			return (uint64_t)ParsedDocument(including, expansion, main).root->children.size();
+		});
+		ParsedDocument held(including, expansion, main);
+		phase(corpus, "include_cached", pasted.length(), [&]() {
+			return (uint64_t)ParsedDocument(including, expansion, main).root->children.size();
+		});
+		if (held.root->hash() != ParsedDocument(pasted).root->hash()) fprintf(stderr, "!include and pasting disagree\n");
+		std::filesystem::remove_all(dir);
+	}
+
+	// Lists of `count` numbers of one form each, converted one value at a time by the standard library
+	// and by the list at once. "stringstream" is what as<double>() used to do per value.
+	void benchNumbers(size_t count) {
+		uint64_t state = 1;
+		auto next      = [&]() { return state = state * 6364136223846793005ull + 1442695040888963407ull, state >> 33; };
+		struct Form {
+			const char* name;
+			std::function<std::string()> make;
+		};
+		char buf[64];
+		Form forms[] = {
+			{ "ints", [&]() { return std::to_string((int64_t)(next() % 2000000) - 1000000); } },
+			{ "short_decimals", [&]() { return std::to_string(next() % 1000000) + "." + std::to_string(next() % 100); } },
+			{ "long_mantissas", [&]() {
+				 snprintf(buf, sizeof(buf), "%.17g", (double)next() / (1 + next() % 1000) * 1e-3);
+				 return std::string { buf };
+			 } },
+		};
+		for (auto& form : forms) {
+			std::string src = "l:\n";
+			for (size_t i = 0; i < count; i++) src += "  - " + form.make() + "\n";
+			ParsedDocument d(src);
+			auto list = d.root->get("l")->asList();
+			std::vector<std::string_view> texts;
+			for (auto c : list->children) texts.push_back(dynamic_cast<const ScalarNode*>(c)->sourceText());
+			uint64_t bytes = 0;
+			for (auto t : texts) bytes += t.size();
+
+			std::string corpus = std::string { "numbers_" } + form.name + "_" + std::to_string(count);
+			std::vector<double> doubles(count);
+			auto sink = [&]() {
+				volatile double sum = std::accumulate(doubles.begin(), doubles.end(), 0.0);
+				(void)sum;
+				return (uint64_t)count;
+			};
+			phase(corpus, "stringstream", bytes, [&]() {
+				for (size_t i = 0; i < count; i++) std::stringstream { std::string { texts[i] } } >> doubles[i];
+				return sink();
+			});
+			phase(corpus, "strtod", bytes, [&]() {
+				for (size_t i = 0; i < count; i++) doubles[i] = strtod(texts[i].data(), nullptr); // the source is NUL-terminated
+				return sink();
+			});
+			phase(corpus, "from_chars", bytes, [&]() {
+				for (size_t i = 0; i < count; i++) std::from_chars(texts[i].data(), texts[i].data() + texts[i].size(), doubles[i]);
+				return sink();
+			});
+			phase(corpus, "as_double", bytes, [&]() {
+				for (size_t i = 0; i < count; i++) doubles[i] = list->children[i]->as<double>();
+				return sink();
+			});
+			phase(corpus, "to_numbers_double", bytes, [&]() {
+				list->toNumbers(doubles.data());
+				return sink();
+			});
+			phase(corpus, "as_vector_double", bytes, [&]() {
+				doubles = d.root->get("l")->as<std::vector<double>>();
+				return sink();
+			});
+			if (form.name == std::string { "ints" }) {
+				std::vector<int64_t> ints(count);
+				phase(corpus, "from_chars_int64", bytes, [&]() {
+					for (size_t i = 0; i < count; i++) std::from_chars(texts[i].data(), texts[i].data() + texts[i].size(), ints[i]);
+					return (uint64_t)ints.size();
+				});
+				phase(corpus, "to_numbers_int64", bytes, [&]() {
+					list->toNumbers(ints.data());
+					return (uint64_t)ints.size();
+				});
+			} else {
+				std::vector<float> floats(count);
+				phase(corpus, "to_numbers_float", bytes, [&]() {
+					list->toNumbers(floats.data());
+					return (uint64_t)floats.size();
+				});
+			}
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	std::vector<std::string> corpora;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "-o" and i + 1 < argc) {
+			results = fopen(argv[++i], "w");
+			if (!results) {
+				perror("fopen");
+				return 1;
+			}
+		} else if (arg == "--diff" and i + 1 < argc) {
+			benchDiff(atoi(argv[++i]));
+		} else if (arg == "--validate" and i + 1 < argc) {
+			benchValidate(atoi(argv[++i]));
+		} else if (arg == "--query" and i + 1 < argc) {
+			benchQuery(atoi(argv[++i]));
+		} else if (arg == "--batch") {
+			benchBatch();
+		} else if (arg == "--overlay") {
+			benchOverlay();
+		} else if (arg == "--include") {
+			benchInclude();
+		} else if (arg == "--numbers" and i + 1 < argc) {
+			benchNumbers(atoi(argv[++i]));
+		} else if (std::filesystem::is_directory(arg)) {
+			for (auto& f : std::filesystem::directory_iterator(arg))
+				if (f.path().extension() == ".yaml") corpora.push_back(f.path().string());
+		} else {
+			corpora.push_back(arg);
+		}
+	}
+	std::sort(corpora.begin(), corpora.end());
+	for (auto& c : corpora) benchCorpus(c);
+	if (results != stdout) fclose(results);
+	return 0;
+}
@@ -1,12 +1,25 @@
-import yaml, random
+import yaml, json, random, argparse, os
 
 words = 'the lazy brown fox jumped over the whatever'.split(' ')
 
-def generate(maxDepth, fanout):
+# Weights of each kind of scalar, and of dict/list/scalar values, for each corpus shape.
+shapes = {
+    #            true false int float word quoted   dict list scalar  maxDepth fanout
+    'random':  ((1, 1, 5, 3, 6, 0),                 (1, 1, 1),        3, 8),
+    'deep':    ((1, 1, 5, 3, 6, 0),                 (4, 1, 1),        12, 3),
+    'wide':    ((1, 1, 5, 3, 6, 0),                 (1, 1, 8),        1, 64),
+    'lists':   ((1, 1, 5, 3, 6, 0),                 (1, 6, 1),        3, 8),
+    'strings': ((0, 0, 1, 0, 4, 12),                (1, 1, 4),        3, 8),
+    'numbers': ((0, 0, 8, 8, 1, 0),                 (1, 2, 4),        3, 8),
+}
+
+def generate(maxDepth, fanout, shape='random'):
     d = {}
 
     _k = 'a'
 
+    scalarWeights, valueWeights = shapes[shape][:2]
+
     def nextKey():
         nonlocal _k
         if _k[-1] == 'z':
@@ -16,12 +29,13 @@ def generate(maxDepth, fanout):
         return _k
 
     def nextScalar(_):
-        r = (random.randint(0, 15))
+        r = random.choices(range(6), scalarWeights)[0]
         if r == 0: return True
         if r == 1: return False
-        if r>=2 and r<7: return random.randint(0,1000)
-        if r>=7 and r<10: return random.randint(0,100) * 10324.
-        if r>=10: return random.choice(words)
+        if r == 2: return random.randint(0,1000)
+        if r == 3: return random.randint(0,100) * 10324.
+        if r == 4: return random.choice(words)
+        if r == 5: return Quoted(' '.join(random.choices(words, k=random.randint(1, 12))))
 
     def nextDict(lvl):
         out = {}
@@ -33,7 +47,7 @@ def generate(maxDepth, fanout):
             if lvl == maxDepth:
                 v = nextScalar(lvl+1)
             else:
-                r = (random.randint(0, 2))
+                r = random.choices(range(3), valueWeights)[0]
                 if r == 0: v = nextDict(lvl+1)
                 if r == 1: v = nextList(lvl+1)
                 if r == 2: v = nextScalar(lvl+1)
@@ -50,7 +64,7 @@ def generate(maxDepth, fanout):
             if lvl == maxDepth:
                 v = nextScalar(lvl+1)
             else:
-                r = (random.randint(0, 1))
+                r = random.choices(range(2), valueWeights[1:])[0]
                 if r == 0: v = nextList(lvl+1)
                 if r == 1: v = nextScalar(lvl+1)
             out.append(v)
@@ -59,8 +73,121 @@ def generate(maxDepth, fanout):
 
     return nextDict(0)
 
-# print(generate(3, 8))
-for i in range(5):
-    with open(f'test{i:}.yaml', 'w') as fp:
-        d = generate(3,8)
-        yaml.dump(d, fp)
+class Quoted(str):
+    pass
+
+# Write in the style this parser supports: block dicts, dash lists of scalars, and flow lists otherwise.
+def emit(fp, v, indent=0):
+    def scalar(x):
+        if x is True: return 'true'
+        if x is False: return 'false'
+        if isinstance(x, Quoted): return '"' + x + '"'
+        return str(x)
+    def flow(x):
+        if isinstance(x, list): return '[' + ', '.join(flow(y) for y in x) + ']'
+        return scalar(x)
+
+    pad = ' ' * indent
+    for k, x in v.items():
+        if isinstance(x, dict) and x:
+            fp.write(f'{pad}{k}:\n')
+            emit(fp, x, indent + 2)
+        elif isinstance(x, dict):
+            fp.write(f'{pad}{k}: {{}}\n')
+        elif isinstance(x, list) and x and not any(isinstance(y, list) for y in x):
+            fp.write(f'{pad}{k}:\n')
+            for y in x: fp.write(f'{pad}  - {scalar(y)}\n')
+        elif isinstance(x, list):
+            fp.write(f'{pad}{k}: {flow(x)}\n')
+        else:
+            fp.write(f'{pad}{k}: {scalar(x)}\n')
+
+# Write one line per leaf of `v`, as `path<TAB>kind<TAB>value`, for the differential runner in fuzz.cc.
+# Paths look like `a.b[2].c`. Empty dicts and lists are leaves with kind `dict` or `list`.
+def writeExpected(fp, v, path=''):
+    if isinstance(v, dict) and v:
+        for k, x in v.items(): writeExpected(fp, x, f'{path}.{k}' if path else k)
+    elif isinstance(v, list) and v:
+        for i, x in enumerate(v): writeExpected(fp, x, f'{path}[{i}]')
+    elif isinstance(v, dict): fp.write(f'{path}\tdict\t\n')
+    elif isinstance(v, list): fp.write(f'{path}\tlist\t\n')
+    elif v is None: fp.write(f'{path}\tnull\t\n')
+    elif isinstance(v, bool): fp.write(f'{path}\tbool\t{"true" if v else "false"}\n')
+    elif isinstance(v, int): fp.write(f'{path}\tint\t{v}\n')
+    elif isinstance(v, float): fp.write(f'{path}\tfloat\t{v!r}\n')
+    else: fp.write(f'{path}\tstr\t{v}\n')
+
+def parseSize(s):
+    units = {'KB': 1 << 10, 'MB': 1 << 20, 'GB': 1 << 30}
+    for u, m in units.items():
+        if s.upper().endswith(u): return int(float(s[:-2]) * m)
+    return int(s)
+
+# Compact rows as flow maps in one long list, like a table dumped by a producer.
+def writeRows(fp, size):
+    fp.write('rows:\n')
+    i = 0
+    while fp.tell() < size:
+        tags = ', '.join(random.choices(words, k=random.randint(0, 3)))
+        fp.write(f'  - {{id: {i}, name: {random.choice(words)}, score: {random.randint(0, 100) * 10324.}, '
+                 f'ok: {random.choice(["true", "false"])}, tags: [{tags}]}}\n')
+        i += 1
+
+# One JSON object of generated documents, one per line, like an API response or a dumped config.
+def writeJson(fp, size):
+    fp.write('{\n')
+    i = 0
+    while fp.tell() < size:
+        fp.write((',\n' if i else '') + f'  "n{i:08d}": ' + json.dumps(generate(3, 8)))
+        i += 1
+    fp.write('\n}\n')
+
+# Write a corpus file of about `size` bytes, made of generated documents under distinct top-level keys.
+def writeCorpus(path, shape, size):
+    if shape == 'rows':
+        with open(path, 'w') as fp: writeRows(fp, size)
+        return
+    if shape == 'json':
+        with open(path, 'w') as fp: writeJson(fp, size)
+        return
+    _, _, maxDepth, fanout = shapes[shape]
+    with open(path, 'w') as fp:
+        i = 0
+        while fp.tell() < size:
+            fp.write(f'n{i:08d}:\n')
+            emit(fp, generate(maxDepth, fanout, shape), 2)
+            i += 1
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-o', '--out', default='.')
+    parser.add_argument('--bench-corpus', action='store_true', help='write benchmark corpora instead of tests')
+    parser.add_argument('--shapes', default=','.join(list(shapes.keys()) + ['rows', 'json']))
+    parser.add_argument('--sizes', default='1KB,1MB,32MB', help='like 1KB,64MB,1GB')
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--count', type=int, default=5, help='number of test documents of each style')
+    args = parser.parse_args()
+
+    if args.bench_corpus:
+        random.seed(args.seed)
+        for shape in args.shapes.split(','):
+            for size in args.sizes.split(','):
+                path = os.path.join(args.out, f'corpus_{shape}_{size}.yaml')
+                print(' - writing', path)
+                writeCorpus(path, shape, parseSize(size))
+    else:
+        # Documents dumped by pyyaml (which uses some styles this parser does not support yet), and the
+        # same kind of documents in the style it does support. Each has a .expected file next to it.
+        random.seed(args.seed)
+        for i in range(args.count):
+            d = generate(3,8)
+            with open(os.path.join(args.out, f'test{i:}.yaml'), 'w') as fp:
+                yaml.dump(d, fp)
+            with open(os.path.join(args.out, f'test{i:}.expected'), 'w') as fp:
+                writeExpected(fp, d)
+
+            d = generate(3, 8, random.choice(list(shapes.keys())))
+            with open(os.path.join(args.out, f'block{i:}.yaml'), 'w') as fp:
+                emit(fp, d)
+            with open(os.path.join(args.out, f'block{i:}.expected'), 'w') as fp:
+                writeExpected(fp, d)
@@ -0,0 +1,345 @@
+// Fuzzing and differential testing.
+//
+// With libFuzzer (clang only), this is a fuzz target:
+//
+//      clang++ -std=c++17 -g -O1 -fsanitize=fuzzer,address -DSYAML_LIBFUZZER -I. fuzz.cc compile_implementation.cc
+//      ./a.out -max_len=4096 -timeout=2 corpusDir/
+//
+// Otherwise it is a runner over the documents written by `create_tests.py`:
+//
+//      ./fuzz [--strict] [--mutations N] [files or directories...]
+//
+// For each .yaml file it
+//      o parses it, and compares every leaf against the .expected file next to it (if there is one),
+//      o checks that parse time grows linearly when the document is repeated 8 times, to catch
+//        pathological backtracking in tryDict/tryListFromDash,
+//      o runs N random byte-level mutations of it through the fuzz target (with --mutations). If one of
+//        them crashes, it is left in fuzz_input.yaml.
+// Parse errors are reported but only fail the run with --strict, since the generated documents use
+// some styles this parser does not support yet. Mismatches, crashes and slow inputs always fail it.
+
+#include "yaml_parse.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <unordered_set>
+
+using namespace syaml;
+
+namespace {
+
+	// Run one input through everything a user might do with it. Only std::runtime_error is expected;
+	// any other exception, assertion or sanitizer report is a bug.
+	void fuzzOne(const std::string& src) {
+		if (src.empty()) return;
+
+		// Where parseJson() and parse() both accept a document, they must build the same tree.
+		Document jdoc(src);
+		TokenizedDoc jtdoc;
+		jtdoc.doc = &jdoc;
+		std::unique_ptr<RootNode> json;
+		try {
+			json.reset(Parser {}.parseJson(&jtdoc));
+		} catch (std::runtime_error&) {}
+
+		try {
+			Document doc(src);
+			TokenizedDoc tdoc = lex(&doc);
+			std::unique_ptr<RootNode> root(Parser {}.parse(&tdoc));
+			if (json and (json->hash() != root->hash() or serialize(json.get()) != serialize(root.get()))) abort();
+			serialize(root.get());
+			root->hash();
+
+			// The JSON written for any tree must parse as JSON.
+			std::string out;
+			char buf[16];
+			OutBuffer ob(buf, sizeof(buf), [&](std::string_view s) { out += s; });
+			toJson(root.get(), ob);
+			Document outDoc(out);
+			TokenizedDoc outTdoc;
+			outTdoc.doc = &outDoc;
+			try {
+				delete Parser {}.parseJson(&outTdoc);
+			} catch (std::runtime_error&) {
+				abort();
+			}
+			OutBuffer mp(buf, sizeof(buf), [](std::string_view) {});
+			toMsgPack(root.get(), mp);
+			static const Rule rule = Rule::map(Rule::list(Rule::number().range(0, 9)).length(1, 2));
+			static const Rule keys = Rule::dict({ { "a", Rule::boolean().optional() }, { "b", Rule::string().oneOf({ "x" }) } }).closed();
+			validate(root.get(), rule);
+			validate(root.get(), keys);
+			static const Query queries[] = { Query("*.*[?@ > 1]"), Query("[*][?a == 'x'][-1]"), Query("[?b][0].*") };
+			for (auto& q : queries) q.nodes(root.get());
+			try {
+				Query(std::string_view { src }.substr(0, 64)).nodes(root.get());
+			} catch (std::runtime_error&) {}
+
+			// Nodes shared through aliases are only visited once, or a few aliases would take forever.
+			std::unordered_set<const Node*> seen;
+			std::function<void(const Node*)> visit = [&](const Node* n) {
+				if (not seen.insert(n).second) return;
+				if (auto d = dynamic_cast<const DictNode*>(n)) {
+					for (auto& kv : d->children) {
+						d->get(kv.first.c_str());
+						visit(kv.second);
+					}
+				} else if (auto l = dynamic_cast<const ListNode*>(n)) {
+					for (uint32_t i = 0; i < l->children.size(); i++) visit(l->get(i));
+				} else if (dynamic_cast<const ScalarNode*>(n)) {
+					n->as<std::string>();
+					try {
+						n->as<double>();
+					} catch (std::runtime_error&) {}
+				}
+			};
+			visit(root.get());
+
+			// Variables are replaced when read, and written out as they were. Tags are left out, since
+			// includes would read whatever files the input names.
+			if (src.find('!') == std::string::npos) {
+				static auto expansion = [] {
+					auto e       = std::make_shared<Expansion>();
+					e->variables = [](std::string_view name) -> std::optional<std::string> {
+						if (name.size() % 2) return std::string { name };
+						return std::nullopt;
+					};
+					return e;
+				}();
+				ParsedDocument expanded(src, expansion);
+				if (serialize(expanded.root.get()) != serialize(root.get())) abort();
+				try {
+					expanded.root->hash();
+					visit(expanded.root.get());
+				} catch (std::runtime_error&) {}
+			}
+
+			// Changes in a batch, to whatever shape the tree has, must leave a tree that writes out.
+			seen.clear();
+			try {
+				Batch(root.get()).set("a.b", 1).append("c", std::vector<int> { 2 }).set("[0]", 3).commit();
+			} catch (std::runtime_error&) {}
+			serialize(root.get());
+			visit(root.get());
+
+			// Stacking a document on itself again changes nothing. (Flattening two copies isn't quite the
+			// document: merged dicts keep only the first of duplicate keys.)
+			auto layer = std::make_shared<ParsedDocument>(src, ParsedDocument::eYaml);
+			Overlay overlay;
+			overlay.push(layer).push(layer);
+			uint64_t twice = overlay.flatten()->hash();
+			if (overlay.push(layer).flatten()->hash() != twice) abort();
+		} catch (std::runtime_error&) {}
+	}
+
+}
+
+#ifdef SYAML_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	// The parser prints where it failed to std::cout, which would swamp the fuzzer's output.
+	static bool silenced = (std::cout.rdbuf(nullptr), true);
+	(void)silenced;
+	fuzzOne(std::string { (const char*)data, size });
+	return 0;
+}
+
+#else
+
+namespace {
+
+	std::string readFile(const std::string& path) {
+		std::ifstream ifs(path);
+		std::stringstream ss;
+		ss << ifs.rdbuf();
+		return ss.str();
+	}
+
+	// Leaves of the tree by path, like `a.b[2].c`. Empty containers count as leaves.
+	void flatten(const Node* n, const std::string& path, std::map<std::string, const Node*>& out) {
+		if (auto d = dynamic_cast<const DictNode*>(n); d and d->children.size()) {
+			for (auto& kv : d->children) flatten(kv.second, path.empty() ? kv.first : path + "." + kv.first, out);
+		} else if (auto l = dynamic_cast<const ListNode*>(n); l and l->children.size()) {
+			for (uint32_t i = 0; i < l->children.size(); i++)
+				flatten(l->children[i], path + "[" + std::to_string(i) + "]", out);
+		} else {
+			out[path] = n;
+		}
+	}
+
+	// Why `n` does not hold `value` of `kind` (as written by create_tests.py), or "" if it does.
+	std::string compareLeaf(const Node* n, const std::string& kind, const std::string& value) {
+		try {
+			if (kind == "dict" or kind == "list" or kind == "null") {
+				// `key:` with nothing after it is an EmptyNode, which is how this parser spells all three.
+				if (n->isEmpty()) return "";
+				if (kind == "dict" and dynamic_cast<const DictNode*>(n)) return "";
+				if (kind == "list" and dynamic_cast<const ListNode*>(n)) return "";
+				return "expected an empty " + kind;
+			}
+			if (not dynamic_cast<const ScalarNode*>(n)) return "expected a scalar";
+			if (kind == "bool") return n->as<bool>() == (value == "true") ? "" : "got " + n->as<std::string>();
+			if (kind == "int") return n->as<int64_t>() == std::stoll(value) ? "" : "got " + n->as<std::string>();
+			if (kind == "float") {
+				double a = n->as<double>(), b = std::stod(value);
+				return std::abs(a - b) <= 1e-9 * std::max(1., std::abs(b)) ? "" : "got " + n->as<std::string>();
+			}
+			return n->as<std::string>() == value ? "" : "got '" + n->as<std::string>() + "'";
+		} catch (std::runtime_error& e) {
+			return std::string { "threw: " } + e.what();
+		}
+	}
+
+	// Number of mismatches between `root` and the .expected file `expectedPath`.
+	int compareExpected(const RootNode* root, const std::string& file, const std::string& expectedPath) {
+		std::map<std::string, const Node*> leaves;
+		flatten(root, "", leaves);
+
+		int mismatches = 0;
+		auto mismatch  = [&](const std::string& path, const std::string& why) {
+			if (mismatches++ < 10)
+				fprintf(stderr, " - %s: mismatch at '%s': %s\n", file.c_str(), path.c_str(), why.c_str());
+		};
+
+		std::ifstream ifs(expectedPath);
+		std::string line;
+		size_t expectedLeaves = 0;
+		while (std::getline(ifs, line)) {
+			auto t0 = line.find('\t'), t1 = line.find('\t', t0 + 1);
+			if (t0 == std::string::npos or t1 == std::string::npos) continue;
+			std::string path = line.substr(0, t0), kind = line.substr(t0 + 1, t1 - t0 - 1), value = line.substr(t1 + 1);
+			expectedLeaves++;
+			auto it = leaves.find(path);
+			if (it == leaves.end())
+				mismatch(path, "missing");
+			else if (auto why = compareLeaf(it->second, kind, value); why.size())
+				mismatch(path, why);
+		}
+		if (leaves.size() != expectedLeaves)
+			mismatch("", std::to_string(leaves.size()) + " leaves, expected " + std::to_string(expectedLeaves));
+		return mismatches;
+	}
+
+	// Best time, in ms, to lex and parse `src`, out of runs adding up to at least ~20ms.
+	double parseMs(const std::string& src) {
+		double best = 1e30, total = 0;
+		for (int i = 0; i < 100 and (i < 3 or total < 20); i++) {
+			Document doc(src);
+			auto t0           = std::chrono::steady_clock::now();
+			TokenizedDoc tdoc = lex(&doc);
+			delete Parser {}.parse(&tdoc);
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+			best      = std::min(best, ms);
+			total += ms;
+		}
+		return best;
+	}
+
+	// `src` repeated `k` times, each copy indented under its own key.
+	std::string repeated(const std::string& src, int k) {
+		std::string indented = "  ";
+		for (char c : src) {
+			indented += c;
+			if (c == '\n') indented += "  ";
+		}
+		if (indented.back() != '\n') indented += '\n';
+		std::string out;
+		for (int i = 0; i < k; i++) out += "r" + std::to_string(i) + ":\n" + indented;
+		return out;
+	}
+
+	// Apply a few random byte edits, biased towards the characters the lexer cares about.
+	std::string mutate(std::string s, std::mt19937& rng) {
+		static const char interesting[] = " \t\n:-[],\"#{}.e0aZ&*<|>+\\";
+		int edits = 1 + rng() % 4;
+		for (int e = 0; e < edits; e++) {
+			size_t at = s.empty() ? 0 : rng() % s.size();
+			char c    = rng() % 4 ? interesting[rng() % (sizeof(interesting) - 1)] : (char)(rng() % 256);
+			switch (rng() % 4) {
+				case 0: if (s.size()) s[at] = c; break;
+				case 1: s.insert(s.begin() + at, c); break;
+				case 2: if (s.size()) s.erase(at, 1 + rng() % 8); break;
+				case 3: if (s.size()) s.insert(at, s.substr(rng() % s.size(), 1 + rng() % 32)); break;
+			}
+		}
+		return s;
+	}
+
+}
+
+int main(int argc, char** argv) {
+	bool strict   = false;
+	int mutations = 0;
+	std::vector<std::string> files;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--strict") {
+			strict = true;
+		} else if (arg == "--mutations" and i + 1 < argc) {
+			mutations = atoi(argv[++i]);
+		} else if (std::filesystem::is_directory(arg)) {
+			for (auto& f : std::filesystem::directory_iterator(arg))
+				if (f.path().extension() == ".yaml") files.push_back(f.path().string());
+		} else {
+			files.push_back(arg);
+		}
+	}
+	std::sort(files.begin(), files.end());
+
+	// The parser prints where it failed to std::cout. We report to stderr.
+	auto coutBuf = std::cout.rdbuf(nullptr);
+
+	int parseErrors = 0, mismatched = 0, slow = 0, compared = 0;
+	std::mt19937 rng(0);
+	for (auto& file : files) {
+		std::string src = readFile(file);
+		if (src.empty()) continue;
+
+		std::unique_ptr<RootNode> root;
+		Document doc(src);
+		try {
+			TokenizedDoc tdoc = lex(&doc);
+			root.reset(Parser {}.parse(&tdoc));
+
+			auto expectedPath = std::filesystem::path(file).replace_extension(".expected");
+			if (std::filesystem::exists(expectedPath)) {
+				compared++;
+				if (compareExpected(root.get(), file, expectedPath.string())) mismatched++;
+			}
+		} catch (std::runtime_error& e) {
+			fprintf(stderr, " - %s: parse error: %s\n", file.c_str(), e.what());
+			parseErrors++;
+		}
+
+		// Only time documents that parse, and that are big enough to time.
+		if (root and src.size() >= 256 and src.size() <= (16 << 20)) {
+			double t1 = parseMs(src), t8 = parseMs(repeated(src, 8));
+			if (t8 > 4 * 8 * t1) {
+				fprintf(stderr, " - %s: superlinear: %.3fms for %zu bytes, %.3fms repeated 8 times\n", file.c_str(),
+				        t1, src.size(), t8);
+				slow++;
+			}
+		}
+
+		// Keep the current mutation on disk, so a crash leaves behind the input that caused it.
+		for (int i = 0; i < mutations; i++) {
+			std::string input = mutate(src, rng);
+			std::ofstream("fuzz_input.yaml") << input;
+			fuzzOne(input);
+		}
+	}
+	if (mutations) std::filesystem::remove("fuzz_input.yaml");
+
+	std::cout.rdbuf(coutBuf);
+	fprintf(stderr, "%zu files: %d compared with expected, %d mismatched, %d parse errors, %d superlinear, %d mutations each\n",
+	        files.size(), compared, mismatched, parseErrors, slow, mutations);
+	return (mismatched or slow or (strict and parseErrors)) ? 1 : 0;
+}
+
+#endif
@@ -5,7 +5,13 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <climits>
+#include <thread>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #define KNRM "\x1B[0m"
 #define KRED "\x1B[31m"
@@ -41,6 +47,26 @@ namespace syaml {
 	};
 }
 
+// The same with a compile-time schema, which looks up all the fields in one pass over the dict.
+struct Server {
+	std::string host;
+	int port;
+	double timeout;
+};
+
+namespace syaml {
+	template <> struct Decode<Server> : FromKey {
+		static constexpr Schema schema { Field<std::string> { "host" }, Field<int> { "port" },
+		                                 Field<double> { "timeout", false } };
+		static Server decode(const DictNode* d) {
+			auto b = schema.bind_(d);
+			if (!b.ok()) throw std::runtime_error(b.error());
+			return { schema.as_<0>(b), schema.as_<1>(b), schema.as_<2>(b, 30.) };
+		}
+	};
+}
+static_assert(Decode<Server>::schema.indexOf("port") == 1 and Decode<Server>::schema.indexOf("nope") == -1);
+
 /*
 bool test_python_files(const std::string &dir) {
 
@@ -149,6 +175,9 @@ bool test_simple() {
 		check("myThing.x", myThing.x == 1);
 		check("myThing.y", myThing.y == 2);
 
+		auto myThingMap = root->get("myThing")->as<Map<int>>();
+		check("myThingMap", myThingMap.size() == 2 and myThingMap["x"] == 1 and myThingMap["y"] == 2);
+
 		MyType fake {5,6};
 		auto myThing2 = root->get("myNonExistentThing")->as<MyType>(fake);
 		std::cout << " myNonExistentThing = { .x=" << myThing2.x << ", .y=" << myThing2.y << " }" << "\n";
@@ -235,6 +264,1736 @@ bool test_complex() {
 	return success;
 }
 
+bool test_reparse() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running reparse test  ------------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	std::string src = "a:\n  b: 1\n\n  # c\n  c: [1,2]\nd:\n  - 1\n  -\n    - 2\n    - 3\ne:\nf: 5\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		Document doc(src);
+		TokenizedDoc tdoc = lex(&doc);
+		Parser p;
+		auto root = std::unique_ptr<RootNode>(p.parse(&tdoc));
+
+		// After every edit, the tree and tokens must match those of a fresh parse of the edited source.
+		auto edit = [&](std::string what, SourceEdit e, bool expectIncremental) {
+			bool incremental = p.reparse(root.get(), e);
+			check(what + " incremental", incremental == expectIncremental);
+
+			Document freshDoc(doc.src);
+			TokenizedDoc freshTdoc = lex(&freshDoc);
+			auto fresh = std::unique_ptr<RootNode>(Parser{}.parse(&freshTdoc));
+			check(what + " serialization", serialize(root.get()) == serialize(fresh.get()));
+
+			bool sameToks = freshTdoc.size() == tdoc.size();
+			for (uint32_t i = 0; sameToks and i < tdoc.size(); i++)
+				sameToks = tdoc[i].lexeme == freshTdoc[i].lexeme and tdoc[i].start == freshTdoc[i].start
+				           and tdoc[i].end == freshTdoc[i].end;
+			check(what + " tokens", sameToks);
+		};
+		auto at = [&](std::string s) { return (uint32_t)doc.src.find(s); };
+
+		edit("change nested scalar", { at("1\n"), at("1\n") + 1, "12345" }, true);
+		check("b", root->get("a")->get("b")->as<int>() == 12345);
+
+		edit("add nested key", { at("  c:"), at("  c:"), "  bb: \"x\"\n" }, true);
+		check("bb", root->get("a")->get("bb")->as<std::string>() == "x");
+		check("c", root->get("a")->get("c")->get(1)->as<int>() == 2);
+
+		edit("change list item", { at("3\n"), at("3\n") + 1, "[7,8]" }, true);
+		check("d[1][1]", root->get("d")->get(1)->get(1)->as<std::vector<int>>()[1] == 8);
+
+		edit("remove list item", { at("  - 1\n"), at("  - 1\n") + 6, "" }, true);
+		check("d[0][0]", root->get("d")->get(0u)->get(0u)->as<int>() == 2);
+
+		edit("fill empty key", { at("e:") + 2, at("e:") + 2, " 4" }, true);
+		check("e", root->get("e")->as<int>() == 4);
+
+		edit("change last line", { at("f: 5") + 3, at("f: 5") + 4, "6" }, true);
+		check("f", root->get("f")->as<int>() == 6);
+
+		edit("dedent key", { at("  bb"), at("  bb") + 2, "" }, true);
+		check("bb at top", root->get("bb")->as<std::string>() == "x");
+
+		edit("span two blocks", { at("e: 4"), at("f: 6") + 1, "e: 4\ng" }, false);
+		check("g", root->get("g")->as<int>() == 6);
+
+		edit("add block scalar", { at("g: 6"), at("g: 6"), "h: |\n  one\n  two\n" }, true);
+		edit("edit block scalar", { at("two"), at("two") + 3, "2\n\n  three" }, true);
+		check("h", root->get("h")->as<std::string>() == "one\n2\n\nthree\n");
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	} catch(...) {
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_reload() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running reload test  -------------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	auto path = (std::filesystem::temp_directory_path() / "syaml_test_reload.yaml").string();
+	auto writeFile = [&path](const std::string& src) {
+		// Replace the file the way editors do, by renaming a temporary over it.
+		std::ofstream(path + ".tmp") << src;
+		std::filesystem::rename(path + ".tmp", path);
+	};
+	auto waitFor = [](auto cond) {
+		for (int i = 0; i < 500 and !cond(); i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		return cond();
+	};
+
+	try {
+		writeFile("a: 1\n");
+		std::atomic<int> errors { 0 };
+		std::atomic<int> lastReloaded { 0 };
+		ReloadableDocument rd(
+		      path, std::chrono::milliseconds(20), nullptr,
+		      [&lastReloaded](const ReloadableDocument::Version& d) { lastReloaded = d->root->get("a")->as<int>(); },
+		      [&errors](const std::string&) { errors++; });
+
+		ReloadableDocument::Version old = rd.get();
+		check("initial value", old->root->get("a")->as<int>() == 1);
+
+		writeFile("a: 2\n");
+		check("reloaded", waitFor([&]() { return rd.get()->root->get("a")->as<int>() == 2; }));
+		check("old version still readable", old->root->get("a")->as<int>() == 1);
+		check("onReload", waitFor([&]() { return lastReloaded == 2; }));
+
+		uint64_t v = rd.version();
+		writeFile("a: [1,\n");
+		check("reload error reported", waitFor([&]() { return errors > 0; }));
+		check("bad version not published", rd.version() == v and rd.get()->root->get("a")->as<int>() == 2);
+
+#ifdef __linux__
+		// A file created in place is read once it is written and closed, not when it is created.
+		std::filesystem::remove(path);
+		v                     = rd.version();
+		int errorsBefore      = errors;
+		int fd                = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		std::string chunks[2] = { "a: 3\n", "b: 4\n" };
+		bool written          = fd >= 0 and write(fd, chunks[0].data(), chunks[0].size()) == (ssize_t)chunks[0].size();
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		// Read too early, the file is either empty (an error) or a prefix that parses (published).
+		check("created file not read before it is closed",
+		      rd.version() == v and errors == errorsBefore and rd.get()->root->get("a")->as<int>() == 2);
+		written = written and write(fd, chunks[1].data(), chunks[1].size()) == (ssize_t)chunks[1].size();
+		if (fd >= 0) close(fd);
+		check("created file read", written and waitFor([&]() { return !rd.get()->root->get("b")->isEmpty(); }) and
+		                               rd.get()->root->get("a")->as<int>() == 3 and rd.get()->root->get("b")->as<int>() == 4);
+#endif
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	} catch(...) {
+		success = false;
+	}
+
+	std::filesystem::remove(path);
+	return success;
+}
+
+bool test_diff() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running diff test  ---------------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		ParsedDocument a("x: 1\ny:\n  z: \"s\"\n  w: [1,2,3,4]\nl:\n  - 1\n  - 2\n  - 3\ngone: 0\n");
+		ParsedDocument b("x:   1\ny:\n  z: \"t\"\n  w: [1,2,9,3,4]\nl:\n  - 1\n  - 3\nnew: 0\n");
+
+		auto d = diff(a.root.get(), b.root.get());
+		std::stringstream ss;
+		for (auto& e : d) ss << "+-~"[e.kind] << e.path << " ";
+		std::cout << " - diff: " << ss.str() << "\n";
+		check("diff entries", ss.str() == "~y.z +y.w[2] -l[1] -gone +new ");
+
+		check("no diff with self", diff(a.root.get(), a.root.get()).empty());
+
+		b.root->get("y")->set<std::string>("z", "s");
+		d = diff(a.root.get(), b.root.get());
+		check("set() value compared", d.size() == 4 and d[0].path == "y.w[2]");
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	} catch(...) {
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_hash() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running hash test  ---------------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		ParsedDocument a("x: 1.0\ny:\n  s: \"str\"\n  l: [1, 2]\nz: true\n");
+		ParsedDocument b("z: true\ny:\n    l: [1,2]\n    s: \"str\"\nx: 1.\n");
+		ParsedDocument c("x: 1.0\ny:\n  s: \"str\"\n  l: [2, 1]\nz: true\n");
+
+		check("format and key order ignored", a.root->hash() == b.root->hash());
+		check("list order matters", a.root->hash() != c.root->hash());
+		check("subtree", a.root->get("y")->hash() == b.root->get("y")->hash());
+		check("string vs word", ParsedDocument("a: \"true\"\n").root->hash() != a.root->get("z")->hash());
+
+		uint64_t before = a.root->hash();
+		a.root->get("y")->set<std::string>("s", "other");
+		check("set() invalidates ancestors", a.root->hash() != before);
+		a.root->get("y")->set<std::string>("s", "str");
+		check("set() back to the same value", a.root->hash() == before);
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	} catch(...) {
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_snapshot() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running snapshot test  -----------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		Snapshot v1(std::make_shared<ParsedDocument>("a: 1\nb:\n  c: \"x\"\n  d: [1,2]\ne:\n  f: 3\n"));
+
+		Snapshot v2 = v1.set({ "b", "c" }, std::string { "y" });
+		check("old version unchanged", v1->get("b")->get("c")->as<std::string>() == "x");
+		check("new version changed", v2->get("b")->get("c")->as<std::string>() == "y");
+		check("unchanged subtree shared", v1->get("e") == v2->get("e"));
+		check("sibling shared", v1->get("b")->get("d") == v2->get("b")->get("d"));
+		check("key order kept", v2->get("b")->asDict()->children[0].first == "c");
+
+		auto sub = new DictNode();
+		sub->set<int>("h", 4);
+		Snapshot v3 = v2.set({ "g", "sub" }, sub).set("a", 2);
+		v1 = Snapshot();
+		v2 = Snapshot();
+		check("v3 a", v3->get("a")->as<int>() == 2);
+		check("v3 c", v3->get("b")->get("c")->as<std::string>() == "y");
+		check("v3 f", v3->get("e")->get("f")->as<int>() == 3);
+		check("v3 g.sub.h", v3->get("g")->get("sub")->get("h")->as<int>() == 4);
+
+		Snapshot v4 = v3.set({ "g", "sub", "i" }, 5);
+		v3 = Snapshot();
+		check("v4 g.sub.h", v4->get("g")->get("sub")->get("h")->as<int>() == 4);
+
+		bool threw = false;
+		try {
+			v4.set({ "a", "x" }, 1);
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		check("set through a scalar throws", threw);
+
+		// Two threads reading sibling versions fill the hash and text caches of the nodes they share, and
+		// of the new nodes, without a lock.
+		bool agree = true;
+		for (int round = 0; round < 20; round++) {
+			std::string src;
+			for (int i = 0; i < 50; i++)
+				src += "k" + std::to_string(i) + ":\n  s: \"a\\tb" + std::to_string(i) + "\"\n  l: [1, 2.5]\n  b: |\n    x\n    y\n";
+			Snapshot base(std::make_shared<ParsedDocument>(src));
+			Snapshot versions[2] = { base.set({ "k1", "n" }, 1.5), base.set({ "k2", "n" }, 7) };
+			uint64_t hashes[2];
+			size_t diffs[2];
+			std::string_view texts[2];
+			auto read = [&](int t) {
+				hashes[t] = versions[t]->hash();
+				diffs[t]  = diff(base.root(), versions[t].root()).size() + diff(versions[1 - t].root(), versions[t].root()).size();
+				texts[t]  = versions[t]->get(t ? "k2" : "k1")->get("n")->as<std::string_view>();
+			};
+			std::thread a(read, 0), b(read, 1);
+			a.join();
+			b.join();
+			agree = agree and hashes[0] != hashes[1] and hashes[0] == base.set({ "k1", "n" }, 1.5)->hash() and
+			        diffs[0] == 3 and diffs[1] == 3 and texts[0] == "1.5" and texts[1] == "7";
+		}
+		check("threads", agree);
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	} catch(...) {
+		success = false;
+	}
+
+	return success;
+}
+
+
+bool test_flow_map() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running flow map test  -----------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		ParsedDocument d("rows:\n  - {id: 1, name: \"a\", tags: [x, y]}\n  - {id: 2,\n     nested: {k: 1.5}}\n"
+		                 "inline: {a: 1, b: , c: {}, \"q k\": 2}\nlist: [{a: 1}, {a: 2}]\nlast: 3\n");
+		auto rows = d.root->get("rows");
+		check("rows[0].id", rows->get(0u)->get("id")->as<int>() == 1);
+		check("rows[0].name", rows->get(0u)->get("name")->as<std::string>() == "a");
+		check("rows[0].tags", rows->get(0u)->get("tags")->as<std::vector<std::string>>()[1] == "y");
+		check("rows[1].nested.k", rows->get(1u)->get("nested")->get("k")->as<double>() == 1.5);
+		check("inline.b empty", d.root->get("inline")->get("b")->isEmpty());
+		check("inline.c", d.root->get("inline")->get("c")->asDict()->children.empty());
+		check("quoted key", d.root->get("inline")->get("q k")->as<int>() == 2);
+		check("list[1].a", d.root->get("list")->get(1u)->get("a")->as<int>() == 2);
+		check("after", d.root->get("last")->as<int>() == 3);
+		check("as<Map>", d.root->get("list")->get(0u)->as<Map<int>>()["a"] == 1);
+
+		ParsedDocument whole("{a: 1, b: [1, 2],\n  c: {d: e}}\n");
+		check("whole document", whole.root->get("c")->get("d")->as<std::string>() == "e");
+
+		ParsedDocument again(serialize(d.root.get()));
+		check("serialize round trip", again.root->hash() == d.root->hash());
+
+		bool threw = false;
+		try {
+			ParsedDocument("a: {b: 1\n");
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		check("unterminated", threw);
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+// Each level merges the previous one eight times: `aN: &aN {<<: [*aN-1, ...]}`. Small, but with a path
+// to the first dict for each of 8^levels ways through the merges.
+static std::string mergeLaughs(int levels) {
+	std::string doc = "a0: &a0 {k: 0}\n";
+	for (int i = 1; i <= levels; i++) {
+		std::string prev = "*a" + std::to_string(i - 1);
+		doc += "a" + std::to_string(i) + ": &a" + std::to_string(i) + " {<<: [" + prev;
+		for (int j = 1; j < 8; j++) doc += ", " + prev;
+		doc += "], k" + std::to_string(i) + ": " + std::to_string(i) + "}\n";
+	}
+	return doc;
+}
+
+bool test_anchors() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running anchors test  ------------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	auto throws = [](auto f) {
+		try {
+			f();
+		} catch (std::runtime_error&) {
+			return true;
+		}
+		return false;
+	};
+
+	try {
+		ParsedDocument d("base: &base\n  a: 1\n  b: 2\nuse:\n  <<: *base\n  b: 3\n"
+		                 "list:\n  - &five 5\n  - *five\n  - *base\nflow: {x: *base, y: [*five]}\n");
+		check("alias shares the node", d.root->get("list")->get(2)->asDict() == d.root->get("base")->asDict());
+		check("scalar alias", d.root->get("list")->get(1)->as<int>() == 5);
+		check("merge", d.root->get("use")->get("a")->as<int>() == 1);
+		check("merge override", d.root->get("use")->get("b")->as<int>() == 3);
+		auto use = d.root->get("use")->as<Map<int>>();
+		check("as<Map> with merge", use.size() == 2 and use["a"] == 1 and use["b"] == 3);
+		check("flow alias", d.root->get("flow")->get("x")->get("b")->as<int>() == 2);
+
+		ParsedDocument again(serialize(d.root.get()));
+		check("serialize round trip", again.root->hash() == d.root->hash());
+		check("serialize keeps sharing", again.root->get("flow")->get("x")->asDict() == again.root->get("base")->asDict());
+
+		check("undefined alias", throws([] { ParsedDocument("a: *nope\n"); }));
+
+		// "Billion laughs": each level aliases the previous one ten times.
+		std::string laughs = "l0: &l0 [x, x, x, x, x, x, x, x, x, x]\n";
+		for (int i = 1; i < 9; i++) {
+			std::string prev = "*l" + std::to_string(i - 1);
+			laughs += "l" + std::to_string(i) + ": &l" + std::to_string(i) + " [" + prev;
+			for (int j = 1; j < 10; j++) laughs += ", " + prev;
+			laughs += "]\n";
+		}
+		ParsedDocument bomb(laughs);
+		check("bomb l2", bomb.root->get("l2")->as<std::vector<std::vector<std::vector<std::string>>>>().size() == 10);
+		using V5 = std::vector<std::vector<std::vector<std::vector<std::vector<std::string>>>>>;
+		check("bomb expansion limit", throws([&] { bomb.root->get("l4")->as<V5>(); }));
+		check("bomb serializes small", serialize(bomb.root.get()).size() < 2 * laughs.size());
+		check("bomb lookup", bomb.root->get("l8")->get(9)->get(9)->get(9)->get(9)->get(9)->get(9)->get(9)->get(9)->get(0u)->as<std::string>() == "x");
+
+		// The same with merges: a lookup searches each merged dict once, however many paths lead to it.
+		ParsedDocument merges(mergeLaughs(11));
+		check("merge bomb lookup", merges.root->get("a11")->get("k")->as<int>() == 0 and
+		                               merges.root->get("a11")->get("k1")->as<int>() == 1);
+		check("merge bomb missing key", merges.root->get("a11")->get("nope")->isEmpty() and
+		                                    merges.root->get("a11")->get(Key("nope"))->isEmpty());
+
+		// Edits to an aliased document are re-parsed in full, so that aliases stay consistent.
+		Document doc("a: &a [1, 2]\nb: *a\n");
+		TokenizedDoc tdoc = lex(&doc);
+		Parser p;
+		std::unique_ptr<RootNode> root(p.parse(&tdoc));
+		bool incremental = p.reparse(root.get(), { (uint32_t)doc.src.find('2'), (uint32_t)doc.src.find('2') + 1, "3" });
+		check("aliased reparse is full", not incremental);
+		check("aliased reparse", root->get("b")->get(1)->as<int>() == 3);
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_block_scalars() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running block scalar test  -------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		ParsedDocument d("lit: |\n  line 1\n    more\n\n  line 3\nfold: >\n  a b\n  c\n\n  d\n    e\n  f\n\n"
+		                 "strip: |-\n  x\n\nkeep: |+\n  y\n\n\none: |  # comment\n  single line\nempty: |\n"
+		                 "list:\n  - >-\n    folded\n    item\n  - |2\n      indented\n    first\nlast: 1\n");
+		auto str = [&](const char* k) { return d.root->get(k)->as<std::string>(); };
+		check("literal", str("lit") == "line 1\n  more\n\nline 3\n");
+		check("folded", str("fold") == "a b c\nd\n  e\nf\n");
+		check("strip", str("strip") == "x");
+		check("keep", str("keep") == "y\n\n\n");
+		check("clip", str("one") == "single line\n");
+		check("empty", str("empty") == "");
+		check("list item", d.root->get("list")->get(0u)->as<std::string>() == "folded item");
+		check("indentation indicator", d.root->get("list")->get(1)->as<std::string>() == "  indented\nfirst\n");
+		check("after", d.root->get("last")->as<int>() == 1);
+
+		// The last line keeps its break only if the source has one, like pyyaml.
+		check("no final break", ParsedDocument("k: |\n  a\n  b").root->get("k")->as<std::string>() == "a\nb" and
+		                            ParsedDocument("k: |\n  single").root->get("k")->as<std::string>() == "single" and
+		                            ParsedDocument("k: |\n  single").root->get("k")->asScalar()->view() == "single" and
+		                            ParsedDocument("k: >+\n  a\n  b").root->get("k")->as<std::string>() == "a b");
+
+		// Single lines are views into the source, the rest are materialized on demand.
+		auto inSource = [&](std::string_view v) {
+			return v.data() >= d.doc.src.data() and v.data() + v.size() <= d.doc.src.data() + d.doc.src.size();
+		};
+		auto one = dynamic_cast<ScalarNode*>(d.root->get("one"));
+		check("single line view", one->isBlock() and one->view() == "single line\n" and inSource(one->view()));
+		check("strip view", inSource(dynamic_cast<ScalarNode*>(d.root->get("strip"))->view()));
+		auto lit = dynamic_cast<ScalarNode*>(d.root->get("lit"));
+		check("not materialized by parsing", lit->materialized == nullptr);
+		check("materialized view", lit->view() == str("lit") and not inSource(lit->view()) and lit->materialized);
+
+		ParsedDocument again(serialize(d.root.get()));
+		check("serialize round trip", again.root->hash() == d.root->hash());
+
+		bool threw = false;
+		try {
+			ParsedDocument("a: [|]\n");
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		check("not in flow collections", threw);
+
+		// A large block is one token, whatever its size.
+		std::string big = "cert: |\n";
+		for (int i = 0; i < 10000; i++) big += "  MIIBIjANBgkqhkiG9w0BAQEFAAOCAQ8AMIIBCgKCAQEA\n";
+		big += "next: 2\n";
+		ParsedDocument b(big);
+		check("big block tokens", b.tdoc.size() < 20);
+		check("big block", b.root->get("cert")->as<std::string>().size() == 10000 * 45);
+
+		ParsedDocument n("i: |-\n  42\nf: >-\n  1.5\nu: |-\n  7\nclip: |\n  3\n");
+		check("block numbers", n.root->get("i")->as<int>() == 42 and n.root->get("f")->as<double>() == 1.5
+		                           and n.root->get("u")->as<unsigned>() == 7u);
+		threw = false;
+		try {
+			n.root->get("clip")->as<int>();
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		check("block number with newline", threw);
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_strings() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running strings test  ------------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		ParsedDocument d("plain: \"no escapes\"\nword: hello\nnum: 1.5\nquote: \"say \\\"hi\\\"\"\n"
+		                 "esc: \"a\\tb\\\\c\\nd \\x41\\u00e9\\U0001F600\"\nflow: {\"k\\\"ey\": 1}\n");
+		auto inSource = [&](std::string_view v) {
+			return v.data() >= d.doc.src.data() and v.data() + v.size() <= d.doc.src.data() + d.doc.src.size();
+		};
+		auto plain = d.root->get("plain")->as<std::string_view>();
+		check("plain view", plain == "no escapes" and inSource(plain));
+		check("word view", d.root->get("word")->as<std::string_view>() == "hello");
+		check("number view", d.root->get("num")->as<std::string_view>() == "1.5");
+		check("escaped quote", d.root->get("quote")->as<std::string>() == "say \"hi\"");
+		check("escapes", d.root->get("esc")->as<std::string>() == "a\tb\\c\nd A\xc3\xa9\xf0\x9f\x98\x80");
+		auto esc = d.root->get("esc")->as<std::string_view>();
+		check("escaped view", esc == d.root->get("esc")->as<std::string>() and not inSource(esc));
+		check("escaped view is kept", d.root->get("esc")->as<std::string_view>().data() == esc.data());
+		check("escaped key", d.root->get("flow")->get("k\"ey")->as<int>() == 1);
+
+		d.root->set("set", std::string { "back\\slash \"and\" quotes" });
+		check("set()", d.root->get("set")->as<std::string>() == "back\\slash \"and\" quotes");
+		ParsedDocument again(serialize(d.root.get()));
+		check("serialize round trip", again.root->hash() == d.root->hash());
+		check("escaped hash", ParsedDocument("a: \"\\x41\"\n").root->hash() == ParsedDocument("a: \"A\"\n").root->hash());
+
+		bool threw = false;
+		try {
+			ParsedDocument("a: \"\\q\"\n");
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		check("bad escape", threw);
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_json() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running json test  ---------------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	auto throws = [](const std::string& src, ParsedDocument::Syntax syntax) {
+		try {
+			ParsedDocument d(src, syntax);
+		} catch (std::runtime_error&) {
+			return true;
+		}
+		return false;
+	};
+
+	try {
+		std::string src = " {\"name\": \"x\\ty\", \"port\": 8080, \"ratio\": -1.5e-3, \"on\": true, \"off\": null,\n"
+		                  "  \"list\": [1, [2, {\"k\\u00e9y\": \"v\"}], []], \"empty\": {}}\n";
+		ParsedDocument yaml(src, ParsedDocument::eYaml), json(src, ParsedDocument::eJson);
+		check("values", json.root->get("name")->as<std::string>() == "x\ty" and json.root->get("port")->as<int>() == 8080
+		                    and json.root->get("ratio")->as<double>() == -1.5e-3 and json.root->get("on")->as<bool>());
+		check("nested", json.root->get("list")->get(1u)->get(1u)->get("k\xc3\xa9y")->as<std::string>() == "v");
+		check("empty", json.root->get("list")->get(2u)->as<std::vector<int>>().empty()
+		                   and json.root->get("empty")->as<Map<int>>().empty());
+
+		// The same tokens and tree as lex() and parse().
+		bool sameTokens = yaml.tdoc.size() == json.tdoc.size();
+		for (uint32_t i = 0; sameTokens and i < yaml.tdoc.size(); i++)
+			sameTokens = yaml.tdoc[i].lexeme == json.tdoc[i].lexeme and yaml.tdoc[i].n == json.tdoc[i].n
+			             and yaml.tdoc[i].start == json.tdoc[i].start and yaml.tdoc[i].end == json.tdoc[i].end;
+		check("tokens", sameTokens);
+		check("tree", json.root->hash() == yaml.root->hash() and json.root->tokRange.end == yaml.root->tokRange.end
+		                  and serialize(json.root.get()) == serialize(yaml.root.get()));
+		auto range = [](const Node* n) { return std::make_pair(n->tokRange.start, n->tokRange.end); };
+		check("ranges", range(json.root->get("list")->get(1u)) == range(yaml.root->get("list")->get(1u)));
+
+		// Multi-line lists and exponents with a sign or `E` are JSON, but not YAML this parser reads.
+		ParsedDocument pretty("{\n  \"a\": [\n    1,\n    2E+2\n  ]\n}\n");
+		check("pretty", pretty.root->get("a")->as<std::vector<double>>() == std::vector<double> { 1, 200 });
+		check("pretty as yaml", throws("{\n  \"a\": [\n    1\n  ]\n}\n", ParsedDocument::eYaml));
+
+		// YAML flow maps look like JSON at first, and are parsed as YAML when they aren't.
+		check("yaml fallback", ParsedDocument("{a: 1, b: [x]}\n").root->get("a")->as<int>() == 1);
+		check("not json", throws("{a: 1}\n", ParsedDocument::eJson));
+		check("trailing comma", throws("{\"a\": 1,}", ParsedDocument::eJson));
+		check("trailing text", throws("{\"a\": 1} x", ParsedDocument::eJson));
+		check("leading zero", throws("{\"a\": 01}", ParsedDocument::eJson));
+		check("bad escape", throws("{\"a\": \"\\q\"}", ParsedDocument::eJson));
+		check("unterminated", throws("{\"a\": \"x", ParsedDocument::eJson));
+		check("top level list", throws("[1, 2]", ParsedDocument::eJson));
+
+		// Edits to a JSON document are re-parsed as JSON.
+		Parser p;
+		p.reparse(pretty.root.get(), SourceEdit { 15, 16, "7" });
+		check("reparse", pretty.root->get("a")->get(0u)->as<int>() == 7);
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_output() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running json and msgpack output test  --------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	auto json = [](const Node* n) {
+		std::string s;
+		char buf[5];
+		OutBuffer out(buf, sizeof(buf), [&](std::string_view v) { s += v; });
+		toJson(n, out);
+		return s;
+	};
+
+	try {
+		ParsedDocument d("a: 1\nb: [true, null, x, \"q\\\"\\x41\\t\"]\nc:\n  d: .5\n  e: -2.50\n  f:\n"
+		                 "g: |\n  line\nbase: &b {x: 1, y: 2}\nm:\n  <<: *b\n  y: 3\n");
+		std::string expected = "{\"a\":1,\"b\":[true,null,\"x\",\"q\\\"A\\t\"],\"c\":{\"d\":0.5,\"e\":-2.50,\"f\":null},"
+		                       "\"g\":\"line\\n\",\"base\":{\"x\":1,\"y\":2},\"m\":{\"y\":3,\"x\":1}}";
+		check("json", json(d.root.get()) == expected);
+		check("json parses", ParsedDocument(expected, ParsedDocument::eJson).root->get("m")->get("x")->as<int>() == 1);
+
+		// Without a flush, what does not fit is dropped but counted.
+		char small[8];
+		OutBuffer out(small, sizeof(small));
+		check("total", toJson(d.root.get(), out) == expected.size() and out.truncated());
+		check("prefix", std::string(small, sizeof(small)) == expected.substr(0, sizeof(small)));
+
+		ParsedDocument p("a: 1\nb: [true, null]\nc: \"x\"\nd: -200\ne: 1.5\nf: 70000\n");
+		std::string bytes(64, '\0');
+		OutBuffer mp(bytes.data(), bytes.size());
+		bytes.resize(toMsgPack(p.root.get(), mp));
+		const char expectedBytes[] = "\x86\xa1" "a\x01\xa1" "b\x92\xc3\xc0\xa1" "c\xa1" "x\xa1" "d\xd1\xff\x38\xa1"
+		                             "e\xcb\x3f\xf8\0\0\0\0\0\0\xa1" "f\xce\0\x01\x11\x70";
+		check("msgpack", bytes == std::string(expectedBytes, sizeof(expectedBytes) - 1));
+
+		// Strings of 32 bytes and more, and lists of 16 items and more, have a size after the tag.
+		std::string longKey(40, 'k');
+		ParsedDocument l(longKey + ": [0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15]\n");
+		std::string lb(128, '\0');
+		OutBuffer lo(lb.data(), lb.size());
+		lb.resize(toMsgPack(l.root.get(), lo));
+		check("str8", lb.substr(0, 3) == "\x81\xd9\x28" and lb.substr(3, 40) == longKey);
+		check("array16", lb.substr(43, 4) == std::string("\xdc\0\x10\0", 4) and lb.size() == 43 + 3 + 16);
+
+		// Dicts merged along many paths are written once. Aliases that really expand to too much throw.
+		ParsedDocument laughs(mergeLaughs(11));
+		check("merge bomb", json(laughs.root->get("a11")) ==
+		                        "{\"k11\":11,\"k10\":10,\"k9\":9,\"k8\":8,\"k7\":7,\"k6\":6,\"k5\":5,\"k4\":4,"
+		                        "\"k3\":3,\"k2\":2,\"k1\":1,\"k\":0}");
+		std::string nested = "a0: &a0 {k: 0}\n";
+		for (int i = 1; i <= 11; i++) {
+			std::string prev = "*a" + std::to_string(i - 1);
+			nested += "a" + std::to_string(i) + ": &a" + std::to_string(i) + " {<<: " + prev + ", v: [" + prev;
+			for (int j = 1; j < 8; j++) nested += ", " + prev;
+			nested += "]}\n";
+		}
+		ParsedDocument bomb(nested);
+		auto throws = [](auto f) {
+			try {
+				f();
+			} catch (std::runtime_error&) {
+				return true;
+			}
+			return false;
+		};
+		char sink[64];
+		OutBuffer so(sink, sizeof(sink));
+		check("bomb json", throws([&] { json(bomb.root.get()); }));
+		check("bomb msgpack", throws([&] { toMsgPack(bomb.root.get(), so); }));
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_schema() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running schema test  -------------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		ParsedDocument d("a:\n  host: \"x\"\n  port: 80\nb:\n  port: 81\n  extra: 1\n  timeout:\n"
+		                 "base: &base {host: h, port: 1, timeout: 2.5}\nc:\n  <<: *base\n  port: 82\n");
+		auto a = d.root->get("a")->as<Server>();
+		check("decode", a.host == "x" and a.port == 80 and a.timeout == 30.);
+
+		auto& schema = Decode<Server>::schema;
+		auto b       = schema.bind(d.root->get("b"));
+		check("unknown and missing", not b.ok() and b.unknown.size() == 1 and b.missing.size() == 1);
+		check("error", b.error() == "unknown key 'extra', missing key 'host'");
+		check("empty value is missing", b.nodes[2] == nullptr and schema.as<2>(b, 1.) == 1.);
+		check("field", schema.as<1>(b) == 81);
+
+		auto c = d.root->get("c")->as<Server>();
+		check("merged", c.host == "h" and c.port == 82 and c.timeout == 2.5);
+
+		// Each merged dict is bound once, so its unknown keys are reported once.
+		ParsedDocument laughs(mergeLaughs(9));
+		auto l = schema.bind(laughs.root->get("a9"));
+		check("merge bomb", l.unknown.size() == 10 and l.unknown.front() == "k9" and l.unknown.back() == "k");
+
+		bool threw = false;
+		try {
+			d.root->get("b")->as<Server>();
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		check("decode error", threw);
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_validate() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running validate test  -----------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		Rule server = Rule::dict({ { "host", Rule::string() },
+		                           { "port", Rule::integer().range(1, 65535) },
+		                           { "mode", Rule::string().oneOf({ "fast", "safe" }).optional() },
+		                           { "ratio", Rule::number().range(0, 1).optional() },
+		                           { "debug", Rule::boolean().optional() },
+		                           { "tags", Rule::list(Rule::string()).length(1, 3).optional() } })
+		                  .closed();
+		Rule config = Rule::dict({ { "servers", Rule::list(server) }, { "limits", Rule::map(Rule::integer()).optional() } });
+
+		ParsedDocument good("servers:\n  - {host: a, port: 80, mode: fast, tags: [x]}\n  - {host: \"b\", port: 8080, ratio: .5}\n"
+		                    "limits:\n  cpu: 4\n  mem: 1024\n");
+		check("valid", validate(good.root.get(), config).empty());
+
+		ParsedDocument bad("servers:\n"
+		                   "  - {host: a, port: 0, mode: slow}\n"
+		                   "  - {port: \"80\", ratio: 2, debug: yes, tags: []}\n"
+		                   "  - {host: c, port: 1.5, colour: red}\n"
+		                   "limits:\n  cpu: many\n");
+		auto vs = validate(bad.root.get(), config);
+		std::map<std::string, Violation> byPath;
+		for (auto& v : vs) byPath[v.path] = v;
+		check("all violations", vs.size() == 10);
+		check("range", byPath["servers[0].port"].message == "expected at least 1, got '0'");
+		check("enum", byPath["servers[0].mode"].message == "expected one of 'fast', 'safe', got 'slow'");
+		check("missing", byPath["servers[1].host"].message == "missing key 'host'");
+		check("quoted is not a number", byPath["servers[1].port"].message == "expected an integer, got '80'");
+		check("number range", byPath["servers[1].ratio"].message == "expected at most 1, got '2'");
+		check("bool", byPath.count("servers[1].debug"));
+		check("length", byPath["servers[1].tags"].message == "expected at least 1 items, got 0");
+		check("integer", byPath["servers[2].port"].message == "expected an integer, got '1.5'");
+		check("unknown", byPath["servers[2].colour"].message == "unknown key 'colour'");
+		check("map values", byPath["limits.cpu"].message == "expected an integer, got 'many'");
+
+		// Positions are 1-based, and those of the key for unknown keys.
+		check("position", byPath["servers[0].port"].line == 2 and byPath["servers[0].port"].column == 21);
+		check("key position", byPath["servers[2].colour"].line == 4 and byPath["servers[2].colour"].column == 26);
+		check("missing key position", byPath["servers[1].host"].line == 3 and byPath["servers[1].host"].column == 5);
+
+		auto types = validate(good.root.get(), Rule::dict({ { "servers", Rule::dict({}) }, { "limits", Rule::list() } }));
+		check("types", types.size() == 2 and types[0].message == "expected a dict, got a list");
+
+		// Merged keys count, and values set() later have the position of their closest parsed ancestor.
+		ParsedDocument merged("base: &b {host: h, port: 1}\ns:\n  <<: *b\n  port: 2\n");
+		check("merged", validate(merged.root->get("s"), server).empty());
+		merged.root->get("s")->set("port", "x");
+		auto set = validate(merged.root->get("s"), server);
+		check("set", set.size() == 1 and set[0].path == "port" and set[0].line == 3);
+
+		// Shared nodes are checked once per rule.
+		std::string laughs = "l0: &l0 [1, x]\n";
+		for (int i = 1; i < 30; i++) {
+			laughs += "l" + std::to_string(i) + ": &l" + std::to_string(i) + " [";
+			for (int j = 0; j < 9; j++) laughs += std::string { j ? ", " : "" } + "*l" + std::to_string(i - 1);
+			laughs += "]\n";
+		}
+		ParsedDocument billion(laughs);
+		Rule nested = Rule::list(Rule::integer());
+		for (int i = 0; i < 29; i++) nested = Rule::list(nested);
+		check("aliases", validate(billion.root->get("l29"), nested).size() == 1);
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_query() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running query test  --------------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		ParsedDocument doc("services:\n"
+		                   "  - {name: web, enabled: true, ports: [80, 443], owner: {team: a}}\n"
+		                   "  - {name: db, enabled: false, ports: [5432]}\n"
+		                   "  - {name: cache, enabled: true, ports: [6379], owner: {team: \"b\"}, note:}\n"
+		                   "  - {name: \"1\", enabled: \"true\", ports: []}\n"
+		                   "limits: {cpu: 4, mem: 1024}\n");
+		auto root = doc.root.get();
+
+		check("keys", Query("limits.cpu").values<int>(root) == std::vector<int> { 4 });
+		check("dollar", Query("$.limits['mem']").values<int>(root) == std::vector<int> { 1024 });
+		check("index", Query("services[1].name").values<std::string>(root) == std::vector<std::string> { "db" });
+		check("negative index", Query("services[-1].name").values<std::string>(root) == std::vector<std::string> { "1" });
+		check("out of range", Query("services[9].name").nodes(root).empty());
+		check("wildcard", Query("services[*].ports[*]").values<int>(root) == std::vector<int> { 80, 443, 5432, 6379 });
+		check("dict wildcard", Query("limits.*").values<int>(root) == std::vector<int> { 4, 1024 });
+		check("dict filter", Query("limits[?@ > 100]").values<int>(root) == std::vector<int> { 1024 });
+		check("filter", Query("services[?enabled == true].name").values<std::string>(root) ==
+		                    std::vector<std::string> { "web", "cache" });
+		check("nested filter path", Query("services[?@.owner.team == 'b'].name").values<std::string>(root) ==
+		                                std::vector<std::string> { "cache" });
+		check("exists", Query("services[?owner].ports[0]").values<int>(root) == std::vector<int> { 80, 6379 });
+		check("types differ", Query("services[?name != 1].name").nodes(root).size() == 4);
+		check("number", Query("services[?ports[0] >= 5000].name").values<std::string>(root) ==
+		                    std::vector<std::string> { "db", "cache" });
+		check("item itself", Query("services[*].ports[?@ < 100]").values<int>(root) == std::vector<int> { 80 });
+		check("no value is null", Query("services[?note == null].name").values<std::string>(root) ==
+		                              std::vector<std::string> { "cache" });
+		check("no value is not a result", Query("services[*].note").nodes(root).empty());
+		check("node handles", Query("services[0]").nodes(root) == std::vector<const Node*> { root->get("services")->get(0u) });
+
+		// Merged keys, explicit ones first.
+		ParsedDocument merged("base: &b {x: 1, y: 2}\ns:\n  <<: *b\n  y: 3\n  z: 4\n");
+		check("merged", Query("s.*").values<int>(merged.root.get()) == std::vector<int> { 3, 4, 1 });
+		check("merged key", Query("s.x").values<int>(merged.root.get()) == std::vector<int> { 1 });
+		check("merged filter", Query("s[?@ != 3]").values<int>(merged.root.get()) == std::vector<int> { 4, 1 });
+		ParsedDocument twice("base: &b {x: 1, y: 2}\ns: {<<: [*b, *b], z: 4}\n");
+		check("merged twice", Query("s.*").values<int>(twice.root.get()) == std::vector<int> { 4, 1, 2 });
+		ParsedDocument laughs(mergeLaughs(11));
+		check("merge bomb", Query("a11.*").values<int>(laughs.root.get()) ==
+		                        std::vector<int> { 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0 });
+
+		// Splitting big lists between threads gives the same results, in the same order.
+		std::string rows = "rows:\n";
+		for (int i = 0; i < 1000; i++) rows += "  - {id: " + std::to_string(i) + ", ok: " + (i % 3 ? "true" : "false") + "}\n";
+		ParsedDocument big(rows);
+		Query q("rows[?ok == true].id");
+		q.minParallel = 16;
+		auto serial   = q.values<int>(big.root.get());
+		check("serial", serial.size() == 666 and serial[0] == 1 and serial.back() == 998);
+		check("parallel", q.values<int>(big.root.get(), 4) == serial);
+		bool threw = false;
+		try {
+			Query("rows[*].ok").values<int>(big.root.get(), 4);
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		check("parallel errors", threw);
+
+		for (auto bad : { "a..b", "a[", "a[1", "a[?b ==]", "a[?b == x]", "a[\"b]", "a b" }) {
+			threw = false;
+			try {
+				Query q(bad);
+			} catch (std::runtime_error&) {
+				threw = true;
+			}
+			check(std::string { "syntax: " } + bad, threw);
+		}
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_batch() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running batch test  --------------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		ParsedDocument doc("a: 1\nb:\n  c: 2\n  d: [x, y]\ne:\nf: 3\n");
+		auto root = doc.root.get();
+		uint64_t before = root->hash();
+
+		Batch b(root);
+		b.set("a", 10).set("b.d[-1]", std::string { "z" }).set("e.g.h", 4).append("b.d", 5).append("new", 6);
+		b.set("list", std::vector<int> { 1, 2 }).set("map", Map<int> { { "k", 7 } });
+		b.set("ordered", std::vector<std::pair<std::string, double>> { { "z", 1.5 }, { "y", 2 } });
+		check("recorded", b.size() == 8);
+		b.commit();
+		check("applied", b.size() == 0);
+
+		std::vector<std::string> keys;
+		for (auto& kv : root->asDict()->children) keys.push_back(kv.first);
+		check("order kept", keys == std::vector<std::string> { "a", "b", "e", "f", "new", "list", "map", "ordered" });
+		check("in place", root->get("a")->as<int>() == 10 and root->get("f")->as<int>() == 3);
+		check("list item", root->get("b")->get("d")->as<std::vector<std::string>>() == std::vector<std::string> { "x", "z", "5" });
+		check("through empty", root->get("e")->get("g")->get("h")->as<int>() == 4);
+		check("new list", root->get("new")->as<std::vector<int>>() == std::vector<int> { 6 });
+		check("vector", root->get("list")->as<std::vector<int>>() == std::vector<int> { 1, 2 });
+		check("map", root->get("map")->get("k")->as<int>() == 7);
+		check("pairs in order", root->get("ordered")->asDict()->children[0].first == "z");
+		check("hash", root->hash() != before);
+		check("dirty", root->dirty and root->get("b")->dirty and not root->get("f")->dirty);
+
+		// The new tree reads back the same after writing it out.
+		ParsedDocument again(serialize(root));
+		check("serialize", again.root->hash() == root->hash());
+
+		// Node::set() keeps the order too.
+		root->set("a", 11);
+		check("set in place", root->asDict()->children[0].first == "a" and root->get("a")->as<int>() == 11);
+
+		// Many changes to a big dict.
+		std::string src;
+		for (int i = 0; i < 1000; i++) src += "k" + std::to_string(i) + ": " + std::to_string(i) + "\n";
+		ParsedDocument big(src);
+		Batch many(big.root.get());
+		for (int i = 0; i < 2000; i += 2) many.set("k" + std::to_string(i), -i);
+		many.commit();
+		auto& cs = big.root->children;
+		check("big", cs.size() == 1500 and cs[0].first == "k0" and cs[2].second->as<int>() == -2 and
+		                 cs[3].second->as<int>() == 3 and cs[1000].first == "k1000" and cs[1499].second->as<int>() == -1998);
+
+		// Errors stop at the failing change, after applying the ones before it.
+		for (auto bad : { "a.x", "b.d[5]", "f[0]", "missing[0].x" }) {
+			Batch e(root);
+			e.set("before", 1).set(bad, 2);
+			bool threw = false;
+			try {
+				e.commit();
+			} catch (std::runtime_error&) {
+				threw = true;
+			}
+			check(std::string { "error: " } + bad, threw and root->get("before")->as<int>() == 1 and e.size() == 0);
+		}
+		check("no partial key", not root->asDict()->find("missing"));
+		bool threw = false;
+		try {
+			Batch(root).set("a[", 1);
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		check("bad path", threw);
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_typed_set() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running typed set test  ----------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		ParsedDocument d("a: 1\n");
+		auto root = d.root.get();
+		root->set("big", std::numeric_limits<int64_t>::max());
+		root->set("huge", std::numeric_limits<uint64_t>::max());
+		root->set("sum", 0.1 + 0.2);
+		root->set("third", 1.0 / 3);
+		root->set("whole", 2.0);
+		root->set("yes", true);
+		root->set("text", std::string { "say \"hi\"\n" });
+		root->set("word", "plain");
+
+		check("int64", root->get("big")->as<int64_t>() == std::numeric_limits<int64_t>::max());
+		check("uint64", root->get("huge")->as<uint64_t>() == std::numeric_limits<uint64_t>::max());
+		check("double exact", root->get("sum")->as<double>() == 0.1 + 0.2 and root->get("third")->as<double>() == 1.0 / 3);
+		check("int as double", root->get("big")->as<double>() == (double)std::numeric_limits<int64_t>::max());
+		check("whole double as int", root->get("whole")->as<int>() == 2 and root->get("whole")->as<unsigned>() == 2u);
+		check("bool", root->get("yes")->as<bool>() and root->get("yes")->as<std::string>() == "true");
+		check("text", root->get("sum")->as<std::string>() == "0.30000000000000004" and
+		                  root->get("big")->as<std::string_view>() == "9223372036854775807");
+		check("string", root->get("text")->as<std::string>() == "say \"hi\"\n");
+
+		bool threw = false;
+		try {
+			root->get("big")->as<int>();
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		check("out of range", threw);
+		threw = false;
+		try {
+			root->get("sum")->as<int>();
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		check("fraction as int", threw);
+
+		// Written out, the values read back the same, and hash like the parsed ones.
+		ParsedDocument again(serialize(root));
+		check("serialized", again.root->hash() == root->hash());
+		check("serialized double", again.root->get("sum")->as<double>() == 0.1 + 0.2);
+		check("serialized string", again.root->get("text")->as<std::string>() == "say \"hi\"\n");
+		check("serialized bool", again.root->get("yes")->as<bool>());
+
+		std::string json;
+		char buf[64];
+		OutBuffer out(buf, sizeof(buf), [&](std::string_view s) { json += s; });
+		toJson(root->get("sum"), out);
+		check("json", json == "0.30000000000000004");
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_overlay() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running overlay test  ------------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		auto base = std::make_shared<ParsedDocument>("server:\n  host: a\n  port: 80\n  tls: {on: false, cert: x}\n"
+		                                              "tags: [a, b]\nmode: fast\nlimits: 4\ndefaults: &d {x: 1, y: 2}\n");
+		auto prod = std::make_shared<ParsedDocument>("server:\n  port: 443\n  tls: {on: true}\ntags: [c]\nlimits: {cpu: 2}\n");
+		auto host = std::make_shared<ParsedDocument>("server:\n  host: b\nmode:\nextra: 1\ndefaults: {y: 3}\n");
+
+		Overlay config;
+		config.push(base).push(prod).push(host);
+
+		check("top layer", config.get("server").get("host").as<std::string>() == "b");
+		check("middle layer", config.get("server").get("port").as<int>() == 443);
+		check("deep merge", config.get("server").get("tls").get("on").as<bool>() and
+		                        config.get("server").get("tls").get("cert").as<std::string>() == "x");
+		check("lists replace", config.get("tags").as<std::vector<std::string>>() == std::vector<std::string> { "c" });
+		check("list item", config.get("tags").get(0u).as<std::string>() == "c" and config.get("tags").get(1u).nodes.empty());
+		check("no value replaces", config.get("mode").as<std::string>("none") == "none");
+		check("dict replaces scalar", config.get("limits").get("cpu").as<int>() == 2);
+		check("missing", config.get("nope").nodes.empty() and config.get("nope").get("x").as<int>(7) == 7);
+		auto tls = config.get("server").get("tls").as<Map<std::string>>();
+		check("merged as map", tls.size() == 2 and tls["on"] == "true" and tls["cert"] == "x");
+		check("merged keys", config.get("defaults").get("x").as<int>() == 1 and config.get("defaults").get("y").as<int>() == 3);
+
+		Snapshot flat = config.flatten();
+		std::vector<std::string> keys;
+		for (auto& kv : flat->children) keys.push_back(kv.first);
+		check("flatten order", keys == std::vector<std::string> { "server", "tags", "mode", "limits", "defaults", "extra" });
+		check("flatten values", flat->get("server")->get("host")->as<std::string>() == "b" and
+		                            flat->get("server")->get("tls")->get("cert")->as<std::string>() == "x" and
+		                            flat->get("server")->get("tls")->get("on")->as<bool>() and
+		                            flat->get("defaults")->get("x")->as<int>() == 1);
+		check("flatten shares", flat->get("tags") == prod->root->get("tags"));
+
+		// Flattened, the layers are one document: it hashes like the same tree parsed from one source.
+		ParsedDocument same("server:\n  host: b\n  port: 443\n  tls: {on: true, cert: x}\ntags: [c]\nmode:\n"
+		                    "limits: {cpu: 2}\ndefaults: {x: 1, y: 3}\nextra: 1\n");
+		check("flatten hash", flat->hash() == same.root->hash());
+
+		// Of repeated keys, the first counts, merged or not.
+		Overlay dups;
+		dups.push(std::make_shared<ParsedDocument>("d: {x: 0}\n")).push(std::make_shared<ParsedDocument>("d: {x: 1, x: 2}\n"));
+		check("repeated keys", dups.get("d").get("x").as<int>() == 1 and dups.flatten()->get("d")->get("x")->as<int>() == 1 and
+		                           dups.flatten()->get("d")->asDict()->children.size() == 1);
+
+		// The layers stay alive for as long as the flattened tree.
+		std::weak_ptr<ParsedDocument> weak = prod;
+		config = Overlay();
+		prod.reset();
+		check("kept alive", not weak.expired() and flat->get("server")->get("port")->as<int>() == 443);
+		flat = Snapshot();
+		check("released", weak.expired());
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_expansion() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running expansion test  ----------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+	auto throws = [](auto f, const char* what = "") {
+		try {
+			f();
+		} catch (std::runtime_error& e) {
+			return std::string { e.what() }.find(what) != std::string::npos;
+		}
+		return false;
+	};
+
+	auto dir = std::filesystem::temp_directory_path() / "syaml_test_expansion";
+	std::filesystem::create_directories(dir);
+	auto writeFile = [&dir](const std::string& name, const std::string& src) {
+		std::ofstream((dir / name).string()) << src;
+	};
+
+	try {
+		writeFile("db.yaml", "host: ${DB_HOST:-localhost}\nport: 5432\n");
+		writeFile("common.yaml", "db: !include \"db.yaml\"\nlog: info\n");
+		writeFile("main.yaml", "name: ${APP}\nport: ${PORT:-8080}\ngreeting: \"hi ${APP}!\"\nliteral: \"$${HOME}\"\n"
+		                       "unset: ${NOPE}\nlines: |\n  app ${APP}\na: !include \"common.yaml\"\n"
+		                       "b: !include \"common.yaml\"\nlist:\n  - !include \"db.yaml\"\n");
+
+		auto expansion       = std::make_shared<Expansion>();
+		expansion->variables = [](std::string_view name) -> std::optional<std::string> {
+			if (name == "APP") return "svc";
+			return std::nullopt;
+		};
+		auto doc = ParsedDocument::fromFile((dir / "main.yaml").string(), expansion);
+		auto r   = doc->root.get();
+
+		check("variable", r->get("name")->as<std::string>() == "svc");
+		check("default", r->get("port")->as<int>() == 8080);
+		check("in string", r->get("greeting")->as<std::string>() == "hi svc!" and r->get("greeting")->asScalar()->view() == "hi svc!");
+		check("escaped", r->get("literal")->as<std::string>() == "${HOME}");
+		check("block", r->get("lines")->as<std::string>() == "app svc\n");
+		check("unset throws", throws([&] { r->get("unset")->as<std::string>(); }, "'NOPE' is not set"));
+		check("include", r->get("a")->get("db")->get("host")->as<std::string>() == "localhost" and
+		                     r->get("b")->get("log")->as<std::string>() == "info" and
+		                     r->get("list")->get(0u)->get("port")->as<int>() == 5432);
+		check("parsed once", expansion->includes->parses() == 2);
+		check("files", doc->tdoc.files.size() == 2);
+
+		// Each file is copied into the document once, and shared like an alias by the places including it.
+		check("one copy per file", r->get("a")->asDict() == r->get("b")->asDict() and doc->root->aliased);
+		r->get("a")->set("log", "debug");
+		check("shared", r->get("b")->get("log")->as<std::string>() == "debug" and
+		                    r->get("list")->get(0u)->get("port")->as<int>() == 5432);
+
+		std::string out = serialize(r);
+		check("serialized", out.find("${APP}") != std::string::npos and out.find("5432") != std::string::npos);
+		check("hash", ParsedDocument("port: ${PORT:-8080}\n", expansion).root->hash() == ParsedDocument("port: 8080\n").root->hash());
+
+		// Cached while in use, and parsed again when a file (or one it includes) changes.
+		auto again = ParsedDocument::fromFile((dir / "main.yaml").string(), expansion);
+		check("cache hit", expansion->includes->parses() == 2);
+		check("copies", again->root->get("a")->get("log")->as<std::string>() == "info");
+		writeFile("db.yaml", "host: ${DB_HOST:-db.internal}\nport: 5433\n");
+		auto changed = ParsedDocument::fromFile((dir / "main.yaml").string(), expansion);
+		check("reloaded", expansion->includes->parses() == 4 and
+		                      changed->root->get("a")->get("db")->get("port")->as<int>() == 5433 and
+		                      changed->root->get("a")->get("db")->get("host")->as<std::string>() == "db.internal");
+		check("old version kept", r->get("b")->get("db")->get("port")->as<int>() == 5432);
+
+		writeFile("c1.yaml", "x: !include \"c2.yaml\"\n");
+		writeFile("c2.yaml", "y: !include \"c1.yaml\"\n");
+		check("cycle", throws([&] { ParsedDocument::fromFile((dir / "c1.yaml").string(), expansion); }, "include cycle"));
+		check("self", throws([&] { ParsedDocument("x: !include \"c1.yaml\"\n", expansion, (dir / "c1.yaml").string()); }, "include cycle"));
+		check("missing file", throws([&] { ParsedDocument("x: !include \"nope.yaml\"\n", expansion); }, "failed to open"));
+		check("other tag", throws([&] { ParsedDocument("x: !secret \"a\"\n", expansion); }, "unsupported tag"));
+		check("unquoted path", throws([&] { ParsedDocument("x: !include db\n", expansion); }, "quoted path"));
+		check("tag without expansion", throws([&] { ParsedDocument("x: !include \"db.yaml\"\n"); }));
+		check("plain ${} without expansion", ParsedDocument("x: ${A}\n").root->get("x")->as<std::string>() == "${A}");
+
+		// The environment, by default.
+		setenv("SYAML_TEST_VAR", "42", 1);
+		auto env = std::make_shared<Expansion>();
+		check("environment", ParsedDocument("x: ${SYAML_TEST_VAR}\n", env).root->get("x")->as<int>() == 42);
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	std::filesystem::remove_all(dir);
+	return success;
+}
+
+bool test_document_cache() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running document cache test  -----------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	auto dir = std::filesystem::temp_directory_path() / "syaml_test_document_cache";
+	std::filesystem::create_directories(dir);
+	auto file = [&dir](const std::string& name) { return (dir / name).string(); };
+	auto writeFile = [&file](const std::string& name, const std::string& src) { std::ofstream(file(name)) << src; };
+
+	try {
+		writeFile("a.yaml", "x: 1\n");
+		writeFile("b.yaml", "x: 1\n");
+		std::string big;
+		for (int i = 0; i < 2000; i++) big += "k" + std::to_string(i) + ": {a: 1, b: [1, 2]}\n";
+		writeFile("c.yaml", big);
+
+		DocumentCache cache;
+		auto a = cache.get(file("a.yaml"));
+		check("cached", cache.get(file("a.yaml")) == a and cache.get((dir / "." / "a.yaml").string()) == a and cache.parses() == 1);
+		check("same contents", cache.get(file("b.yaml")) == a and cache.parses() == 1);
+		// Shared, so only readable.
+		static_assert(std::is_same<decltype(cache.get("")), std::shared_ptr<const RootNode>>::value);
+		Overlay layered;
+		layered.push(a).push(std::make_shared<const ParsedDocument>("y: 2\n"));
+		check("overlay", layered.get("x").as<int>() == 1 and layered.get("y").as<int>() == 2);
+
+		std::vector<std::shared_ptr<const RootNode>> got(8);
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < got.size(); i++) threads.emplace_back([&, i]() { got[i] = cache.get(file("c.yaml")); });
+		for (auto& t : threads) t.join();
+		check("coalesced", cache.parses() == 2 and std::all_of(got.begin(), got.end(), [&](auto& d) { return d == got[0]; }));
+		check("value", got[0]->get("k1999")->get("b")->get(1u)->as<int>() == 2);
+
+		// Rewritten with the same bytes, it isn't parsed again.
+		auto t = std::filesystem::last_write_time(file("a.yaml"));
+		std::filesystem::last_write_time(file("a.yaml"), t + std::chrono::hours(1));
+		check("touched", cache.get(file("a.yaml")) == a and cache.parses() == 2);
+
+		writeFile("a.yaml", "x: 22\n");
+		auto changed = cache.get(file("a.yaml"));
+		check("changed", changed != a and changed->get("x")->as<int>() == 22 and cache.parses() == 3);
+		check("old version", a->get("x")->as<int>() == 1 and cache.get(file("b.yaml")) == a);
+
+		// The same size and time: only seen when checking the contents.
+		t = std::filesystem::last_write_time(file("a.yaml"));
+		writeFile("a.yaml", "x: 33\n");
+		std::filesystem::last_write_time(file("a.yaml"), t);
+		check("same stamp", cache.get(file("a.yaml")) == changed);
+		cache.checkContent = true;
+		check("check content", cache.get(file("a.yaml"))->get("x")->as<int>() == 33 and cache.parses() == 4);
+
+		// Documents are only kept while someone holds them.
+		std::weak_ptr<const RootNode> weak = got[0];
+		got.clear();
+		check("released", weak.expired());
+		cache.get(file("c.yaml"));
+		check("parsed again", cache.parses() == 5);
+
+		// Files whose documents were freed are forgotten, so that loading many paths over time doesn't grow
+		// the cache. Held ones stay.
+		for (int i = 0; i < 300; i++) {
+			writeFile("many" + std::to_string(i) + ".yaml", "i: " + std::to_string(i) + "\n");
+			cache.get(file("many" + std::to_string(i) + ".yaml"));
+		}
+		uint64_t parses = cache.parses();
+		check("pruned", cache.size() <= 64 and cache.get(file("b.yaml")) == a and cache.parses() == parses);
+
+		bool threw = false;
+		try {
+			cache.get(file("nope.yaml"));
+		} catch (std::runtime_error& e) {
+			threw = std::string { e.what() }.find("failed to open") != std::string::npos;
+		}
+		check("missing", threw);
+		check("global", &DocumentCache::global() == &DocumentCache::global() and
+		                    DocumentCache::global().get(file("b.yaml"))->get("x")->as<int>() == 1);
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	std::filesystem::remove_all(dir);
+	return success;
+}
+
+bool test_interned_keys() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running interned keys test  ------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		std::string src = "base: &b {name: x, port: 1}\nitems:\n";
+		for (int i = 0; i < 100; i++) src += "  - {name: n" + std::to_string(i) + ", port: " + std::to_string(i) + ", tags: [a]}\n";
+		src += "merged:\n  <<: *b\n  port: 2\n";
+		ParsedDocument d(src, ParsedDocument::eYaml, true), plain(src, ParsedDocument::eYaml);
+
+		check("table", d.tdoc.keys and d.tdoc.keys->size() == 7 and !plain.tdoc.keys);
+		auto items = d.root->get("items")->asList();
+		check("ids", items->children[0]->asDict()->keyIds.size() == 3 and
+		                 items->children[0]->asDict()->keyIds == items->children[99]->asDict()->keyIds);
+
+		static const Key name("name"), port("port"), nope("nope");
+		int sum = 0;
+		for (auto item : items->children) sum += item->get(port)->as<int>();
+		check("lookup", sum == 4950 and items->children[7]->get(name)->as<std::string>() == "n7");
+		check("missing", items->children[0]->get(nope)->isEmpty() and d.root->get(nope)->isEmpty());
+		check("merged", d.root->get("merged")->get(port)->as<int>() == 2 and d.root->get("merged")->get(name)->as<std::string>() == "x");
+		check("not interned", plain.root->get("items")->get(3u)->get(port)->as<int>() == 3 and
+		                          plain.root->get("merged")->get(name)->as<std::string>() == "x");
+		check("same key, both documents", items->children[1]->get(port)->as<int>() == 1 and
+		                                      plain.root->get("items")->get(2u)->get(port)->as<int>() == 2 and
+		                                      items->children[5]->get(port)->as<int>() == 5);
+
+		// Keys that set() adds are found by comparing strings.
+		items->children[0]->set("extra", 1);
+		items->children[0]->set("port", 42);
+		check("after set", items->children[0]->get(Key("extra"))->as<int>() == 1 and items->children[0]->get(port)->as<int>() == 42);
+
+		check("query", Query("items[?port > 97].name").values<std::string>(d.root.get()) == std::vector<std::string> { "n98", "n99" });
+
+		ParsedDocument json("{\"a\": {\"k\": 1}, \"b\": {\"k\": 2}}", ParsedDocument::eJson, true);
+		check("json", json.tdoc.keys and json.tdoc.keys->size() == 3 and json.root->get("b")->get(Key("k"))->as<int>() == 2);
+		check("same hash", d.root->hash() != 0 and ParsedDocument(src, ParsedDocument::eYaml, true).root->hash() == plain.root->hash());
+
+		// Re-parsing a block drops its numbers; the rest keep theirs.
+		ParsedDocument r("a:\n  x: 1\n  y: 2\nb:\n  x: 3\n", ParsedDocument::eYaml, true);
+		size_t at = r.doc.src.find("y: 2");
+		Parser {}.reparse(r.root.get(), { (uint32_t)at, (uint32_t)at + 1, "z" });
+		check("reparsed", r.root->get("a")->get(Key("z"))->as<int>() == 2 and r.root->get("a")->get(Key("y"))->isEmpty() and
+		                      r.root->get("b")->get(Key("x"))->as<int>() == 3);
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_columns() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running columns test  ------------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+	auto error = [](auto f) -> std::string {
+		try {
+			f();
+		} catch (std::runtime_error& e) {
+			return e.what();
+		}
+		return "";
+	};
+
+	try {
+		static constexpr Schema points { Field<std::string_view> { "name" }, Field<double> { "x" }, Field<int> { "y" },
+		                                 Field<std::vector<int>> { "tags", false } };
+		std::string src = "base: &b {name: m, x: 7, y: 8}\npoints:\n";
+		for (int i = 0; i < 50; i++)
+			src += "  - {name: p" + std::to_string(i) + ", x: " + std::to_string(i) + ".5, y: " + std::to_string(i) + ", tags: [" +
+			       std::to_string(i) + "]}\n";
+		src += "  - {y: 50, x: 50.5, name: reordered, tags: []}\n"; // other key order
+		src += "  - {name: untagged, x: 51.5, y: 51}\n";             // optional key missing
+		src += "  - {name: empty, x: 52.5, y: 52, tags: }\n";         // optional key with no value
+		src += "  -\n    <<: *b\n    y: 53\n";                       // merged
+		src += "  - {name: p54, x: 54.5, y: 54, tags: [54]}\n";
+		ParsedDocument d(src);
+
+		auto cols   = points.columns(d.root->get("points"));
+		auto& names = std::get<0>(cols);
+		auto& xs    = std::get<1>(cols);
+		auto& ys    = std::get<2>(cols);
+		auto& tags  = std::get<3>(cols);
+		check("sizes", names.size() == 55 and xs.size() == 55 and ys.size() == 55 and tags.size() == 55);
+		check("uniform", names[7] == "p7" and xs[7] == 7.5 and ys[7] == 7 and tags[7] == std::vector<int> { 7 });
+		check("reordered", names[50] == "reordered" and xs[50] == 50.5 and ys[50] == 50 and tags[50].empty());
+		check("missing", names[51] == "untagged" and ys[51] == 51 and tags[51].empty());
+		check("empty", names[52] == "empty" and ys[52] == 52 and tags[52].empty());
+		check("merged", names[53] == "m" and xs[53] == 7 and ys[53] == 53);
+		check("after", names[54] == "p54" and tags[54] == std::vector<int> { 54 });
+		int sum = 0;
+		for (int y : ys) sum += y;
+		check("sum", sum == 50 * 49 / 2 + 50 + 51 + 52 + 53 + 54);
+
+		check("not a list", error([&] { points.columns(d.root->get("base")); }) ==
+		                        "Schema::columns() called on a node that is not a list");
+		check("not a dict", error([] { points.columns(ParsedDocument("l: [{name: a, x: 1, y: 2}, 3]\n").root->get("l")); }) ==
+		                        "Schema::columns(): item 1 is not a dict");
+		check("unknown", error([] {
+			                 points.columns(ParsedDocument("l:\n  - {name: a, x: 1, y: 2}\n  - {name: b, x: 1, y: 2, z: 3}\n").root->get("l"));
+		                 }) == "Schema::columns(): item 1: unknown key 'z'");
+		check("missing required", error([] {
+			                          points.columns(ParsedDocument("l:\n  - {name: a, x: 1, y: 2}\n  - {name: b, x: 1}\n").root->get("l"));
+		                          }) == "Schema::columns(): item 1: missing key 'y'");
+		check("bad value", error([] {
+			                   points.columns(ParsedDocument("l:\n  - {name: a, x: 1, y: 2}\n  - {name: b, x: 1, y: two}\n").root->get("l"));
+		                   }).rfind("Schema::columns(): item 1: ", 0) == 0);
+		check("empty list", std::get<0>(points.columns(ParsedDocument("l: []\n").root->get("l"))).empty());
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+bool test_numbers() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running numbers test  ------------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+	auto throws = [](auto f) {
+		try {
+			f();
+		} catch (std::runtime_error&) {
+			return true;
+		}
+		return false;
+	};
+
+	try {
+		// Short decimals, long mantissas and exponents: each the same as strtod() and strtof() read it.
+		std::vector<std::string> texts = { "0",     "-0",       "5",    "1.1e2", "10324.", ".5",   "0.1", "-12.375",  "1e22", "1e23",
+			                               "1e-22", "12345678", "123456789012.5", "9007199254740993", "0.30000000000000001",
+			                               "2.2250738585072011e-308", "4.9e-324", "3.4028234663852886e38",
+			                               "3.14159265358979323846264338327950288", "1.00000005960464477539062", "7e-10" };
+		std::string src = "l: [";
+		for (size_t i = 0; i < texts.size(); i++) src += (i ? ", " : "") + texts[i];
+		ParsedDocument d(src + "]\n");
+		auto doubles = d.root->get("l")->as<std::vector<double>>();
+		auto floats  = d.root->get("l")->as<std::vector<float>>();
+		bool same    = doubles.size() == texts.size() and floats.size() == texts.size();
+		for (size_t i = 0; same and i < texts.size(); i++) {
+			double e = strtod(texts[i].c_str(), nullptr);
+			float f  = strtof(texts[i].c_str(), nullptr);
+			same     = memcmp(&doubles[i], &e, sizeof(e)) == 0 and memcmp(&floats[i], &f, sizeof(f)) == 0;
+			if (not same) std::cout << "   '" << texts[i] << "' read as " << doubles[i] << " and " << floats[i] << "\n";
+		}
+		check("correctly rounded", same);
+		check("one value", d.root->get("l")->get(4u)->as<double>() == 10324. and d.root->get("l")->get(2u)->as<int>() == 5);
+
+		ParsedDocument ints("l:\n  - 0\n  - -7\n  - 2147483647\n  - -2147483648\n  - 00012\n");
+		check("int32", ints.root->get("l")->as<std::vector<int32_t>>() == std::vector<int32_t> { 0, -7, 2147483647, -2147483648, 12 });
+		ParsedDocument longs("l: [9223372036854775807, -9223372036854775808, 12345678901234]\n");
+		check("int64", longs.root->get("l")->as<std::vector<int64_t>>() ==
+		                   std::vector<int64_t> { INT64_MAX, INT64_MIN, 12345678901234 });
+		check("int32 overflow", throws([&] { longs.root->get("l")->as<std::vector<int32_t>>(); }));
+		check("int64 overflow", throws([] { ParsedDocument("l: [9223372036854775808]\n").root->get("l")->as<std::vector<int64_t>>(); }));
+		check("not an integer", throws([] { ParsedDocument("l: [1, 1.5]\n").root->get("l")->as<std::vector<int>>(); }) and
+		                            throws([] { ParsedDocument("l: [1, 1e3]\n").root->get("l")->as<std::vector<int64_t>>(); }));
+		check("not a number", throws([] { ParsedDocument("l: [1, x]\n").root->get("l")->as<std::vector<double>>(); }) and
+		                          throws([] { ParsedDocument("l: [1, inf]\n").root->get("l")->as<std::vector<double>>(); }) and
+		                          throws([] { ParsedDocument("l: [1, 1e400]\n").root->get("l")->as<std::vector<double>>(); }));
+
+		// Children that aren't plain numbers in the source are read as before.
+		ParsedDocument other("l:\n  - 1\n  - |-\n    2.5\n  - 3\nx: 1\n");
+		std::vector<double> out(3);
+		other.root->get("l")->asList()->toNumbers(out.data());
+		check("block", out == std::vector<double> { 1, 2.5, 3 });
+		other.root->set("x", "6.5");
+		check("set", other.root->get("x")->as<double>() == 6.5 and other.root->get("x")->as<std::string>() == "6.5");
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+// Inputs the fuzzer found problems with.
+bool test_malformed() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running malformed input test  ----------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	auto throws = [](const std::string& src) {
+		try {
+			ParsedDocument d(src);
+		} catch (std::runtime_error&) {
+			return true;
+		}
+		return false;
+	};
+
+	check("unexpected char", throws("a: @\n"));
+	check("unterminated string", throws("a: \"abc\n"));
+	check("number", throws("a: 1.2.3\n"));
+	check("empty", throws(""));
+	check("bad escape in a flow key", throws("a: {\"\\xZZ\": 1}\n"));
+
+	try {
+		// A blank line holding only whitespace used to be taken as the indent of a dash list, which recursed forever.
+		ParsedDocument d("a:\n  - 1\n \n      - 2\n");
+		check("blank line", d.root->get("a")->get(1u)->get(0u)->as<int>() == 2);
+
+		bool threw = false;
+		try {
+			ParsedDocument("a: word\n").root->get("a")->as<int>();
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		check("as<int>() on a word", threw);
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	}
+
+	return success;
+}
+
+#ifdef SYAML_STATS
+bool test_stats() {
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+	std::cout << "--------------------------- Running stats test  --------------------------------------------\n";
+	std::cout << "--------------------------------------------------------------------------------------------\n";
+
+	bool success = true;
+
+	auto check = [&success](std::string msg, bool cond) {
+		if (!cond) {
+			std::cout << " - FAILED CHECK: " << msg << "\n";
+			success = false;
+		}
+	};
+
+	try {
+		std::string src = "a: 1\nb:\n  c: [1, 2]\n  d:\n    - 3\n    - 4\ne:\n";
+		ParsedDocument d(src);
+		const ParseStats& stats = d.root->stats;
+		d.root->stats.print(std::cout);
+		std::cout << "\n";
+
+		check("bytes", stats.bytes == src.length());
+		check("tokens", stats.tokens == d.tdoc.tokens.size());
+		check("dicts", stats.dicts == 2);
+		check("lists", stats.lists == 2);
+		check("scalars", stats.scalars == 5);
+		check("empties", stats.empties == 1);
+		check("maxDepth", stats.maxDepth == 3);
+		check("rejects", stats.rejects > 0);
+		check("allocBytes", stats.allocBytes > stats.tokens * sizeof(Tok));
+
+		d.root->get("a")->as<int>();
+		bool threw = false;
+		try {
+			d.root->get("e")->as<int>();
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		check("conversions", threw and stats.conversions == 2 and stats.exceptions == 1);
+
+		Document bad("a: [1, 2\n");
+		TokenizedDoc tdoc = lex(&bad);
+		Parser p;
+		try {
+			delete p.parse(&tdoc);
+		} catch (std::runtime_error&) {
+		}
+		check("parse errors counted on the Parser", p.stats.exceptions == 1);
+
+	} catch(std::runtime_error& e) {
+		std::cout << " - ERROR " << e.what() << "\n";
+		success = false;
+	} catch(...) {
+		success = false;
+	}
+
+	return success;
+}
+#endif
 
 int main() {
 
@@ -244,6 +2003,32 @@ int main() {
 	bool success = true;
 	success &= test_simple();
 	success &= test_complex();
+	success &= test_reparse();
+	success &= test_reload();
+	success &= test_diff();
+	success &= test_hash();
+	success &= test_snapshot();
+	success &= test_flow_map();
+	success &= test_anchors();
+	success &= test_block_scalars();
+	success &= test_strings();
+	success &= test_json();
+	success &= test_output();
+	success &= test_schema();
+	success &= test_validate();
+	success &= test_query();
+	success &= test_batch();
+	success &= test_typed_set();
+	success &= test_overlay();
+	success &= test_expansion();
+	success &= test_document_cache();
+	success &= test_interned_keys();
+	success &= test_columns();
+	success &= test_numbers();
+	success &= test_malformed();
+#ifdef SYAML_STATS
+	success &= test_stats();
+#endif
 	// success &= test_python_files(".");
 
 	std::cout << "\n\n";
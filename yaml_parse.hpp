@@ -1,12 +1,27 @@
 #pragma once
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <cmath>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <set>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #define simpleAssert(cond) assert((cond));
@@ -14,8 +29,24 @@
 // #define syamlPrintf(...) printf(__VA_ARGS__);
 #define syamlPrintf(...) {};
 
+// Define SYAML_STATS (everywhere the header is included) to have the lexer and parser fill a `ParseStats`.
+// Without it the statements are compiled out.
+#ifdef SYAML_STATS
+#define syamlStat(...) __VA_ARGS__
+#else
+#define syamlStat(...)
+#endif
+
 #ifdef SYAML_IMPL
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
 #endif
 #include <sstream>
 #include <type_traits>
@@ -44,13 +75,13 @@
 // FIXME: This implementation fails the tests from serialized pyyaml outputs because it does not
 // support:
 //          1) Parsing multiple layers of lists on one line, for example: ' - - 1'
-//          2) Lexing/parsing maps using the '{ ... }' syntax.
 //
 // NOTE: Adding a set() method made the code a little incoherent because originally I thought to tie values
 //       to ranges of the document's source string.
 //       With set() however, there is no longer any fixed relationship to the document.
-//       So I handled that by having every node have a string. It is empty if the node corresponds to one
-//       from the document. Otherwise it is the textual representation of the value passed to set()
+//       So I handled that by having every node say what set() stored in it, if anything: a number or a
+//       boolean as such (formatted only when written out or read as text), or else a string in
+//       `valueStr`.
 //
 
 namespace syaml {
@@ -167,7 +198,7 @@ namespace syaml {
     template <typename T>
     struct is_map<
         T, typename std::enable_if<std::is_same<
-               T, std::unordered_map<typename T::value_type, typename T::mapped_type>>::value>::type> {
+               T, std::unordered_map<typename T::key_type, typename T::mapped_type>>::value>::type> {
         static const bool value = true;
     };
 
@@ -231,6 +262,12 @@ namespace syaml {
             eString,
             eOpenBrace,
             eCloseBrace,
+            eOpenCurly,
+            eCloseCurly,
+            eAnchor,      // `&name`
+            eAlias,       // `*name`
+            eBlockScalar, // `|` or `>` and the lines under it, see `BlockScalar`
+            eTag,         // `!name` or `!!name`, see `Expansion`
             eEOF
         } lexeme;
         uint32_t n = 0;
@@ -261,6 +298,12 @@ namespace syaml {
             case eString: os << "str"; break;
             case eOpenBrace: os << "openBrace"; break;
             case eCloseBrace: os << "closeBrace"; break;
+            case eOpenCurly: os << "openCurly"; break;
+            case eCloseCurly: os << "closeCurly"; break;
+            case eAnchor: os << "anchor"; break;
+            case eAlias: os << "alias"; break;
+            case eBlockScalar: os << "block, indent=" << n; break;
+            case eTag: os << "tag"; break;
             case eEOF: os << "eof"; break;
             }
             if (lexeme != eNL) os << ", '" << std::string_view { doc.src }.substr(start, end - start);
@@ -270,10 +313,60 @@ namespace syaml {
 
     struct Parser;
 
+#ifdef SYAML_STATS
+    // Filled by lex() and Parser::parse(), and kept on the RootNode. Times are in milliseconds.
+    // `allocBytes` counts the token array and the nodes (with their child arrays), not every allocation.
+    struct ParseStats {
+        uint64_t bytes      = 0;
+        uint64_t tokens     = 0;
+
+        uint64_t dicts      = 0;
+        uint64_t lists      = 0;
+        uint64_t scalars    = 0;
+        uint64_t empties    = 0;
+        uint64_t rejects    = 0; // ParserGuard::reject(), i.e. backtracks
+        uint64_t exceptions = 0; // parse errors, and as<>() calls that threw
+        uint32_t maxDepth   = 0;
+
+        double lexMs        = 0;
+        double parseMs      = 0;
+
+        uint64_t allocBytes = 0;
+
+        // Updated by as<>() on nodes of the tree, under the root's lock.
+        uint64_t conversions = 0;
+        double conversionMs  = 0;
+
+        void print(std::ostream& os) const;
+    };
+
+    namespace {
+        inline double msSince(std::chrono::steady_clock::time_point t0) {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        }
+    }
+#endif
+
+    struct Expansion;
+    struct ParsedDocument;
+    class KeyTable;
+
     using ConstTok = const Tok;
     struct TokenizedDoc {
         Document* doc;
         std::vector<Tok> tokens;
+        syamlStat(ParseStats stats;)
+
+        // Filled by `Expansion::prepare()`: the expansion to apply to scalars, the included documents by
+        // the token of their path, and the files read for this document with their modification time and
+        // size at the time.
+        const Expansion* expansion = nullptr;
+        std::unordered_map<uint32_t, std::shared_ptr<const ParsedDocument>> includes;
+        std::vector<std::pair<std::string, std::pair<int64_t, uint64_t>>> files;
+
+        // The document's dict keys, if the parser interned them (see `Parser::internKeys`).
+        std::shared_ptr<KeyTable> keys;
+
         inline ConstTok& operator[](uint32_t i) const {
             return tokens[i];
         }
@@ -308,15 +401,222 @@ namespace syaml {
         return c >= '0' and c <= '9';
     }
 
+    // Escape sequences in double-quoted strings, as in YAML. The lexer counts them in the string token's
+    // `n`, so that the common string without any can be used in place.
+    static inline bool is_escape(char c) {
+        return std::strchr("0abtnvfre \"/\\xuUN_LP\t", c) != nullptr and c != 0;
+    }
+
+    // `s` (the inside of a double-quoted string) with its escape sequences replaced.
+    inline std::string unescape(std::string_view s) {
+        auto utf8 = [](std::string& out, uint32_t c) {
+            if (c < 0x80) {
+                out += (char)c;
+            } else if (c < 0x800) {
+                out += (char)(0xc0 | (c >> 6));
+                out += (char)(0x80 | (c & 0x3f));
+            } else if (c < 0x10000) {
+                out += (char)(0xe0 | (c >> 12));
+                out += (char)(0x80 | ((c >> 6) & 0x3f));
+                out += (char)(0x80 | (c & 0x3f));
+            } else {
+                out += (char)(0xf0 | (c >> 18));
+                out += (char)(0x80 | ((c >> 12) & 0x3f));
+                out += (char)(0x80 | ((c >> 6) & 0x3f));
+                out += (char)(0x80 | (c & 0x3f));
+            }
+        };
+        std::string out;
+        out.reserve(s.size());
+        for (size_t i = 0; i < s.size(); i++) {
+            if (s[i] != '\\') {
+                out += s[i];
+                continue;
+            }
+            if (++i == s.size()) throw std::runtime_error("string ends with a '\\'");
+            int hex = 0;
+            switch (s[i]) {
+            case '0': out += '\0'; break;
+            case 'a': out += '\a'; break;
+            case 'b': out += '\b'; break;
+            case 't':
+            case '\t': out += '\t'; break;
+            case 'n': out += '\n'; break;
+            case 'v': out += '\v'; break;
+            case 'f': out += '\f'; break;
+            case 'r': out += '\r'; break;
+            case 'e': out += '\x1b'; break;
+            case ' ':
+            case '"':
+            case '/':
+            case '\\': out += s[i]; break;
+            case 'N': utf8(out, 0x85); break;
+            case '_': utf8(out, 0xa0); break;
+            case 'L': utf8(out, 0x2028); break;
+            case 'P': utf8(out, 0x2029); break;
+            case 'x': hex = 2; break;
+            case 'u': hex = 4; break;
+            case 'U': hex = 8; break;
+            default: throw std::runtime_error("unknown escape sequence '\\" + std::string { s[i] } + "'");
+            }
+            if (hex) {
+                uint32_t c = 0;
+                auto r     = std::from_chars(s.data() + i + 1, s.data() + std::min(s.size(), i + 1 + hex), c, 16);
+                if (r.ec != std::errc {} or r.ptr != s.data() + i + 1 + hex or c > 0x10ffff)
+                    throw std::runtime_error("bad \\" + std::string { s[i] } + " escape sequence");
+                utf8(out, c);
+                i += hex;
+            }
+        }
+        return out;
+    }
+
+    // The types `parseNumber()` reads: float, double, and signed integers of 32 and 64 bits.
+    template <class V>
+    using is_plain_number = std::bool_constant<std::is_same<V, float>::value or std::is_same<V, double>::value or
+                                               (std::is_integral<V>::value and std::is_signed<V>::value and sizeof(V) >= 4)>;
+
+    // `s` as a V (see `is_plain_number`) if it is a decimal number that fits, read as a stringstream would
+    // read it, or nothing. std::from_chars() does the reading, and rounds floating point correctly; the
+    // checks before it turn away what it takes and a stringstream doesn't: "inf", "nan" and "+-1".
+    template <class V> inline Opt<V> parseNumber(std::string_view s) {
+        static_assert(is_plain_number<V>::value);
+        size_t i = s.size() and (s[0] == '-' or s[0] == '+');
+        if (i == s.size() or not(is_numer(s[i]) or s[i] == '.')) return {};
+        if (s[0] == '+') s.remove_prefix(1);
+        V v;
+        auto r = std::from_chars(s.data(), s.data() + s.size(), v);
+        if (r.ec != std::errc {} or r.ptr != s.data() + s.size()) return {};
+        if constexpr (std::is_floating_point<V>::value)
+            if (not std::isfinite(v)) return {};
+        return v;
+    }
+
+    // `s` as a double-quoted string, escaping what needs to be.
+    inline std::string quote(std::string_view s) {
+        static const char hex[] = "0123456789abcdef";
+        std::string out;
+        out.reserve(s.size() + 2);
+        out += '"';
+        for (char c : s) {
+            switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            case '\r': out += "\\r"; break;
+            default:
+                if ((unsigned char)c < 0x20) out += "\\x", out += hex[c >> 4], out += hex[c & 15];
+                else out += c;
+            }
+        }
+        out += '"';
+        return out;
+    }
+
+    // A block scalar (`|` literal or `>` folded) is lexed as one token, from the indicator to the end of
+    // the block's last line, with `n` the indentation of its contents. Nothing is copied while parsing:
+    // the contents are only de-indented (and folded) when asked for, and `view()` can often point
+    // straight into the source.
+    struct BlockScalar {
+        char style = '|'; // '|' or '>'
+        char chomp = 0;   // '-' strips the final line breaks, '+' keeps them all, 0 keeps one
+        uint32_t indent = 0;
+        std::string_view src;
+        std::string_view body; // the lines under the header, still indented, without the last line break
+        bool hasBody = false;
+
+        // Whether the last line has a line break in the source, rather than ending the file.
+        inline bool endsWithBreak() const {
+            return body.data() + body.size() < src.data() + src.size();
+        }
+
+        inline static BlockScalar of(std::string_view src, const Tok& t) {
+            BlockScalar b;
+            b.src    = src;
+            b.style  = src[t.start];
+            b.indent = t.n;
+            for (uint32_t i = t.start + 1; i < t.end and src[i] != ' ' and src[i] != '\n'; i++)
+                if (src[i] == '-' or src[i] == '+') b.chomp = src[i];
+            auto nl   = src.find('\n', t.start);
+            b.hasBody = nl < t.end;
+            if (b.hasBody) b.body = src.substr(nl + 1, t.end - nl - 1);
+            return b;
+        }
+
+        // Call `f` with each line of the body, without its indentation. Blank lines are empty.
+        template <class F> inline void forEachLine(F&& f) const {
+            if (not hasBody) return;
+            size_t p = 0;
+            while (true) {
+                size_t eol = std::min(body.find('\n', p), body.size());
+                size_t q   = p;
+                while (q < eol and q - p < indent and body[q] == ' ') q++;
+                std::string_view line = body.substr(q, eol - q);
+                if (q - p < indent and line.find_first_not_of(" \t") == std::string_view::npos) line = {};
+                f(line);
+                if (eol == body.size()) break;
+                p = eol + 1;
+            }
+        }
+
+        // The contents, de-indented, folded and chomped.
+        inline std::string text() const {
+            std::string out;
+            out.reserve(body.size());
+            int breaks = -1, leading = 0; // line breaks since the last non-empty line, -1 before the first
+            bool prevMore = false;
+            forEachLine([&](std::string_view line) {
+                if (line.empty()) {
+                    breaks < 0 ? leading++ : breaks++;
+                    return;
+                }
+                // In folded scalars, a break between two lines of text is a space, unless there are blank
+                // lines between them. Lines indented more than the rest are kept as they are.
+                bool more = style == '|' or line[0] == ' ' or line[0] == '\t';
+                if (breaks < 0)
+                    out.append(leading, '\n');
+                else if (not more and not prevMore)
+                    out.append(breaks == 1 ? 1 : breaks - 1, breaks == 1 ? ' ' : '\n');
+                else
+                    out.append(breaks, '\n');
+                out.append(line);
+                breaks   = 1;
+                prevMore = more;
+            });
+            // The break of the last line is only kept if the source has it.
+            int kept = chomp == '+' ? (breaks < 0 ? leading : breaks) : chomp == 0 and breaks > 0;
+            if (kept > 0 and not endsWithBreak()) kept--;
+            out.append(kept, '\n');
+            return out;
+        }
+
+        // The contents as a range of the source, when they are one (a single line, with nothing to
+        // de-indent or fold).
+        inline std::optional<std::string_view> view() const {
+            if (not hasBody) return std::string_view {};
+            if (body.find('\n') != std::string_view::npos) return {};
+            if (body.find_first_not_of(" \t") == std::string_view::npos)
+                return chomp == '+' ? std::nullopt : std::optional { std::string_view {} };
+            std::string_view line = body.substr(indent);
+            if (chomp == '-') return line;
+            // The line and the break after it, if there is one.
+            if (not endsWithBreak()) return line;
+            return std::string_view { line.data(), line.size() + 1 };
+        }
+    };
+
     inline TokenizedDoc lex(Document* doc) {
+        syamlStat(auto t0 = std::chrono::steady_clock::now();)
         TokenizedDoc out;
         out.doc       = doc;
 
         auto& ts      = out.tokens;
         const auto& s = doc->src;
         uint32_t N    = (uint32_t)s.length();
-        simpleAssert(N > 0);
+        if (N == 0) throw std::runtime_error("lex() called on an empty document");
         uint32_t i = 0;
+        int flowDepth = 0; // block scalars can't be in [] or {}
         while (i < N) {
             uint32_t i0 = i;
             uint32_t n  = 0;
@@ -336,24 +636,111 @@ namespace syaml {
                 ts.push_back(Tok { Tok::eWhitespace, n, i0, i });
             }
 
-            // String
+            // String. `n` is the number of escape sequences in it.
             else if (s[i] == '\"') {
                 i++;
                 while (i < N and s[i] != '"') {
-                    n++;
+                    if (s[i] == '\\') {
+                        if (i + 1 == N or not is_escape(s[i + 1]))
+                            throw std::runtime_error("bad escape sequence in string at byte " + std::to_string(i));
+                        n++;
+                        i++;
+                    }
                     i++;
                 }
-                simpleAssert(s[i] == '"');
+                if (i == N) throw std::runtime_error("unterminated string starting at byte " + std::to_string(i0));
                 // ts.push_back(Tok{Tok::eString,n,i0+1,i++});
                 ts.push_back(Tok { Tok::eString, n, i0, ++i });
             }
 
-            // Ident
-            else if (is_alpha(s[i])) {
-                while (i < N and (is_alpha(s[i]) or is_numer(s[i]))) { i++; }
+            // Ident, which can have `${...}` variables in it (see `Expansion`)
+            else if (is_alpha(s[i]) or (s[i] == '$' and i + 1 < N and s[i + 1] == '{')) {
+                while (i < N) {
+                    if (is_alpha(s[i]) or is_numer(s[i])) {
+                        i++;
+                    } else if (s[i] == '$' and i + 1 < N and s[i + 1] == '{') {
+                        uint32_t v = i;
+                        while (i < N and s[i] != '}' and s[i] != '\n') i++;
+                        if (i == N or s[i] != '}')
+                            throw std::runtime_error("unterminated '${' at byte " + std::to_string(v));
+                        i++;
+                    } else {
+                        break;
+                    }
+                }
+                ts.push_back(Tok { Tok::eIdent, n, i0, i });
+            }
+
+            // Tag
+            else if (s[i] == '!') {
+                i += i + 1 < N and s[i + 1] == '!' ? 2 : 1;
+                uint32_t name = i;
+                while (i < N and (is_alpha(s[i]) or is_numer(s[i]) or s[i] == '-')) { i++; }
+                if (i == name) throw std::runtime_error("empty tag name at byte " + std::to_string(i0));
+                ts.push_back(Tok { Tok::eTag, n, i0, i });
+            }
+
+            // Merge key, which is used like an ident
+            else if (s[i] == '<' and i + 1 < N and s[i + 1] == '<') {
+                i += 2;
                 ts.push_back(Tok { Tok::eIdent, n, i0, i });
             }
 
+            // Anchor or alias
+            else if (s[i] == '&' or s[i] == '*') {
+                i++;
+                while (i < N and (is_alpha(s[i]) or is_numer(s[i]) or s[i] == '-')) { i++; }
+                if (i == i0 + 1) throw std::runtime_error("empty anchor or alias name at byte " + std::to_string(i0));
+                ts.push_back(Tok { s[i0] == '&' ? Tok::eAnchor : Tok::eAlias, n, i0, i });
+            }
+
+            // Block scalar: the header (`|`, `>`, with optional chomping and indentation indicators and a
+            // comment), then every line indented more than the line the header is on, and blank lines.
+            else if ((s[i] == '|' or s[i] == '>') and flowDepth == 0) {
+                uint32_t lineStart = i0;
+                while (lineStart > 0 and s[lineStart - 1] != '\n') lineStart--;
+                uint32_t lineIndent = 0;
+                while (s[lineStart + lineIndent] == ' ') lineIndent++;
+
+                i++;
+                uint32_t explicitIndent = 0;
+                bool keep = false;
+                for (int k = 0; k < 2 and i < N; k++) {
+                    if (s[i] == '-' or s[i] == '+') keep = s[i++] == '+';
+                    else if (s[i] >= '1' and s[i] <= '9') explicitIndent = s[i++] - '0';
+                }
+                while (i < N and (s[i] == ' ' or s[i] == '\t')) i++;
+                if (i < N and s[i] == '#')
+                    while (i < N and s[i] != '\n') i++;
+                if (i < N and s[i] != '\n')
+                    throw std::runtime_error("unexpected text after block scalar header at byte " + std::to_string(i));
+
+                uint32_t indent = explicitIndent ? lineIndent + explicitIndent : 0;
+                uint32_t end = i, keepEnd = i;
+                for (uint32_t p = i + 1; p < N;) {
+                    uint32_t q = p;
+                    while (q < N and s[q] == ' ') q++;
+                    uint32_t eol = q;
+                    while (eol < N and s[eol] != '\n') eol++;
+                    bool blank = true;
+                    for (uint32_t k = q; k < eol and blank; k++) blank = s[k] == ' ' or s[k] == '\t';
+
+                    if (indent == 0 and !blank) {
+                        // The first line with text sets the indentation.
+                        if (q - p <= lineIndent) break;
+                        indent = q - p;
+                    }
+                    if (indent and q - p >= indent)
+                        end = eol;
+                    else if (!blank)
+                        break;
+                    keepEnd = eol;
+                    p       = eol + 1;
+                }
+                i = keep ? keepEnd : end;
+                ts.push_back(Tok { Tok::eBlockScalar, indent, i0, i });
+            }
+
             // Single dash
             else if (s[i] == '-'
                      and (i >= s.length() or s[i + 1] == ' ' or s[i + 1] == '\n' or s[i + 1] == '\t')) {
@@ -367,19 +754,19 @@ namespace syaml {
                 int n_d = 0;
                 while (i < N) {
                     if (s[i] == 'e') {
-                        if (n_e) simpleAssert(false && "multiple 'e' in float.");
+                        if (n_e) throw std::runtime_error("error while lexing a number, multiple 'e'");
                         n_e++;
                         i++;
                         // allow like '1e-2'
                         if (i < N and s[i] == '-') { i++; }
                     } else if (s[i] == '.') {
-                        if (n_d) simpleAssert(false && "multiple '.' in float.");
+                        if (n_d) throw std::runtime_error("error while lexing a number, multiple '.'");
                         n_d++;
                         i++;
                     } else if (is_numer(s[i])) {
                         i++;
-                    } else if (s[i] == '#' or s[i] == ',' or s[i] == ']' or s[i] == ' ' or s[i] == '\n'
-                               or s[i] == '\t') {
+                    } else if (s[i] == '#' or s[i] == ',' or s[i] == ']' or s[i] == '}' or s[i] == ' '
+                               or s[i] == '\n' or s[i] == '\t') {
                         break;
                     } else {
                         throw std::runtime_error("error while lexing a number, unexpected char: "
@@ -397,17 +784,33 @@ namespace syaml {
             else if (s[i] == ':')
                 ts.push_back(Tok { Tok::eColon, n, i0, ++i });
             else if (s[i] == '[')
-                ts.push_back(Tok { Tok::eOpenBrace, n, i0, ++i });
+                flowDepth++, ts.push_back(Tok { Tok::eOpenBrace, n, i0, ++i });
             else if (s[i] == ']')
-                ts.push_back(Tok { Tok::eCloseBrace, n, i0, ++i });
-            else { simpleAssert(false); }
+                flowDepth--, ts.push_back(Tok { Tok::eCloseBrace, n, i0, ++i });
+            else if (s[i] == '{')
+                flowDepth++, ts.push_back(Tok { Tok::eOpenCurly, n, i0, ++i });
+            else if (s[i] == '}')
+                flowDepth--, ts.push_back(Tok { Tok::eCloseCurly, n, i0, ++i });
+            else {
+                throw std::runtime_error("unexpected char '" + std::string { s[i] } + "' at byte " + std::to_string(i));
+            }
         }
 
         ts.push_back(Tok { Tok::eEOF, 0, i, i });
 
+        syamlStat(out.stats.bytes = N; out.stats.tokens = ts.size();
+                  out.stats.allocBytes = ts.capacity() * sizeof(Tok); out.stats.lexMs = msSince(t0);)
         return out;
     }
 
+    // Whether `src` could be a JSON document, i.e. its first non-whitespace character opens an object.
+    // YAML flow maps look the same, so this only says which parser to try first.
+    inline bool looksLikeJson(std::string_view src) {
+        for (char c : src)
+            if (c != ' ' and c != '\t' and c != '\n') return c == '{';
+        return false;
+    }
+
     // ---------------------------------------------------------------------------------------------------
     //
     //   AST
@@ -424,6 +827,80 @@ namespace syaml {
         struct Serialization;
     }
 
+    // The distinct dict keys of a document, each stored once and numbered. Filled by the parser when it
+    // interns keys (see `Parser::internKeys`), and not changed afterwards.
+    class KeyTable {
+    public:
+        static constexpr uint32_t kAbsent = ~0u;
+
+        // The number of `k`, added if new.
+        inline uint32_t intern(std::string_view k) {
+            auto it = ids.find(k);
+            if (it != ids.end()) return it->second;
+            strings.emplace_back(k);
+            return ids.emplace(strings.back(), (uint32_t)strings.size() - 1).first->second;
+        }
+        // The number of `k`, or kAbsent.
+        inline uint32_t find(std::string_view k) const {
+            auto it = ids.find(k);
+            return it == ids.end() ? kAbsent : it->second;
+        }
+        inline size_t size() const {
+            return strings.size();
+        }
+        // Unique to this table, for `Key` to know which table its cached number is from.
+        inline uint32_t serial() const {
+            return serial_;
+        }
+
+    private:
+        static inline std::atomic<uint32_t> nextSerial { 0 };
+        std::deque<std::string> strings;
+        std::unordered_map<std::string_view, uint32_t> ids;
+        uint32_t serial_ = nextSerial.fetch_add(1, std::memory_order_relaxed);
+    };
+
+    // A dict key looked up many times, like a field read from every item of a list:
+    //
+    //      static const Key name("name");
+    //      for (auto item : items->children) names.push_back(item->get(name)->as<std::string>());
+    //
+    // In documents with interned keys, its number is looked up in the document's `KeyTable` once, and
+    // then compared with the numbers the dicts keep for their keys. Elsewhere it is compared as a string.
+    class Key {
+    public:
+        inline Key() {
+        }
+        inline explicit Key(std::string k)
+            : k(std::move(k)) {
+        }
+        inline Key(const Key& o)
+            : k(o.k) {
+        }
+        inline Key& operator=(const Key& o) {
+            k = o.k;
+            cached.store(~uint64_t(0), std::memory_order_relaxed);
+            return *this;
+        }
+
+        inline const std::string& str() const {
+            return k;
+        }
+
+        // The number of this key in `table`, or KeyTable::kAbsent.
+        inline uint32_t idIn(const KeyTable& table) const {
+            uint64_t c = cached.load(std::memory_order_relaxed);
+            if (uint32_t(c >> 32) == table.serial()) return uint32_t(c);
+            uint32_t id = table.find(k);
+            cached.store(uint64_t(table.serial()) << 32 | id, std::memory_order_relaxed);
+            return id;
+        }
+
+    private:
+        std::string k;
+        mutable std::atomic<uint64_t> cached { ~uint64_t(0) }; // the table's serial, and the number in it
+    };
+
     struct Node {
 
     public:
@@ -449,6 +926,7 @@ namespace syaml {
         // template <class T> Node* get(const T& k) const;
         Node* get(const char* k, int len) const;
         Node* get(const char* k) const;
+        Node* get(const Key& k) const;
         Node* get(uint32_t i) const;
         template <class T> void set(const char* k, const T& v);
 
@@ -461,7 +939,15 @@ namespace syaml {
         friend struct ScalarNode; // why is this neeeded.
         friend struct DictNode;   // why is this neeeded.
 
-        bool isEmpty() const;
+        inline virtual bool isEmpty() const {
+            return false;
+        }
+
+        // A stable 64-bit hash of the subtree's contents: keys (in any order), structure and normalized
+        // scalars (so `1.0` and `1.` hash the same, as do `"a"` and the same string given to set()).
+        // Computed lazily in one pass and cached; set() invalidates it up the parent chain.
+        uint64_t hash() const;
+        uint64_t hash_() const;
 
         // protected:
     public:
@@ -482,14 +968,39 @@ namespace syaml {
             simpleAssert(false);
             return nullptr;
         }
+        inline virtual Node* get_(const Key& k) const {
+            return get_(k.str().c_str(), (int)k.str().size());
+        }
         // void set_(const char* k, DictNode* v); // NOTE:Takes ownership
         template <class T> void set_(const char* k, const T& v);
 
         Node* parent       = {};
         TokenizedDoc* tdoc = {};
         SourceRange tokRange;
-        std::string valueStr; // if not null: this node is from a set() call
-        bool valueStrIsString = false;
+        // What set() stored in this node, if it is from a set() call. Strings (`eSetString`, written out
+        // quoted) and other values as text (`eSetText`, written out as they are) are in `valueStr`, and
+        // numbers and booleans in the ScalarNode.
+        enum SetKind : uint8_t { eNotSet, eSetInt, eSetDouble, eSetBool, eSetString, eSetText };
+        SetKind setKind = eNotSet;
+        std::string valueStr;
+        bool dirty            = false; // this subtree was changed by set(), so the source no longer describes it
+        // Set by hash_(). Atomic, because nodes reached through a Snapshot are hashed without a lock,
+        // possibly by several threads at once: they all store the same value.
+        mutable std::atomic<bool> hashValid { false };
+        mutable std::atomic<uint64_t> cachedHash { 0 };
+        mutable std::atomic<uint32_t> refs { 1 }; // see `retainNode()`
+
+        // Invalidate the cached hashes of this node and its ancestors.
+        // NOTE: A cached hash implies the cached hashes of all descendants, so we can stop early.
+        inline void invalidateHash() {
+            for (Node* n = this; n and n->hashValid; n = n->parent) n->hashValid = false;
+        }
+
+        // Mark this node and its ancestors as changed.
+        inline void markDirty() {
+            invalidateHash();
+            for (Node* n = this; n and !n->dirty; n = n->parent) n->dirty = true;
+        }
 
         DictNode* asDict();
         ListNode* asList();
@@ -497,6 +1008,31 @@ namespace syaml {
         EmptyNode* asEmpty();
     };
 
+    // Nodes are reference counted so that subtrees can be shared (see `Snapshot`). Containers hold one
+    // reference to each child, and release it instead of deleting the child.
+    inline Node* retainNode(const Node* n) {
+        n->refs.fetch_add(1, std::memory_order_relaxed);
+        return const_cast<Node*>(n);
+    }
+    inline void releaseNode(const Node* n) {
+        if (n and n->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete n;
+    }
+    struct NodeReleaser {
+        inline void operator()(const Node* n) const {
+            releaseNode(n);
+        }
+    };
+    using NodeUPtr = std::unique_ptr<Node, NodeReleaser>;
+
+    // Budget for expanding aliases in toVector()/toMap(), in nodes. Set by as() from
+    // `RootNode::aliasExpansionLimit` for documents with aliases, so that a small document aliasing
+    // the same subtree over and over ("billion laughs") can't take exponential time and memory.
+    inline thread_local uint64_t aliasExpansionLeft = ~uint64_t(0);
+    inline void spendAliasExpansion(uint64_t n) {
+        if (n > aliasExpansionLeft) throw std::runtime_error("aliases expand to more nodes than aliasExpansionLimit");
+        aliasExpansionLeft -= n;
+    }
+
     struct EmptyNode : public Node {
         using Node::Node;
         inline virtual ~EmptyNode() {
@@ -504,7 +1040,16 @@ namespace syaml {
 
         virtual Node* get_(const char* k, int len=-1) const override;
         virtual Node* get_(uint32_t k) const override;
+        inline bool isEmpty() const override {
+            return true;
+        }
     };
+
+    // Returned by `get()` for missing keys and out-of-bounds indices. Shared by all documents.
+    inline EmptyNode* emptySentinel() {
+        static EmptyNode sentinel(nullptr, SourceRange { 0, 0 });
+        return &sentinel;
+    }
     struct ListNode : public Node {
 
         // private:
@@ -519,10 +1064,21 @@ namespace syaml {
         virtual Node* get_(uint32_t k) const override;
 
         template <class V> inline std::vector<V> toVector() const {
+            if constexpr (is_plain_number<V>::value) {
+                std::vector<V> out(children.size());
+                toNumbers(out.data());
+                return out;
+            }
+            spendAliasExpansion(children.size());
             std::vector<V> out;
             for (auto& child : children) { out.push_back(child->as_<V>({})); }
             return out;
         }
+        // Every child as a V (float, double, or a signed integer of 32 or 64 bits) into `out`, which has
+        // room for children.size(). Plain decimal numbers are read from the source in one pass over the
+        // list, without a stringstream (see `parseNumber()`). Any other child is read with as<V>(), and
+        // throws like it. Used by toVector() and as<std::vector<V>>() for these types.
+        template <class V> void toNumbers(V* out) const;
         inline bool isFromDash() const {
             return fromDash;
         }
@@ -533,6 +1089,10 @@ namespace syaml {
         // private:
         // std::unordered_map<std::string, Node*> children;
         std::vector<std::pair<std::string, Node*>> children;
+        bool fromFlow = false;
+        // The numbers of the keys in `tdoc->keys`, when the parser interned them. Only used while it is as
+        // long as `children`: adding keys leaves it shorter, and whatever removes keys clears it.
+        std::vector<uint32_t> keyIds;
 
     public:
         using Node::Node;
@@ -545,17 +1105,91 @@ namespace syaml {
 
         virtual Node* get_(const char* k, int len=-1) const override;
         virtual Node* get_(uint32_t k) const override;
+        virtual Node* get_(const Key& k) const override;
+
+        // The value of `k`, or nullptr. Keys not in this dict are looked up in the dicts merged into
+        // it with `<<` (in order), when there are any.
+        Node* find(const char* k, int len = -1) const;
+        Node* find(const Key& k) const;
+        // `own(d)` (the value of a key in d's own children, or nullptr) for this dict, then for the dicts
+        // merged into it, depth first. A dict merged along several paths is searched once, so that
+        // aliasing the same dicts over and over can't make a lookup exponential.
+        template <class Own> inline Node* findMerged(const Own& own, std::vector<const DictNode*>& searched) const {
+            if (auto n = own(this)) return n;
+            Node* found = nullptr;
+            forEachMerged([&](const DictNode* d) {
+                if (found or std::find(searched.begin(), searched.end(), d) != searched.end()) return;
+                searched.push_back(d);
+                found = d->findMerged(own, searched);
+            });
+            return found;
+        }
+
+        // Call `f` with each dict merged into this one by a `<<` key (a dict, or a list of dicts).
+        template <class F> inline void forEachMerged(F&& f) const {
+            for (auto& kv : children) {
+                if (kv.first != "<<") continue;
+                if (auto d = dynamic_cast<const DictNode*>(kv.second))
+                    f(d);
+                else if (auto l = dynamic_cast<const ListNode*>(kv.second))
+                    for (auto c : l->children)
+                        if (auto d = dynamic_cast<const DictNode*>(c)) f(d);
+            }
+        }
 
         template <class V> inline Map<V> toMap() const {
+            spendAliasExpansion(children.size());
             Map<V> out;
-            for (auto& kv : children) { out[kv.first] = kv.second->as_<V>({}); }
+            bool merges = false;
+            for (auto& kv : children) {
+                if (kv.first == "<<")
+                    merges = true;
+                else
+                    out[kv.first] = kv.second->as_<V>({});
+            }
+            // Explicit keys win over merged ones, and earlier merges over later ones.
+            if (merges)
+                forEachMerged([&out](const DictNode* d) {
+                    for (auto& kv : d->toMap<V>()) out.insert(kv);
+                });
             return out;
         }
+        inline bool isFromFlow() const {
+            return fromFlow;
+        }
     };
 
     struct RootNode : public DictNode {
         std::mutex mtx;
 
+        // Only with SYAML_STATS. Read it under guard() if other threads may be calling as<>().
+        syamlStat(ParseStats stats;)
+
+        // Whether the document has aliases, which share the anchored node rather than copying it.
+        bool aliased = false;
+        // How many nodes converting (part of) an aliased document with as<>() may visit. Set by the parser
+        // to a multiple of the document's size.
+        uint64_t aliasExpansionLimit = 0;
+
+        // Mark every node changed. set() calls this on aliased documents, because a node reached through
+        // an alias has ancestors besides its `parent` chain.
+        inline void markAllDirty() {
+            std::vector<Node*> stack { this };
+            std::unordered_map<Node*, bool> shared;
+            while (stack.size()) {
+                Node* n = stack.back();
+                stack.pop_back();
+                if (n->refs.load(std::memory_order_relaxed) > 1 and shared[n]) continue;
+                if (n->refs.load(std::memory_order_relaxed) > 1) shared[n] = true;
+                n->dirty     = true;
+                n->hashValid = false;
+                if (auto d = dynamic_cast<DictNode*>(n))
+                    for (auto& kv : d->children) stack.push_back(kv.second);
+                else if (auto l = dynamic_cast<ListNode*>(n))
+                    for (auto c : l->children) stack.push_back(c);
+            }
+        }
+
         // Only allow a move constructor.
         // We don't want to do a deep copy, so we want to take ownership of o's children
         RootNode(DictNode&& o);
@@ -563,14 +1197,24 @@ namespace syaml {
         virtual ~RootNode();
 
         inline EmptyNode* getEmptySentinel() {
-            return sentinel;
+            return emptySentinel();
         }
 
         inline std::unique_lock<std::mutex> guard() {
             return std::unique_lock<std::mutex>(mtx);
         }
+    };
 
-        EmptyNode* sentinel;
+    // Sets the budget of `spendAliasExpansion()` on this thread to `root`'s `aliasExpansionLimit`, if its
+    // document has aliases, and restores it when it goes out of scope.
+    struct AliasExpansionScope {
+        uint64_t saved = aliasExpansionLeft;
+        inline AliasExpansionScope(const RootNode* root) {
+            if (root and root->aliased) aliasExpansionLeft = root->aliasExpansionLimit;
+        }
+        inline ~AliasExpansionScope() {
+            aliasExpansionLeft = saved;
+        }
     };
 
     struct ScalarNode : public Node {
@@ -583,17 +1227,124 @@ namespace syaml {
         virtual Node* get_(const char* k, int len=-1) const override;
         virtual Node* get_(uint32_t k) const override;
 
+        // The `|` or `>` token this scalar was parsed from, or nullptr.
+        inline const Tok* blockTok() const {
+            if (setKind or !tdoc or tokRange.end <= tokRange.start) return nullptr;
+            const Tok& t = (*tdoc)[tokRange.end - 1];
+            return t == Tok::eBlockScalar ? &t : nullptr;
+        }
+        inline bool isBlock() const {
+            return blockTok() != nullptr;
+        }
+
+        // Whether the scalar's text has `${...}` variables to replace, in a document parsed with an
+        // `Expansion`. They are replaced on the first view(), and the result kept like other
+        // materialized text.
+        inline bool expands() const {
+            if (setKind or !tdoc or !tdoc->expansion or tokRange.end <= tokRange.start) return false;
+            const auto& l = (*tdoc)[tokRange.start];
+            const auto& r = (*tdoc)[tokRange.end - 1];
+            return std::string_view { tdoc->doc->src }.substr(l.start, r.end - l.start).find("${") != std::string_view::npos;
+        }
+
+        // The scalar's text (without quotes), pointing into the source when possible. Strings with
+        // escape sequences and block scalars that need de-indenting or folding are materialized on the
+        // first call, and kept. The view is valid until the node is replaced or its document re-parsed.
+        // `as<std::string_view>()` is the same.
+        std::string_view view() const;
+        std::string_view view_() const;
+
+        // Contents materialized by view(), set once (see `materialize()`).
+        mutable std::atomic<std::string*> materialized { nullptr };
+        // Keep `text` as the materialized contents and return them. Nodes reached through a Snapshot are
+        // read without a lock, so two threads may race here: the first one's text is kept.
+        std::string_view materialize(std::string text) const;
+
+        // A number or boolean stored by set().
+        union {
+            int64_t setInt = 0; // also the booleans
+            double setDouble;
+        };
+
+        // The text of a number or boolean stored by set(), in `buf`, or else `valueStr`.
+        inline std::string_view setText(char (&buf)[32]) const {
+            switch (setKind) {
+            case eSetInt: return { buf, size_t(std::to_chars(buf, buf + sizeof(buf), setInt).ptr - buf) };
+            case eSetDouble: return { buf, size_t(std::to_chars(buf, buf + sizeof(buf), setDouble).ptr - buf) };
+            case eSetBool: return setInt ? "true" : "false";
+            default: return valueStr;
+            }
+        }
+
+        // The text of a scalar that is not a block scalar, without quotes, and whether it has escape
+        // sequences to replace. Not for numbers and booleans stored by set().
+        inline std::pair<std::string_view, bool> quotedText() const {
+            if (setKind) return { valueStr, false };
+            const auto& l      = (*tdoc)[tokRange.start];
+            const auto& r      = (*tdoc)[tokRange.end - 1];
+            std::string_view v = std::string_view { tdoc->doc->src }.substr(l.start, r.end - l.start);
+            if (v.length() >= 2 and v.front() == '"' and v.back() == '"') v = v.substr(1, v.length() - 2);
+            return { v, r == Tok::eString and r.n };
+        }
+
+        // The scalar's source text as it is, quotes included. Not for numbers and booleans stored by set().
+        inline std::string_view sourceText() const {
+            if (setKind) return valueStr;
+            if (tokRange.end <= tokRange.start) return {};
+            const auto& l = (*tdoc)[tokRange.start];
+            const auto& r = (*tdoc)[tokRange.end - 1];
+            return std::string_view { tdoc->doc->src }.substr(l.start, r.end - l.start);
+        }
+
+        // Reads a number from `text`: by parseNumber when it takes all of it, else by a stringstream.
+        template <class V> static inline V parseText(std::string_view text) {
+            if constexpr (is_plain_number<V>::value)
+                if (auto v = parseNumber<V>(text)) return *v;
+            V o;
+            std::stringstream ss { std::string { text } };
+            ss >> o;
+            if (ss.fail() or not ss.eof())
+                throw std::runtime_error("toScalar<V>() failed or partial parse of: " + std::string { text });
+            return o;
+        }
+
         template <class V> inline V toScalar() const {
 
+            if constexpr (std::is_same<V, std::string_view>::value) return view_();
+
+            // Numbers and booleans stored by set() are read as they are when they fit `V`, and else from
+            // their text like parsed ones.
+            if constexpr (std::is_same<V, bool>::value) {
+                if (setKind == eSetBool) return setInt != 0;
+            } else if constexpr (std::is_integral<V>::value) {
+                if (setKind == eSetInt and setInt >= (int64_t)std::numeric_limits<V>::min() and
+                    (setInt < 0 or (uint64_t)setInt <= (uint64_t)std::numeric_limits<V>::max()))
+                    return (V)setInt;
+            } else if constexpr (std::is_floating_point<V>::value) {
+                if (setKind == eSetInt) return (V)setInt;
+                if (setKind == eSetDouble) return (V)setDouble;
+            }
+            if (setKind and setKind < eSetString) {
+                char buf[32];
+                std::string text { setText(buf) };
+                if constexpr (std::is_same<V, std::string>::value) return text;
+                if constexpr (std::is_fundamental<V>::value and not std::is_same<V, bool>::value)
+                    return parseText<V>(text);
+            }
+
+            auto t        = blockTok();
+            bool expanded = expands();
+            if (t or expanded) {
+                std::string text = materialized or expanded ? std::string { view_() } : BlockScalar::of(tdoc->doc->src, *t).text();
+                if constexpr (std::is_same<V, std::string>::value) return text;
+                if constexpr (std::is_fundamental<V>::value and not std::is_same<V, bool>::value)
+                    return parseText<V>(text);
+            }
+
             if constexpr (std::is_same<V, std::string>::value) {
                 // return tdoc->getRangeString(range);
-                if (valueStr.length()) {
-                    if (valueStrIsString)
-                        return valueStr.substr(1, valueStr.length() - 2);
-                    else
-                        return valueStr;
-                } else
-                    return tdoc->getTokenRangeString(tokRange, true);
+                auto [text, escaped] = quotedText();
+                return escaped ? unescape(text) : std::string { text };
             }
 
             if constexpr (std::is_same<V, bool>::value) {
@@ -607,36 +1358,65 @@ namespace syaml {
                                              + s);
             }
 
-            if constexpr (std::is_fundamental<V>::value) {
-                V o;
-                std::stringstream ss;
-                if (valueStr.length()) {
-                    ss = std::stringstream { valueStr };
-                } else {
-                    ss = tdoc->getTokenRangeStream(tokRange);
-                }
-                ss >> o;
-                assert(ss.eof() && "failed or partial parse");
-                // std::cout << " - parse this str :: " << ss.str() << " => " << o << "\n";
-                return o;
-            }
+            if constexpr (std::is_fundamental<V>::value) return parseText<V>(sourceText());
 
             throw std::runtime_error("toScalar<V>() called with invalid type V for ScalarNode");
         }
     };
 
+    template <class V> inline void ListNode::toNumbers(V* out) const {
+        static_assert(is_plain_number<V>::value, "ListNode::toNumbers() reads floats, doubles and signed integers");
+        spendAliasExpansion(children.size());
+        // Children lexed as one number token are read straight from the source. The rest (set() values,
+        // strings, block scalars, `${...}` variables) go to as<V>().
+        for (size_t i = 0; i < children.size(); i++) {
+            const Node* c = children[i];
+            Opt<V> v;
+            if (c->tdoc and not c->setKind and c->tokRange.end == c->tokRange.start + 1) {
+                const auto& t = (*c->tdoc)[c->tokRange.start];
+                if (t.lexeme == Tok::eNumber)
+                    v = parseNumber<V>(std::string_view { c->tdoc->doc->src }.substr(t.start, t.end - t.start));
+            }
+            out[i] = v ? *v : c->as_<V>({});
+        }
+    }
+
     // ---------------------------------------------------------------------------------------------------
     //
     //   Parsing
     //
     // ---------------------------------------------------------------------------------------------------
 
+    // Replace the source bytes [start, end) with `text`.
+    struct SourceEdit {
+        uint32_t start;
+        uint32_t end;
+        std::string text;
+    };
+
     struct Parser {
     public:
         TokenizedDoc* tdoc;
 
         RootNode* parse(TokenizedDoc* doc);
 
+        // Apply `edit` to the document `root` was parsed from, updating the source, the tokens and the
+        // tree in place. Only the smallest enclosing block (a block-dict entry or a dash-list item, found
+        // by indentation) is re-lexed and re-parsed, and its new subtree is spliced into `root`.
+        // Falls back to re-parsing the whole document when no such block can be isolated.
+        // Returns true if the edit was applied incrementally.
+        //
+        // NOTE: Token ranges of nodes after the edit are shifted in a linear pass, which is much cheaper
+        //       than re-lexing, but is not free on huge documents.
+        // NOTE: Values added with set() inside the re-parsed block are lost (they are not in the source).
+        bool reparse(RootNode* root, const SourceEdit& edit);
+
+        // Parse a JSON document, whose top level must be an object, in one pass: `doc`'s tokens are filled
+        // in as the tree is built. The tokens and the tree are the same as lex() and parse() give, but
+        // there are no indents to track and no speculative tryDict()/tryList() attempts. Throws on
+        // anything that is not JSON, without printing where, since callers usually fall back to parse().
+        RootNode* parseJson(TokenizedDoc* doc);
+
         ~Parser();
 
         Tok lex();
@@ -644,11 +1424,30 @@ namespace syaml {
 
         Node* tryDict();
         Node* tryList();
+        Node* tryFlowDict();
         Node* tryListFromDash();
         Node* tryScalar();
 
+        // Give the document a `KeyTable`, and each dict the numbers of its keys in it, so that lookups
+        // with a `Key` compare numbers. Costs a hash lookup per key while parsing.
+        bool internKeys = false;
+        void numberKeys(DictNode* d);
+
+        // Anchors defined so far, each holding a reference to its node.
+        std::unordered_map<std::string, Node*> anchors;
+        bool aliased = false;
+        // If the next token is an anchor, consume it (and any whitespace after it) and return its name.
+        std::string takeAnchor();
+        void defineAnchor(const std::string& name, Node* node);
+        // If the next token is an alias, consume it and return a new reference to the anchored node.
+        Node* tryAlias();
+        void clearAnchors();
+
         uint32_t I = 0;
 
+        // Only with SYAML_STATS. Also filled when parse() throws, in which case there is no RootNode.
+        syamlStat(ParseStats stats; uint32_t depth = 0;)
+
         // inline bool eof() { return I >= tdoc->size(); }
         ConstTok& peek();
         ConstTok& advance();
@@ -658,76 +1457,410 @@ namespace syaml {
 
     // ---------------------------------------------------------------------------------------------------
     //
-    //   Conversions
+    //   Diffing
     //
     // ---------------------------------------------------------------------------------------------------
 
-	/*
-    template <class T> inline Node* Node::get(const T& k) const {
-        auto root = getRoot(false);
-        auto g    = root ? root->guard() : decltype(root->guard()) {};
-        return this->get_(k);
-    }
-	*/
-	inline Node* Node::get(const char* k, int len) const {
-        auto root = getRoot(false);
-        auto g    = root ? root->guard() : decltype(root->guard()) {};
-        return this->get_(k, len);
-	}
-	inline Node* Node::get(const char* k) const {
-        return this->get(k, -1);
-	}
-	inline Node* Node::get(uint32_t i) const {
-        auto root = getRoot(false);
-        auto g    = root ? root->guard() : decltype(root->guard()) {};
-        return this->get_(i);
-	}
+    // One difference found by `diff()`. Paths look like `a.b[2].c`.
+    struct DiffEntry {
+        enum Kind { eAdded, eRemoved, eChanged } kind;
+        std::string path;
+        const Node* before; // nullptr if added
+        const Node* after;  // nullptr if removed
+    };
 
-    template <class T> inline void Node::set(const char* k, const T& v) {
-        auto root = getRoot(false);
-        auto g    = root ? root->guard() : decltype(root->guard()) {};
-        return this->set_(k, v);
-    }
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Owned documents & reloading
+    //
+    // ---------------------------------------------------------------------------------------------------
 
-    // template <typename std::enable_if_t<is_vector<T>::value, T> >
-    template <class T>
-    // inline std::enable_if_t<is_vector<TV>::value, T> Node::as_(Opt<std::vector<T>> def) const {
-    inline std::enable_if_t<is_vector<T>::value, T> Node::as_(Opt<T> def) const {
-        using TV               = typename T::value_type;
-        const ListNode* asList = dynamic_cast<const ListNode*>(this);
+    // A source string together with its tokens and tree. Not copyable or movable, since the tokens and
+    // nodes point into it.
+    struct ParsedDocument {
+        // eAuto parses sources that look like JSON (see `looksLikeJson()`) with Parser::parseJson(), and
+        // the rest, or ones that turn out not to be JSON, with lex() and Parser::parse().
+        enum Syntax { eAuto, eYaml, eJson };
+
+        Document doc;
+        TokenizedDoc tdoc;
+        std::unique_ptr<RootNode> root;
+
+        // With `internKeys`, see `Parser::internKeys`.
+        ParsedDocument(const std::string& src, Syntax syntax = eAuto, bool internKeys = false);
+        // Parsed as YAML with `expansion` (see there), which this keeps. `path` is where `src` was read
+        // from, if anywhere.
+        ParsedDocument(const std::string& src, std::shared_ptr<const Expansion> expansion, const std::string& path = "");
+        ParsedDocument(const ParsedDocument&) = delete;
+        ParsedDocument& operator=(const ParsedDocument&) = delete;
+
+        static std::shared_ptr<ParsedDocument> fromFile(const std::string& path,
+                                                        std::shared_ptr<const Expansion> expansion = nullptr);
+
+        std::shared_ptr<const Expansion> expansion;
+    };
 
-        simpleAssert(asList != nullptr && "Node.as<vector> called on non-ListNode");
-        return asList->toVector<TV>();
-    }
+    // Parsed files, shared by everyone loading them, like plugins of a process reading the same configs.
+    //
+    // get() parses a file on first use, and again once it changed: by modification time and size, and when
+    // those did change (or always, with `checkContent`), by comparing its bytes with what was parsed. Files
+    // with the same contents share one document. Concurrent get()s of the same file wait for one parse.
+    //
+    // Documents are kept for as long as someone holds them, not by the cache. Since the cache hands them
+    // out again, to callers loading the same file or one with the same contents, it only hands out their
+    // roots, const. The nodes reached from them must not be changed either.
+    class DocumentCache {
+    public:
+        // The process-wide cache.
+        static DocumentCache& global();
 
-    template <class T>
-    // inline std::enable_if_t<is_map<TV>::value, T> Node::as_(Opt<Map<T>> def) const {
-    inline std::enable_if_t<is_map<T>::value, T> Node::as_(Opt<T> def) const {
-        using TV               = typename T::value_type;
-        const DictNode* asDict = dynamic_cast<const DictNode*>(this);
-        simpleAssert(asDict != nullptr && "Node.as<map> called on non-ListNode");
+        // The root of the document at `path`, which keeps the document alive. Throws if it can't be read
+        // or parsed.
+        std::shared_ptr<const RootNode> get(const std::string& path);
 
-        return asDict->toMap<TV>();
-    }
+        // Read every file on get(), even when its modification time and size are unchanged, for file
+        // systems whose timestamps are too coarse to see a change.
+        bool checkContent = false;
 
-    // template <typename std::enable_if_t<std::is_integral<T>::value, T> >
-    template <class T> inline std::enable_if_t<is_scalar<T>::value, T> Node::as_(Opt<T> def) const {
-        const ScalarNode* asScalar = dynamic_cast<const ScalarNode*>(this);
-        simpleAssert(asScalar != nullptr
-                     && "Node.as<T> called on non-ScalarNode (with T not in {vector,map})");
+        // How many files were parsed.
+        inline uint64_t parses() const {
+            return parses_.load(std::memory_order_relaxed);
+        }
+        // How many files the cache knows of. Files whose documents nobody holds anymore are forgotten
+        // when a later get() finds the cache has doubled since it last looked.
+        inline size_t size() {
+            std::lock_guard<std::mutex> lck(mtx);
+            return entries.size();
+        }
 
-        return asScalar->toScalar<T>();
-    }
+    private:
+        friend struct Expansion;
 
-    template <class T> inline std::enable_if_t<is_decodable<T>::value, T> Node::as_(Opt<T> def) const {
+        // get() for documents read with `expansion`. `from` is the path of the including document, if it
+        // has one, to detect include cycles, which throw.
+        std::shared_ptr<const ParsedDocument> load(const std::string& path, const Expansion* expansion,
+                                                   const std::string& from);
 
-        // TODO: Would be nicer to allow any combination, based on dynamic_cast(this) and on
-        // `use_dict` etc.
+        struct Entry {
+            std::weak_ptr<const ParsedDocument> doc;
+            std::pair<int64_t, uint64_t> stamp;
+            std::shared_future<std::shared_ptr<const ParsedDocument>> loading;
+        };
 
-        if constexpr (Decode<T>::use_dict) {
-            auto asDict = dynamic_cast<const DictNode*>(this);
-            simpleAssert(asDict != nullptr && "Node.as<map> called on non-ListNode");
-            return Decode<T>::decode(asDict);
+        std::mutex mtx;
+        std::unordered_map<std::string, Entry> entries;
+        size_t pruneAt = 64; // entries.size() at which to drop the entries of freed documents
+        // Documents without includes by a hash of their source, to share the ones read from several paths.
+        std::unordered_multimap<uint64_t, std::weak_ptr<const ParsedDocument>> byContent;
+        // Including file -> included file, for the loads in progress.
+        std::unordered_multimap<std::string, std::string> waits;
+        std::atomic<uint64_t> parses_ { 0 };
+    };
+
+    // A file that is re-parsed in the background whenever it changes on disk (by inotify on Linux, by
+    // polling its modification time and size otherwise).
+    //
+    // `get()` returns the current version, which stays alive for as long as the caller holds it.
+    // New versions are published with an atomic pointer swap. Readers never block on a reload: they only
+    // announce themselves in the current epoch while copying the pointer, and the reloading thread waits
+    // for the previous epoch to drain before dropping its own reference to the old version.
+    //
+    // If a reload fails to parse, the previous version is kept and `onError` is called.
+    class ReloadableDocument {
+    public:
+        // A version of the document, alive for as long as someone holds it. Unrelated to `Snapshot`.
+        using Version = std::shared_ptr<const ParsedDocument>;
+
+        // Throws if the initial load fails. Only `path` is watched, not the files it includes.
+        // `onReload` and `onError` are called from the watching thread (and from reload()), never for the
+        // initial load.
+        ReloadableDocument(const std::string& path,
+                           std::chrono::milliseconds pollInterval = std::chrono::milliseconds(500),
+                           std::shared_ptr<const Expansion> expansion = nullptr,
+                           std::function<void(const Version&)> onReload = nullptr,
+                           std::function<void(const std::string&)> onError = nullptr);
+        ~ReloadableDocument();
+
+        Version get() const;
+
+        // Incremented on every successful reload.
+        inline uint64_t version() const {
+            return version_.load(std::memory_order_acquire);
+        }
+
+        // Synchronously re-read the file. Returns false (keeping the old version) if it fails.
+        bool reload();
+
+        // Given to the constructor, before the watching thread starts, which reads them.
+        const std::function<void(const Version&)> onReload;
+        const std::function<void(const std::string&)> onError;
+
+    private:
+        struct Published {
+            Version doc;
+        };
+
+        void publish(Version doc);
+        void watch();
+        std::pair<int64_t, uint64_t> stamp() const;
+
+        std::string path;
+        std::chrono::milliseconds pollInterval;
+        std::shared_ptr<const Expansion> expansion;
+        std::pair<int64_t, uint64_t> lastStamp;
+
+        std::atomic<Published*> current { nullptr };
+        mutable std::atomic<uint64_t> epoch { 0 };
+        mutable std::atomic<uint32_t> readers[2] = { { 0 }, { 0 } };
+        std::atomic<uint64_t> version_ { 0 };
+
+        std::mutex reloadMtx;
+        std::atomic<bool> stopping { false };
+        int inotifyFd = -1;
+        int wakeFd    = -1;
+        std::thread watcher;
+    };
+
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Expansion
+    //
+    // ---------------------------------------------------------------------------------------------------
+
+    // A stage between lex() and Parser::parse() for configs that use environment variables and include
+    // other files:
+    //
+    //      port: ${PORT:-8080}
+    //      db: !include "db.yaml"
+    //
+    // `${NAME}` in plain and quoted scalars and block scalars is replaced by `variables(NAME)`, or by the
+    // text after `:-` in `${NAME:-default}` when that has no value, and `$${` by `${`. This happens lazily,
+    // on the scalar's first view() or as<>(), which throws if a variable has no value and no default.
+    // Keys are not expanded. serialize() keeps the `${...}` as they are.
+    //
+    // `!include "path"` (quoted, relative to the including file) is replaced by the file's top-level dict.
+    // Every file a document includes is loaded in parallel, through `includes`, and its nodes copied into
+    // the including document, so that set() on one doesn't change the others. Included files can include
+    // others, but not themselves. Expansions with different variables should not share a cache.
+    //
+    // `ParsedDocument` and `ReloadableDocument` take an expansion. With lex() and Parser directly:
+    //
+    //      auto tdoc = lex(&doc);
+    //      expansion->prepare(tdoc, path);
+    //      std::unique_ptr<RootNode> root { Parser {}.parse(&tdoc) };
+    //      expansion->attach(tdoc, root.get());
+    //
+    // The expansion must be made with std::make_shared, and outlive the documents prepared with it.
+    //
+    // NOTE: Parser::reparse() doesn't expand the re-parsed text, and throws on tags.
+    struct Expansion : std::enable_shared_from_this<Expansion> {
+        std::function<Opt<std::string>(std::string_view)> variables = [](std::string_view name) -> Opt<std::string> {
+            auto v = std::getenv(std::string { name }.c_str());
+            return v ? Opt<std::string> { v } : std::nullopt;
+        };
+        std::shared_ptr<DocumentCache> includes = std::make_shared<DocumentCache>();
+        // How many included files are loaded at once.
+        unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+
+        // `text` with its variables replaced.
+        std::string expand(std::string_view text) const;
+
+        // Load the files included by `tdoc`, read from `path` (or from a string if empty, with includes
+        // relative to the working directory), and remove the tags from its tokens.
+        void prepare(TokenizedDoc& tdoc, const std::string& path = "") const;
+
+        // Put the included documents in the tree parsed from `tdoc` in place of their paths.
+        void attach(TokenizedDoc& tdoc, RootNode* root) const;
+    };
+
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Snapshots
+    //
+    // ---------------------------------------------------------------------------------------------------
+
+    // An immutable version of a document. Copying a Snapshot is O(1), and `set()` returns a new Snapshot
+    // that shares every subtree off the path to the changed key, so a change costs one dict copy per level.
+    // Nodes are freed when the last version referencing them goes away.
+    //
+    // Versions can be read from several threads at once. Nodes copied by `set()` have no parent (a shared
+    // node has many), so reading them takes no lock; the only things reading writes are the caches of
+    // `hash()` and `ScalarNode::view()`, which are atomic and hold the same value whoever fills them.
+    //
+    // NOTE: Don't call `Node::set()` on nodes reached through a snapshot.
+    class Snapshot {
+    public:
+        Snapshot() = default;
+        Snapshot(const Snapshot& o);
+        Snapshot(Snapshot&& o);
+        Snapshot& operator=(Snapshot o);
+        ~Snapshot();
+
+        // The first version of `doc`. The document must not be modified through `doc->root` afterwards.
+        explicit Snapshot(std::shared_ptr<ParsedDocument> doc);
+
+        inline const DictNode* root() const {
+            return root_;
+        }
+        inline const DictNode* operator->() const {
+            return root_;
+        }
+
+        // A new version with the value at `path` (a list of dict keys) set to `v`, creating missing dicts
+        // along the way. Takes ownership of a `DictNode*` value. Key order is preserved.
+        template <class T> Snapshot set(const std::vector<std::string>& path, const T& v) const;
+        template <class T> Snapshot set(const char* k, const T& v) const;
+
+    private:
+        friend class Overlay;
+        Snapshot(DictNode* root, std::shared_ptr<const void> source);
+        static DictNode* withPath(const Node* node, const std::vector<std::string>& path, size_t i, Node* leaf);
+
+        DictNode* root_ = nullptr;
+        std::shared_ptr<const void> source; // keeps the source and tokens alive
+    };
+
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Overlays
+    //
+    // ---------------------------------------------------------------------------------------------------
+
+    // Documents stacked on top of each other, like a base config and its overrides, read as if they were
+    // merged but without merging them:
+    //
+    //      Overlay config;
+    //      config.push(base).push(production).push(host);
+    //      int port = config.get("server").get("port").as<int>();
+    //
+    // A key is looked up from the top layer down. Dicts are merged deeply: a dict at the same key in
+    // several layers has the keys of all of them, and the values of the highest layer with each. Any other
+    // value (a scalar, a list, or a key with no value) replaces whatever the layers below have there.
+    // `flatten()` builds the merged tree once, as a `Snapshot` that shares every subtree that only one
+    // layer has.
+    //
+    // NOTE: The layers must not be changed while in an overlay. Lookups take no lock, and converting a
+    //       value takes the locks of the documents it comes from.
+    class Overlay {
+    public:
+        // The values at some path in the layers, top layer first: either the dicts to merge, or a single
+        // other value. Empty where no layer has a value.
+        struct View {
+            std::vector<const Node*> nodes;
+
+            View get(const char* k) const;
+            View get(uint32_t i) const;
+
+            // Like `Node::as()`, on the merge of the dicts when there are several.
+            template <class T> inline T as(Opt<T> def = {}) const {
+                if (nodes.size() <= 1) return (nodes.empty() ? emptySentinel() : nodes[0])->as<T>(def);
+                auto locks = lockAll(nodes);
+                NodeUPtr merged { merge(nodes) };
+                return merged->as_<T>(def);
+            }
+        };
+
+        // Adds `layer` on top of the others.
+        Overlay& push(std::shared_ptr<const ParsedDocument> layer);
+        // Adds a document by its root, which keeps it alive, like the ones from a `DocumentCache`.
+        Overlay& push(std::shared_ptr<const RootNode> layer);
+
+        View root() const;
+        inline View get(const char* k) const {
+            return root().get(k);
+        }
+
+        // The merged tree, whose new dicts have no parent (so reading them takes no lock) and which keeps
+        // the layers alive.
+        Snapshot flatten() const;
+
+    private:
+        std::vector<std::shared_ptr<const RootNode>> layers;
+
+        // A new dict merging `dicts` (top first).
+        static Node* merge(const std::vector<const Node*>& dicts);
+        // The locks of the documents of `nodes`, always taken in the same order.
+        static std::vector<std::unique_lock<std::mutex>> lockAll(const std::vector<const Node*>& nodes);
+    };
+
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Conversions
+    //
+    // ---------------------------------------------------------------------------------------------------
+
+	/*
+    template <class T> inline Node* Node::get(const T& k) const {
+        auto root = getRoot(false);
+        auto g    = root ? root->guard() : decltype(root->guard()) {};
+        return this->get_(k);
+    }
+	*/
+	inline Node* Node::get(const char* k, int len) const {
+        auto root = getRoot(false);
+        auto g    = root ? root->guard() : decltype(root->guard()) {};
+        return this->get_(k, len);
+	}
+	inline Node* Node::get(const char* k) const {
+        return this->get(k, -1);
+	}
+    inline Node* Node::get(const Key& k) const {
+        auto root = getRoot(false);
+        auto g    = root ? root->guard() : decltype(root->guard()) {};
+        return this->get_(k);
+    }
+	inline Node* Node::get(uint32_t i) const {
+        auto root = getRoot(false);
+        auto g    = root ? root->guard() : decltype(root->guard()) {};
+        return this->get_(i);
+	}
+
+    template <class T> inline void Node::set(const char* k, const T& v) {
+        auto root = getRoot(false);
+        auto g    = root ? root->guard() : decltype(root->guard()) {};
+        if (root and root->aliased) root->markAllDirty();
+        return this->set_(k, v);
+    }
+
+    // template <typename std::enable_if_t<is_vector<T>::value, T> >
+    template <class T>
+    // inline std::enable_if_t<is_vector<TV>::value, T> Node::as_(Opt<std::vector<T>> def) const {
+    inline std::enable_if_t<is_vector<T>::value, T> Node::as_(Opt<T> def) const {
+        using TV               = typename T::value_type;
+        const ListNode* asList = dynamic_cast<const ListNode*>(this);
+
+        simpleAssert(asList != nullptr && "Node.as<vector> called on non-ListNode");
+        return asList->toVector<TV>();
+    }
+
+    template <class T>
+    // inline std::enable_if_t<is_map<TV>::value, T> Node::as_(Opt<Map<T>> def) const {
+    inline std::enable_if_t<is_map<T>::value, T> Node::as_(Opt<T> def) const {
+        using TV               = typename T::mapped_type;
+        const DictNode* asDict = dynamic_cast<const DictNode*>(this);
+        simpleAssert(asDict != nullptr && "Node.as<map> called on non-ListNode");
+
+        return asDict->toMap<TV>();
+    }
+
+    // template <typename std::enable_if_t<std::is_integral<T>::value, T> >
+    template <class T> inline std::enable_if_t<is_scalar<T>::value, T> Node::as_(Opt<T> def) const {
+        const ScalarNode* asScalar = dynamic_cast<const ScalarNode*>(this);
+        simpleAssert(asScalar != nullptr
+                     && "Node.as<T> called on non-ScalarNode (with T not in {vector,map})");
+
+        return asScalar->toScalar<T>();
+    }
+
+    template <class T> inline std::enable_if_t<is_decodable<T>::value, T> Node::as_(Opt<T> def) const {
+
+        // TODO: Would be nicer to allow any combination, based on dynamic_cast(this) and on
+        // `use_dict` etc.
+
+        if constexpr (Decode<T>::use_dict) {
+            auto asDict = dynamic_cast<const DictNode*>(this);
+            simpleAssert(asDict != nullptr && "Node.as<map> called on non-ListNode");
+            return Decode<T>::decode(asDict);
         }
 
         if constexpr (Decode<T>::use_list) {
@@ -740,6 +1873,18 @@ namespace syaml {
     template <class T> T Node::as(Opt<T> def) const {
         auto root = getRoot(false);
         auto g    = root ? root->guard() : decltype(root->guard()) {};
+        AliasExpansionScope budget(root);
+#ifdef SYAML_STATS
+        auto t0 = std::chrono::steady_clock::now();
+        struct Record {
+            RootNode* root;
+            std::chrono::steady_clock::time_point t0;
+            ~Record() {
+                if (root) root->stats.conversions++, root->stats.conversionMs += msSince(t0);
+            }
+        } record { root, t0 };
+        try {
+#endif
         if (dynamic_cast<const EmptyNode*>(this)) {
             if (def)
                 return *def;
@@ -747,120 +1892,823 @@ namespace syaml {
                 throw std::runtime_error("as<>() called on an EmptyNode with no default provided.");
         }
         return as_<T>(def);
+#ifdef SYAML_STATS
+        } catch (...) {
+            if (root) root->stats.exceptions++;
+            throw;
+        }
+#endif
+    }
+
+    // A vector of key-value pairs, which set() stores as a dict.
+    template <class T> struct is_pair_vector : std::false_type {};
+    template <class A, class B> struct is_pair_vector<std::vector<std::pair<A, B>>> : std::true_type {};
+
+    // The node set() stores for a value: a list for a vector, a dict for a `Map` or a vector of pairs
+    // (in their order), and a scalar for anything else. Takes ownership of a `DictNode*` or `ListNode*`.
+    template <class T> inline Node* newValueNode(const T& v) {
+        if constexpr (std::is_same<T, DictNode*>::value or std::is_same<T, ListNode*>::value) {
+            return v;
+        } else if constexpr (is_map<T>::value or is_pair_vector<T>::value) {
+            NodeUPtr out { new DictNode() };
+            auto d = static_cast<DictNode*>(out.get());
+            d->children.reserve(v.size());
+            for (auto& kv : v) {
+                d->children.push_back({ kv.first, newValueNode(kv.second) });
+                d->children.back().second->parent = d;
+            }
+            out->dirty = true;
+            return out.release();
+        } else if constexpr (is_vector<T>::value) {
+            NodeUPtr out { new ListNode(nullptr, SourceRange {}) };
+            auto l = static_cast<ListNode*>(out.get());
+            l->children.reserve(v.size());
+            for (auto& c : v) {
+                l->children.push_back(newValueNode(c));
+                l->children.back()->parent = l;
+            }
+            out->dirty = true;
+            return out.release();
+        } else {
+            // Numbers and booleans are kept as they are; characters are written out like streams do.
+            constexpr bool isChar = std::is_same<T, char>::value or std::is_same<T, signed char>::value
+                                 or std::is_same<T, unsigned char>::value;
+            auto newNode = new ScalarNode("");
+            if constexpr (std::is_same<T, bool>::value) {
+                newNode->setKind = Node::eSetBool;
+                newNode->setInt  = v;
+            } else if constexpr (std::is_integral<T>::value and not isChar) {
+                if (std::is_signed<T>::value or (uint64_t)v <= (uint64_t)std::numeric_limits<int64_t>::max()) {
+                    newNode->setKind = Node::eSetInt;
+                    newNode->setInt  = (int64_t)v;
+                } else {
+                    char buf[32];
+                    newNode->setKind  = Node::eSetText;
+                    newNode->valueStr = std::string(buf, std::to_chars(buf, buf + sizeof(buf), v).ptr);
+                }
+            } else if constexpr (std::is_floating_point<T>::value) {
+                newNode->setKind   = Node::eSetDouble;
+                newNode->setDouble = (double)v;
+            } else if constexpr (std::is_same<T, std::string>::value or std::is_same<T, std::string_view>::value) {
+                newNode->setKind  = Node::eSetString;
+                newNode->valueStr = v;
+            } else {
+                std::stringstream ss;
+                ss << v;
+                newNode->setKind  = Node::eSetText;
+                newNode->valueStr = ss.str();
+            }
+            return newNode;
+        }
+    }
+
+    template <class T> Snapshot Snapshot::set(const std::vector<std::string>& path, const T& v) const {
+        return Snapshot(withPath(root_, path, 0, newValueNode(v)), source);
+    }
+    template <class T> Snapshot Snapshot::set(const char* k, const T& v) const {
+        return set<T>(std::vector<std::string> { k }, v);
     }
 
     template <class T> void Node::set_(const char* k, const T& v) {
         auto self = dynamic_cast<DictNode*>(this);
         if (not self) { throw std::runtime_error("set_ is only supported on DictNodes for now!"); }
 
-        std::string kk { k };
-        auto oldIt = std::find_if(self->children.begin(), self->children.end(),
-                                  [k](const auto& kv) { return 0 == my_strcmp(kv.first.c_str(), k); });
-        if (oldIt != self->children.end()) delete oldIt->second;
-        if (oldIt != self->children.end()) self->children.erase(oldIt);
+        self->markDirty();
 
-        if constexpr (std::is_same<T, DictNode*>::value) {
-            dynamic_cast<DictNode*>(v)->parent = this;
-            self->children.push_back({ kk, v });
-            return;
-        }
+        Node* newNode   = newValueNode(v);
+        newNode->parent = this;
 
-        std::string valueStr;
-        bool valueStrIsString = false;
-        if constexpr (std::is_same<T, std::string>::value) {
-            valueStr         = "\"" + v + "\"";
-            valueStrIsString = true;
+        // Replace the value in place, so that the keys keep their order.
+        auto oldIt = std::find_if(self->children.begin(), self->children.end(),
+                                  [k](const auto& kv) { return 0 == my_strcmp(kv.first.c_str(), k); });
+        if (oldIt != self->children.end()) {
+            releaseNode(oldIt->second);
+            oldIt->second = newNode;
         } else {
-            std::stringstream ss;
-            ss << v;
-            valueStr = ss.str();
+            self->children.push_back({ std::string { k }, newNode });
         }
-        auto newNode              = new ScalarNode(valueStr);
-        newNode->parent           = this;
-        newNode->valueStrIsString = valueStrIsString;
-
-        self->children.push_back({ kk, newNode });
     }
 
-#ifdef SYAML_IMPL
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Schemas
+    //
+    // ---------------------------------------------------------------------------------------------------
 
-    /*
-void Node::set_(const char* k, DictNode* v) {
-            auto self = dynamic_cast<DictNode*>(this);
-            if (not self) {
-                    throw std::runtime_error("set_ is only supported on DictNodes for now!");
-            }
+    // A key of a `Schema`, and the type its value is read as.
+    template <class T> struct Field {
+        using type = T;
+        std::string_view key;
+        bool required = true;
+    };
 
-            std::string kk{k};
-            auto oldIt = std::find_if(self->children.begin(), self->children.end(),
-                                                    [k](const auto& kv) { return 0 ==
-my_strcmp(kv.first.c_str(), k); }); if (oldIt != self->children.end()) delete oldIt->second; if (oldIt !=
-self->children.end()) self->children.erase(oldIt);
+    // A dict's children, bucketed by `Schema::bind()`. `nodes[i]` is the value of the schema's i'th key,
+    // or nullptr if the dict does not have it (or has it with no value).
+    template <size_t N> struct Bound {
+        std::array<const Node*, N> nodes {};
+        std::vector<std::string> unknown;      // keys that are not in the schema
+        std::vector<std::string_view> missing; // required keys that are not in the dict
 
-            dynamic_cast<DictNode*>(v)->parent = this;
-            self->children.push_back({kk,v});
-    }
-    */
+        inline bool ok() const {
+            return unknown.empty() and missing.empty();
+        }
+        // Like "unknown key 'a', missing key 'b'", or "" if ok().
+        inline std::string error() const {
+            std::string out;
+            for (auto& k : unknown) out += (out.size() ? ", " : "") + std::string { "unknown key '" } + k + "'";
+            for (auto& k : missing) out += (out.size() ? ", " : "") + std::string { "missing key '" } + std::string { k } + "'";
+            return out;
+        }
+    };
 
-    uint32_t Document::distanceFromStartOfLine(int i) const {
-        uint32_t d = 0;
-        while (i > 0 and src[i] != '\n') {
-            i--;
-            d++;
+    namespace {
+        constexpr uint64_t schemaHash(std::string_view s) {
+            uint64_t h = 14695981039346656037ull;
+            for (char c : s) h = (h ^ (uint8_t)c) * 1099511628211ull;
+            return h;
+        }
+        // The slot of a key with hash `h` in a bucket with displacement `d`.
+        constexpr uint64_t schemaSlot(uint64_t h, uint32_t d) {
+            return ((h ^ (d * 0x9e3779b97f4a7c15ull)) * 0xbf58476d1ce4e5b9ull) >> 32;
+        }
+        constexpr size_t schemaTableSize(size_t n) {
+            size_t m = 2;
+            while (m < 2 * n) m *= 2;
+            return m;
         }
-        return d;
     }
 
-    const std::stringstream Document::getRangeStream(const SourceRange& rng) const {
-        std::string snippet = getRangeString(rng);
-        return std::stringstream(std::move(snippet));
-    }
+    // A set of keys and the types of their values, declared at compile time:
+    //
+    //      constexpr Schema serverSchema { Field<std::string> { "host" }, Field<int> { "port" },
+    //                                      Field<double> { "timeout", false } };
+    //      auto b = serverSchema.bind(node);
+    //      if (!b.ok()) throw std::runtime_error(b.error());
+    //      int port = serverSchema.as<1>(b);
+    //
+    // A perfect hash of the keys is built at compile time ("hash and displace": keys are split into
+    // buckets by their hash, and each bucket gets a displacement that moves its keys to free slots).
+    // bind() looks each of the dict's keys up with one pass over it and one comparison, and reports
+    // unknown and missing keys in the same pass. After that, each field is an array index, rather than a
+    // scan of the dict's children per get().
+    template <class... Fields> struct Schema {
+        static constexpr size_t N = sizeof...(Fields);
+        static constexpr size_t M = schemaTableSize(N); // slots
+        static constexpr size_t B = M / 2;              // buckets
+        template <size_t I> using type = typename std::tuple_element_t<I, std::tuple<Fields...>>::type;
+
+        std::array<std::string_view, N> keys {};
+        std::array<bool, N> required {};
+        std::array<uint32_t, B> displacement {};
+        std::array<int16_t, M> table {}; // slot => index in `keys`, or -1
+
+        constexpr Schema(Fields... fs)
+            : keys { fs.key... }
+            , required { fs.required... } {
+            for (size_t i = 0; i < N; i++)
+                for (size_t j = i + 1; j < N; j++)
+                    if (keys[i] == keys[j]) throw std::logic_error("Schema has a duplicate key");
+            for (size_t s = 0; s < M; s++) table[s] = -1;
+
+            std::array<size_t, B> sizes {};
+            for (size_t i = 0; i < N; i++) sizes[schemaHash(keys[i]) & (B - 1)]++;
+            // Place the biggest buckets first, while there are many free slots.
+            for (size_t done = 0; done < N;) {
+                size_t b = 0;
+                for (size_t c = 1; c < B; c++)
+                    if (sizes[c] > sizes[b]) b = c;
+                for (uint32_t d = 0;; d++) {
+                    if (d == 1u << 20) throw std::logic_error("no perfect hash found for Schema");
+                    bool fits = true;
+                    for (size_t i = 0; i < N and fits; i++) {
+                        uint64_t h = schemaHash(keys[i]);
+                        if ((h & (B - 1)) != b) continue;
+                        auto& slot = table[schemaSlot(h, d) & (M - 1)];
+                        fits       = slot < 0;
+                        if (fits) slot = (int16_t)i;
+                    }
+                    if (fits) {
+                        displacement[b] = d;
+                        break;
+                    }
+                    for (size_t s = 0; s < M; s++)
+                        if (table[s] >= 0 and (schemaHash(keys[table[s]]) & (B - 1)) == b) table[s] = -1;
+                }
+                done += sizes[b];
+                sizes[b] = 0;
+            }
+        }
 
-    std::string Document::findLineAround(int i, int o) const {
-        // if (i < 0 or i >= src.length()) return "~";
-        if (i < 0 or i >= (int)src.length()) return "";
-        int s = i;
-        // int e = i+1;
-        int e = i;
-        while (s >= 0 and src[s] != '\n') s--;
-        while (e < (int)src.length() and src[e] != '\n') e++;
-        // if (src[e]=='\n') e--;
-        // if (o == 0) return std::string_view{src}.substr(s,e);
-        if (o == 0) return src.substr(s + 1, e - s - 1);
-        if (o > 0) return findLineAround(e + 1, o - 1);
-        if (o < 0) return findLineAround(s - 1, o + 1);
-        return "";
-    }
-    std::vector<std::pair<uint32_t, std::string>> Document::linesAround(int i, int N) const {
-        std::vector<std::pair<uint32_t, std::string>> out(N);
-        for (int o = 0; o < N; o++) {
-            uint32_t nl = 0;
-            for (int j = 0; j < i; j++) nl += src[j] == '\n';
-            out[o] = { nl + o - 1, findLineAround(i, o - 1) };
+        // Index of `key`, or -1.
+        constexpr int indexOf(std::string_view key) const {
+            uint64_t h = schemaHash(key);
+            int i      = table[schemaSlot(h, displacement[h & (B - 1)]) & (M - 1)];
+            return i >= 0 and keys[i] == key ? i : -1;
         }
-        return out;
-    }
 
-    const std::string Document::getRangeString(SourceRange rng, bool trimQuotes) const {
-        assert(rng.end >= rng.start);
-        if (trimQuotes and src[rng.start] == '"') rng.start++;
-        if (trimQuotes and src[rng.end - 1] == '"') rng.end--;
-        std::string snippet = src.substr(rng.start, rng.end - rng.start);
-        return snippet;
-    }
+        // Bucket the children of `node`, which must be a dict, including those merged into it with `<<`.
+        inline Bound<N> bind(const Node* node) const {
+            auto root = node->getRoot(false);
+            auto g    = root ? root->guard() : decltype(root->guard()) {};
+            return bind_(node);
+        }
+        inline Bound<N> bind_(const Node* node) const {
+            auto d = dynamic_cast<const DictNode*>(node);
+            if (d == nullptr) throw std::runtime_error("Schema::bind() called on a node that is not a dict");
+            Bound<N> b;
+            std::vector<const DictNode*> merged;
+            bindChildren(d, b, merged);
+            for (size_t i = 0; i < N; i++)
+                if (required[i] and not b.nodes[i]) b.missing.push_back(keys[i]);
+            return b;
+        }
 
-    RootNode::RootNode(DictNode&& o)
-        : DictNode(o.tdoc, o.tokRange) {
-        children = std::move(o.children);
-        for (auto kv : children) kv.second->parent = this; // dont forget this.
-        parent           = o.parent;
-        sentinel         = new EmptyNode(tdoc, { 0, 0 });
-        sentinel->parent = this;
-    }
+        // The value of the I'th key as its field's type, or `def` if the dict does not have it.
+        template <size_t I> inline type<I> as(const Bound<N>& b, Opt<type<I>> def = {}) const {
+            if (not b.nodes[I]) return missingValue<I>(def);
+            return b.nodes[I]->template as<type<I>>(def);
+        }
+        template <size_t I> inline type<I> as_(const Bound<N>& b, Opt<type<I>> def = {}) const {
+            if (not b.nodes[I]) return missingValue<I>(def);
+            return b.nodes[I]->template as_<type<I>>(def);
+        }
 
-    RootNode::~RootNode() {
-        delete sentinel;
-    }
+        // One array per field, in the order of the fields.
+        using Columns = std::tuple<std::vector<typename Fields::type>...>;
+
+        // Read every dict of `list` into columns, in one walk under the root's lock: the I'th array
+        // holds the I'th field of each dict, or `type<I> {}` where an optional field is missing. Throws
+        // like "Schema::columns(): item 3: unknown key 'x'" for items bind() would not accept.
+        //
+        //      auto cols = pointSchema.columns(doc.root->get("points"));
+        //      std::vector<double>& xs = std::get<0>(cols);
+        //
+        // Lists of records mostly repeat one key order, so the positions of the keys in the last dict
+        // that needed bind() are tried first, with one comparison per field, and bind() is only used
+        // again for a dict they don't fit.
+        inline Columns columns(const Node* list) const {
+            auto root = list->getRoot(false);
+            auto g    = root ? root->guard() : decltype(root->guard()) {};
+            AliasExpansionScope budget(root);
+            return columns_(list);
+        }
+        inline Columns columns_(const Node* node) const {
+            auto l = dynamic_cast<const ListNode*>(node);
+            if (l == nullptr) throw std::runtime_error("Schema::columns() called on a node that is not a list");
+            spendAliasExpansion(l->children.size());
+            Columns out;
+            std::apply([&](auto&... column) { (column.reserve(l->children.size()), ...); }, out);
+
+            std::array<int32_t, N> order; // the position of each key in the dicts, or -1 if absent
+            size_t ordered = SIZE_MAX;     // how many children dicts with that order have
+            for (size_t r = 0; r < l->children.size(); r++) {
+                auto d = dynamic_cast<const DictNode*>(l->children[r]);
+                if (d == nullptr)
+                    throw std::runtime_error("Schema::columns(): item " + std::to_string(r) + " is not a dict");
+                std::array<const Node*, N> nodes;
+                if (not guess(d, order, ordered, nodes)) {
+                    auto b = bind_(d);
+                    if (not b.ok())
+                        throw std::runtime_error("Schema::columns(): item " + std::to_string(r) + ": " + b.error());
+                    nodes   = b.nodes;
+                    ordered = learn(d, order);
+                }
+                try {
+                    appendRow(out, nodes, std::index_sequence_for<Fields...> {});
+                } catch (std::runtime_error& e) {
+                    throw std::runtime_error("Schema::columns(): item " + std::to_string(r) + ": " + e.what());
+                }
+            }
+            return out;
+        }
+
+    private:
+        // The values of a dict's keys at the positions in `order`, if it has exactly those keys there.
+        inline bool guess(const DictNode* d, const std::array<int32_t, N>& order, size_t ordered,
+                          std::array<const Node*, N>& nodes) const {
+            if (d->children.size() != ordered) return false;
+            for (size_t i = 0; i < N; i++) {
+                nodes[i] = nullptr;
+                if (order[i] < 0) continue;
+                auto& kv = d->children[order[i]];
+                if (kv.first != keys[i] or kv.second->isEmpty()) return false;
+                nodes[i] = kv.second;
+            }
+            return true;
+        }
+        // Record where a dict bind() accepted has each key. Returns its number of children, or SIZE_MAX
+        // (nothing will fit) if it has keys guess() can't account for: merges, duplicates, empty values.
+        inline size_t learn(const DictNode* d, std::array<int32_t, N>& order) const {
+            order.fill(-1);
+            for (size_t j = 0; j < d->children.size(); j++) {
+                int i = indexOf(d->children[j].first);
+                if (i < 0 or order[i] >= 0 or d->children[j].second->isEmpty()) return SIZE_MAX;
+                order[i] = (int32_t)j;
+            }
+            return d->children.size();
+        }
+        template <size_t... I>
+        inline void appendRow(Columns& out, const std::array<const Node*, N>& nodes, std::index_sequence<I...>) const {
+            (std::get<I>(out).push_back(nodes[I] ? nodes[I]->template as_<type<I>>({}) : type<I> {}), ...);
+        }
+
+        // Explicit keys first, so that they win over merged ones. Each dict is merged at most once,
+        // however many times it is aliased.
+        inline void bindChildren(const DictNode* d, Bound<N>& b, std::vector<const DictNode*>& merged) const {
+            bool merges = false;
+            for (auto& kv : d->children) {
+                int i = indexOf(kv.first);
+                if (i >= 0) {
+                    if (not b.nodes[i] and not kv.second->isEmpty()) b.nodes[i] = kv.second;
+                } else if (kv.first == "<<") {
+                    merges = true;
+                } else {
+                    b.unknown.push_back(kv.first);
+                }
+            }
+            if (merges)
+                d->forEachMerged([&](const DictNode* m) {
+                    if (std::find(merged.begin(), merged.end(), m) != merged.end()) return;
+                    merged.push_back(m);
+                    bindChildren(m, b, merged);
+                });
+        }
+        template <size_t I> inline type<I> missingValue(const Opt<type<I>>& def) const {
+            if (def) return *def;
+            throw std::runtime_error("Schema::as(): no value for key '" + std::string { keys[I] } + "'");
+        }
+    };
+
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Validation
+    //
+    // ---------------------------------------------------------------------------------------------------
+
+    // What a node should look like. `validate(node, rule)` checks a subtree against a rule in one walk
+    // under the root's lock, and returns every `Violation` rather than throwing at the first one.
+    // Rules are built with the static functions and the setters, which can be chained:
+    //
+    //      Rule config = Rule::dict({ { "host", Rule::string() },
+    //                                 { "port", Rule::integer().range(1, 65535) },
+    //                                 { "mode", Rule::string().oneOf({ "fast", "safe" }).optional() },
+    //                                 { "tags", Rule::list(Rule::string()).length(0, 8).optional() } })
+    //                        .closed();
+    struct Rule {
+        enum Type {
+            eAny,
+            eDict,
+            eList,
+            eString,  // any scalar, since any scalar can be read as<std::string>()
+            eNumber,  // a scalar that reads as<double>()
+            eInteger, // a scalar that reads as<int64_t>()
+            eBool     // true or false
+        } type = eAny;
+
+        bool required     = true; // as a key of a dict rule. Keys with no value count as missing.
+        bool allowUnknown = true; // dicts: whether keys without a rule are allowed
+        double min = -std::numeric_limits<double>::infinity(), max = std::numeric_limits<double>::infinity();
+        size_t minLength = 0, maxLength = SIZE_MAX; // lists: number of items
+        std::vector<std::string> values;            // if not empty, the scalar's text must be one of these
+        std::vector<std::pair<std::string, Rule>> keys;
+        std::unordered_map<std::string, uint32_t> keyIndex; // key => index in `keys`
+        std::shared_ptr<const Rule> items; // lists: every item. dicts: every key that is not in `keys`.
+
+        static inline Rule any() {
+            return Rule {};
+        }
+        static inline Rule string() {
+            return of(eString);
+        }
+        static inline Rule number() {
+            return of(eNumber);
+        }
+        static inline Rule integer() {
+            return of(eInteger);
+        }
+        static inline Rule boolean() {
+            return of(eBool);
+        }
+        static inline Rule list() {
+            return of(eList);
+        }
+        static inline Rule list(Rule item) {
+            Rule r  = of(eList);
+            r.items = std::make_shared<const Rule>(std::move(item));
+            return r;
+        }
+        static inline Rule dict(std::vector<std::pair<std::string, Rule>> keys) {
+            Rule r = of(eDict);
+            for (uint32_t i = 0; i < keys.size(); i++)
+                if (not r.keyIndex.emplace(keys[i].first, i).second)
+                    throw std::logic_error("Rule::dict() has a duplicate key '" + keys[i].first + "'");
+            r.keys = std::move(keys);
+            return r;
+        }
+        // A dict with any keys, whose values all follow `value`.
+        static inline Rule map(Rule value) {
+            Rule r  = of(eDict);
+            r.items = std::make_shared<const Rule>(std::move(value));
+            return r;
+        }
+
+        inline Rule& optional() {
+            required = false;
+            return *this;
+        }
+        inline Rule& closed() {
+            allowUnknown = false;
+            return *this;
+        }
+        inline Rule& range(double lo, double hi) {
+            min = lo;
+            max = hi;
+            return *this;
+        }
+        inline Rule& length(size_t lo, size_t hi = SIZE_MAX) {
+            minLength = lo;
+            maxLength = hi;
+            return *this;
+        }
+        inline Rule& oneOf(std::vector<std::string> vs) {
+            values = std::move(vs);
+            return *this;
+        }
+
+    private:
+        static inline Rule of(Type t) {
+            Rule r;
+            r.type = t;
+            return r;
+        }
+    };
+
+    // A node that does not follow its rule. `line` and `column` (1-based) are where the node, or for
+    // unknown keys the key, starts in the source. For nodes added with set() they are those of the
+    // closest ancestor from the source, and 0 if there is none.
+    struct Violation {
+        std::string path; // like `a.b[2].c`
+        std::string message;
+        uint32_t line   = 0;
+        uint32_t column = 0;
+    };
+
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Queries
+    //
+    // ---------------------------------------------------------------------------------------------------
+
+    // A path expression with wildcards and filters, compiled once and then run over trees, each time in
+    // one walk under the root's lock:
+    //
+    //      Query q("services[?enabled == true].ports[*].number");
+    //      std::vector<int> numbers = q.values<int>(doc.root.get());
+    //
+    // Steps are `.key` (or `["key"]`), `[2]` (`[-1]` is the last item), `*` or `[*]` (every value of a
+    // dict, or item of a list) and `[?cond]` (those of them for which `cond` holds). A condition is
+    // a path of keys and indices relative to the item, either alone (the item has a value there) or
+    // compared with `==`, `!=`, `<`, `<=`, `>` or `>=` to a number, a string, `true`, `false` or `null`.
+    // A query may start with `$`, and a condition with `@` (alone, the item itself). Only values of the
+    // same type compare, so `[?port > 1000]` skips items whose port is a string or missing, and keys with
+    // no value are null. Keys with no value are never among the results.
+    //
+    // With `threads` > 1, the items of big lists (and values of big dicts) are split between that many
+    // threads. Documents with aliases are always queried on one thread, since a node reached twice could
+    // be converted by two threads at once.
+    struct Query {
+        struct Step;
+        struct Filter {
+            enum Op { eExists, eEq, eNe, eLt, eLe, eGt, eGe } op = eExists;
+            enum Literal { eNumber, eString, eBool, eNull } literal = eString;
+            std::vector<Step> path; // only keys and indices
+            std::string text;       // the literal, unescaped
+            double number = 0;
+        };
+        struct Step {
+            enum Kind { eKey, eIndex, eAll, eFilter } kind = eKey;
+            Key key;
+            int64_t index = 0;
+            Filter filter;
+        };
+
+        std::vector<Step> steps;
+        // Lists with fewer items than this are not worth splitting between threads.
+        size_t minParallel = 1024;
+
+        // Throws std::runtime_error if `expr` is not a valid query.
+        explicit Query(std::string_view expr);
+
+        inline std::vector<const Node*> nodes(const Node* root, unsigned threads = 1) const {
+            return run<const Node*>(root, threads, [](const Node* n) { return n; });
+        }
+        template <class T> inline std::vector<T> values(const Node* root, unsigned threads = 1) const {
+            return run<T>(root, threads, [](const Node* n) { return n->as_<T>({}); });
+        }
+
+        // The matches of the query in `root`, each passed through `convert`, in document order.
+        template <class T, class F> inline std::vector<T> run(const Node* root, unsigned threads, F&& convert) const {
+            auto r = root->getRoot(false);
+            auto g = r ? r->guard() : decltype(r->guard()) {};
+            AliasExpansionScope budget(r);
+            if (not r or r->aliased) threads = 1;
+            std::vector<T> out;
+            eval(root, 0, threads, out, convert);
+            return out;
+        }
+
+    private:
+        bool matches(const Node* item, const Filter& f) const;
+
+        // The child of `n` a key or index step leads to, or nullptr.
+        static inline const Node* child(const Node* n, const Step& s) {
+            if (s.kind == Step::eKey) {
+                auto d = dynamic_cast<const DictNode*>(n);
+                return d ? d->find(s.key) : nullptr;
+            }
+            auto l = dynamic_cast<const ListNode*>(n);
+            if (not l) return nullptr;
+            int64_t i = s.index < 0 ? s.index + (int64_t)l->children.size() : s.index;
+            return i >= 0 and i < (int64_t)l->children.size() ? l->children[i] : nullptr;
+        }
+
+        template <class T, class F>
+        void eval(const Node* n, size_t i, unsigned threads, std::vector<T>& out, const F& convert) const {
+            if (n->isEmpty()) return;
+            if (i == steps.size()) return out.push_back(convert(n));
+            const Step& s = steps[i];
+            if (s.kind == Step::eKey or s.kind == Step::eIndex) {
+                if (auto c = child(n, s)) eval(c, i + 1, threads, out, convert);
+            } else if (auto l = dynamic_cast<const ListNode*>(n)) {
+                auto& cs = l->children;
+                fanOut(cs.size(), [&](size_t k) { return cs[k]; }, i, s.kind == Step::eFilter ? &s.filter : nullptr,
+                       threads, out, convert);
+            } else if (auto d = dynamic_cast<const DictNode*>(n)) {
+                auto& cs = d->children;
+                auto f   = s.kind == Step::eFilter ? &s.filter : nullptr;
+                if (std::none_of(cs.begin(), cs.end(), [](auto& kv) { return kv.first == "<<"; }))
+                    fanOut(cs.size(), [&](size_t k) { return cs[k].second; }, i, f, threads, out, convert);
+                else {
+                    std::vector<const DictNode*> merged;
+                    eachValue(d, d, merged, [&](const Node* v) {
+                        if (not f or matches(v, *f)) eval(v, i + 1, threads, out, convert);
+                    });
+                }
+            }
+        }
+
+        // Each value of `top` found in `d`, in order: its own keys first, then the merged ones that
+        // neither an explicit key nor an earlier merge overrides. Each dict in `merged` is visited
+        // once, however many times it is aliased, so that its values aren't repeated.
+        template <class G>
+        static inline void eachValue(const DictNode* top, const DictNode* d, std::vector<const DictNode*>& merged, const G& g) {
+            spendAliasExpansion(d->children.size());
+            for (auto& kv : d->children)
+                if (kv.first != "<<" and (d == top or top->find(kv.first.c_str(), (int)kv.first.length()) == kv.second))
+                    g(kv.second);
+            d->forEachMerged([&](const DictNode* m) {
+                if (std::find(merged.begin(), merged.end(), m) != merged.end()) return;
+                merged.push_back(m);
+                eachValue(top, m, merged, g);
+            });
+        }
+
+        // Step `i` over the `count` children `item(k)` of a node, keeping those that pass `f`, if any.
+        template <class T, class F, class G>
+        void fanOut(size_t count, const G& item, size_t i, const Filter* f, unsigned threads, std::vector<T>& out,
+                    const F& convert) const {
+            spendAliasExpansion(count);
+            if (threads <= 1 or count < minParallel) {
+                for (size_t k = 0; k < count; k++)
+                    if (not f or matches(item(k), *f)) eval(item(k), i + 1, threads, out, convert);
+                return;
+            }
+            // Each thread takes a contiguous range of children, and walks below them on its own.
+            std::vector<std::vector<T>> parts(threads);
+            std::vector<std::exception_ptr> errors(threads);
+            std::vector<std::thread> workers;
+            size_t per = (count + threads - 1) / threads;
+            for (unsigned t = 0; t < threads; t++)
+                workers.emplace_back([&, t]() {
+                    try {
+                        for (size_t k = t * per; k < std::min(count, (t + 1) * per); k++)
+                            if (not f or matches(item(k), *f)) eval(item(k), i + 1, 1, parts[t], convert);
+                    } catch (...) {
+                        errors[t] = std::current_exception();
+                    }
+                });
+            for (auto& w : workers) w.join();
+            for (auto& e : errors)
+                if (e) std::rethrow_exception(e);
+            for (auto& p : parts) out.insert(out.end(), std::make_move_iterator(p.begin()), std::make_move_iterator(p.end()));
+        }
+    };
+
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Batched changes
+    //
+    // ---------------------------------------------------------------------------------------------------
+
+    // Many changes to one tree, recorded first and then applied by commit() under a single lock:
+    //
+    //      Batch b(doc.root.get());
+    //      b.set("server.port", 8080).set("server.hosts[0]", "a").append("server.tags", "new");
+    //      b.set("limits", Map<int> { { "cpu", 4 } });
+    //      b.commit();
+    //
+    // Paths are keys and indices, written like in a `Query` (an empty one is the target itself). set()
+    // replaces an existing value where it is, so keys keep their order, and adds missing keys at the end
+    // of their dict, creating the dicts on the way. append() adds to a list, created if missing. Values are
+    // converted like Node::set() does, and vectors and `Map`s become lists and dicts.
+    //
+    // Unlike calling set() for each change, the dicts with many changes are indexed once instead of
+    // scanned for each key, and the changed nodes and hashes are marked once at the end. commit() throws
+    // std::runtime_error at the first change it can't make (a path through a scalar, an index out of
+    // range); the changes before it stay applied. Either way the batch is empty afterwards.
+    struct Batch {
+        explicit inline Batch(Node* target)
+            : target(target) {
+        }
+        Batch(const Batch&)            = delete;
+        Batch& operator=(const Batch&) = delete;
+
+        template <class T> inline Batch& set(std::string_view path, const T& v) {
+            return add(eSet, path, newValueNode(v));
+        }
+        template <class T> inline Batch& append(std::string_view path, const T& v) {
+            return add(eAppend, path, newValueNode(v));
+        }
+        void commit();
+
+        // Changes not applied yet.
+        inline size_t size() const {
+            return ops.size();
+        }
+
+    private:
+        enum Kind { eSet, eAppend };
+        struct Op {
+            Kind kind;
+            std::vector<Query::Step> path;
+            NodeUPtr value;
+        };
+        Node* target;
+        std::vector<Op> ops;
+
+        // Takes ownership of `value`, even when `path` is not valid.
+        Batch& add(Kind kind, std::string_view path, Node* value);
+    };
+
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   JSON and MessagePack output
+    //
+    // ---------------------------------------------------------------------------------------------------
+
+    // A buffer owned by the caller, that `toJson()` and `toMsgPack()` write into. When it is full it is
+    // handed to `flush` and reused, so output of any size can go through a small buffer. Without `flush`,
+    // output that does not fit is dropped, but still counted in `total`.
+    //
+    //      char buf[64 << 10];
+    //      OutBuffer out(buf, sizeof(buf), [&](std::string_view s) { fwrite(s.data(), 1, s.size(), f); });
+    //      toJson(doc.root.get(), out);
+    struct OutBuffer {
+        char* data;
+        size_t capacity;
+        std::function<void(std::string_view)> flush;
+        size_t length = 0; // bytes in `data` that were not flushed yet
+        size_t total  = 0; // bytes written, including flushed ones and ones that did not fit
+
+        inline OutBuffer(char* data, size_t capacity, std::function<void(std::string_view)> flush = {})
+            : data(data)
+            , capacity(capacity)
+            , flush(std::move(flush)) {
+        }
+
+        inline void write(const char* p, size_t n) {
+            total += n;
+            while (n) {
+                if (length == capacity) {
+                    if (not flush or capacity == 0) return;
+                    flush({ data, length });
+                    length = 0;
+                }
+                size_t k = std::min(n, capacity - length);
+                std::memcpy(data + length, p, k);
+                length += k;
+                p += k;
+                n -= k;
+            }
+        }
+        inline void write(std::string_view s) {
+            write(s.data(), s.size());
+        }
+        inline void put(char c) {
+            if (length == capacity) return write(&c, 1);
+            data[length++] = c;
+            total++;
+        }
+
+        // Hand what is left to `flush`. Called by the emitters when they are done.
+        inline void finish() {
+            if (flush and length) flush({ data, length });
+            if (flush) length = 0;
+        }
+        // Whether some output was dropped, because it did not fit and there is no `flush`.
+        inline bool truncated() const {
+            return not flush and total > capacity;
+        }
+    };
+
+#ifdef SYAML_IMPL
+
+    /*
+void Node::set_(const char* k, DictNode* v) {
+            auto self = dynamic_cast<DictNode*>(this);
+            if (not self) {
+                    throw std::runtime_error("set_ is only supported on DictNodes for now!");
+            }
+
+            std::string kk{k};
+            auto oldIt = std::find_if(self->children.begin(), self->children.end(),
+                                                    [k](const auto& kv) { return 0 ==
+my_strcmp(kv.first.c_str(), k); }); if (oldIt != self->children.end()) delete oldIt->second; if (oldIt !=
+self->children.end()) self->children.erase(oldIt);
+
+            dynamic_cast<DictNode*>(v)->parent = this;
+            self->children.push_back({kk,v});
+    }
+    */
+
+    uint32_t Document::distanceFromStartOfLine(int i) const {
+        uint32_t d = 0;
+        while (i > 0 and src[i] != '\n') {
+            i--;
+            d++;
+        }
+        return d;
+    }
+
+    const std::stringstream Document::getRangeStream(const SourceRange& rng) const {
+        std::string snippet = getRangeString(rng);
+        return std::stringstream(std::move(snippet));
+    }
+
+    std::string Document::findLineAround(int i, int o) const {
+        // if (i < 0 or i >= src.length()) return "~";
+        if (i < 0 or i >= (int)src.length()) return "";
+        int s = i;
+        // int e = i+1;
+        int e = i;
+        while (s >= 0 and src[s] != '\n') s--;
+        while (e < (int)src.length() and src[e] != '\n') e++;
+        // if (src[e]=='\n') e--;
+        // if (o == 0) return std::string_view{src}.substr(s,e);
+        if (o == 0) return src.substr(s + 1, e - s - 1);
+        if (o > 0) return findLineAround(e + 1, o - 1);
+        if (o < 0) return findLineAround(s - 1, o + 1);
+        return "";
+    }
+    std::vector<std::pair<uint32_t, std::string>> Document::linesAround(int i, int N) const {
+        std::vector<std::pair<uint32_t, std::string>> out(N);
+        for (int o = 0; o < N; o++) {
+            uint32_t nl = 0;
+            for (int j = 0; j < i; j++) nl += src[j] == '\n';
+            out[o] = { nl + o - 1, findLineAround(i, o - 1) };
+        }
+        return out;
+    }
+
+    const std::string Document::getRangeString(SourceRange rng, bool trimQuotes) const {
+        assert(rng.end >= rng.start);
+        if (trimQuotes and src[rng.start] == '"') rng.start++;
+        if (trimQuotes and src[rng.end - 1] == '"') rng.end--;
+        std::string snippet = src.substr(rng.start, rng.end - rng.start);
+        return snippet;
+    }
+
+    RootNode::RootNode(DictNode&& o)
+        : DictNode(o.tdoc, o.tokRange) {
+        children = std::move(o.children);
+        keyIds   = std::move(o.keyIds);
+        for (auto kv : children) kv.second->parent = this; // dont forget this.
+        parent   = o.parent;
+        fromFlow = o.fromFlow;
+    }
+
+    RootNode::~RootNode() {
+    }
+
+#ifdef SYAML_STATS
+    void ParseStats::print(std::ostream& os) const {
+        os << "bytes=" << bytes << " tokens=" << tokens << " dicts=" << dicts << " lists=" << lists
+           << " scalars=" << scalars << " empties=" << empties << " rejects=" << rejects
+           << " exceptions=" << exceptions << " maxDepth=" << maxDepth << " lexMs=" << lexMs
+           << " parseMs=" << parseMs << " allocBytes=" << allocBytes << " conversions=" << conversions
+           << " conversionMs=" << conversionMs;
+    }
+#endif
 
     Node* ScalarNode::get_(const char* k, int len) const {
         syamlAssert(false, "ScalarNode.get(str) called.");
@@ -888,36 +2736,65 @@ self->children.end()) self->children.erase(oldIt);
         } else {
             syamlWarn(k >= 0 and k < children.size(), "ListNode.get(int) out-of-bounds (asked ", k,
                       " have ", children.size(), " children)");
-            return getRoot(true)->getEmptySentinel();
+            return emptySentinel();
         }
     }
 
-    inline Node* DictNode::get_(const char* k, int len) const {
-        decltype(children.begin()) it;
-        if constexpr (is_vector<decltype(children)>::value) {
-            it = std::find_if(children.begin(), children.end(),
-                              [k,len](const auto& kv) { return 0 == my_strcmp(kv.first.c_str(), k, len); });
-        } else {
-            assert(false);
-        }
+    Node* DictNode::find(const char* k, int len) const {
+        std::vector<const DictNode*> searched;
+        return findMerged(
+            [k, len](const DictNode* d) -> Node* {
+                decltype(d->children.begin()) it;
+                if constexpr (is_vector<decltype(d->children)>::value) {
+                    it = std::find_if(d->children.begin(), d->children.end(),
+                                      [k,len](const auto& kv) { return 0 == my_strcmp(kv.first.c_str(), k, len); });
+                } else {
+                    assert(false);
+                }
+                return it != d->children.end() ? it->second : nullptr;
+            },
+            searched);
+    }
 
-        if (it == children.end()) {
-            syamlWarn(it != children.end(), "DictNode.get(k) key not found ('", k, "' have ",
-                      children.size(), " children)");
-            return getRoot(true)->getEmptySentinel();
-        }
+    Node* DictNode::find(const Key& k) const {
+        std::vector<const DictNode*> searched;
+        return findMerged(
+            [&k](const DictNode* d) -> Node* {
+                if (d->tdoc and d->tdoc->keys and d->keyIds.size() == d->children.size()) {
+                    uint32_t id = k.idIn(*d->tdoc->keys);
+                    if (id != KeyTable::kAbsent)
+                        for (size_t i = 0; i < d->keyIds.size(); i++)
+                            if (d->keyIds[i] == id) return d->children[i].second;
+                    return nullptr;
+                }
+                auto it = std::find_if(d->children.begin(), d->children.end(),
+                                       [&k](const auto& kv) { return kv.first == k.str(); });
+                return it != d->children.end() ? it->second : nullptr;
+            },
+            searched);
+    }
 
-        return it->second;
+    inline Node* DictNode::get_(const char* k, int len) const {
+        Node* found = find(k, len);
+        if (!found) {
+            syamlWarn(found, "DictNode.get(k) key not found ('", k, "' have ", children.size(), " children)");
+            return emptySentinel();
+        }
+        return found;
 	}
+    inline Node* DictNode::get_(const Key& k) const {
+        Node* found = find(k);
+        if (!found) {
+            syamlWarn(found, "DictNode.get(k) key not found ('", k.str(), "' have ", children.size(), " children)");
+            return emptySentinel();
+        }
+        return found;
+    }
     inline Node* DictNode::get_(uint32_t k) const {
         syamlAssert(false, "DictNode.get(int) called.");
         return 0;
     }
 
-    bool Node::isEmpty() const {
-        return dynamic_cast<const EmptyNode*>(this) != nullptr;
-    }
-
     struct ParserGuard {
         uint32_t I0;
         bool terminated = false;
@@ -933,6 +2810,7 @@ self->children.end()) self->children.erase(oldIt);
         inline void reject() {
             terminated = true;
             parser->I  = I0;
+            syamlStat(parser->stats.rejects++;)
         }
         inline SourceRange currentRange() const {
             return SourceRange { I0, parser->I };
@@ -944,6 +2822,21 @@ self->children.end()) self->children.erase(oldIt);
         I0 = parser->I;
     }
 
+#ifdef SYAML_STATS
+    // Tracks how deeply tryDict/tryList/tryListFromDash are nested. `maxDepth` is taken when a leaf is
+    // made, so attempts that backtrack don't count.
+    struct DepthStat {
+        Parser* parser;
+        inline DepthStat(Parser* parser)
+            : parser(parser) {
+            parser->depth++;
+        }
+        inline ~DepthStat() {
+            parser->depth--;
+        }
+    };
+#endif
+
     ConstTok& Parser::peek() {
         return (*tdoc)[I];
     }
@@ -955,490 +2848,2312 @@ self->children.end()) self->children.erase(oldIt);
         return peek() == Tok::eEOF;
     }
 
-    Parser::~Parser() {
+    Parser::~Parser() {
+        clearAnchors();
+    }
+
+    std::string Parser::takeAnchor() {
+        if (peek() != Tok::eAnchor) return {};
+        Tok t = advance();
+        while (peek() == Tok::eWhitespace) advance();
+        return tdoc->doc->src.substr(t.start + 1, t.end - t.start - 1);
+    }
+
+    // NOTE: A node may be anchored in an attempt that is later backtracked, so anchors hold a reference,
+    //       and the same name is simply redefined when the input is parsed again.
+    void Parser::defineAnchor(const std::string& name, Node* node) {
+        auto& slot = anchors[name];
+        releaseNode(slot);
+        slot = retainNode(node);
+    }
+
+    Node* Parser::tryAlias() {
+        if (peek() != Tok::eAlias) return nullptr;
+        Tok t       = advance();
+        std::string name = tdoc->doc->src.substr(t.start + 1, t.end - t.start - 1);
+        auto it     = anchors.find(name);
+        if (it == anchors.end()) throw std::runtime_error("alias '*" + name + "' to an undefined anchor");
+        aliased = true;
+        return retainNode(it->second);
+    }
+
+    void Parser::clearAnchors() {
+        for (auto& kv : anchors) releaseNode(kv.second);
+        anchors.clear();
+        aliased = false;
+    }
+
+    inline void Parser::numberKeys(DictNode* d) {
+        if (!tdoc->keys) return;
+        d->keyIds.reserve(d->children.size());
+        for (auto& kv : d->children) d->keyIds.push_back(tdoc->keys->intern(kv.first));
+    }
+
+    RootNode* Parser::parse(TokenizedDoc* tdoc_) {
+        tdoc            = tdoc_;
+        clearAnchors();
+        if (internKeys) tdoc->keys = std::make_shared<KeyTable>();
+
+#ifdef SYAML_STATS
+        stats   = tdoc->stats;
+        depth   = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        DictNode* rootAsDict;
+        try {
+            rootAsDict = (DictNode*)tryDict();
+            if (!rootAsDict) rootAsDict = (DictNode*)tryFlowDict();
+        } catch (...) {
+            stats.exceptions++;
+            stats.parseMs = msSince(t0);
+            throw;
+        }
+#else
+        auto rootAsDict = (DictNode*)tryDict();
+        if (!rootAsDict) rootAsDict = (DictNode*)tryFlowDict();
+#endif
+        syamlAssert(rootAsDict != nullptr);
+
+        RootNode* root = new RootNode(std::move(*rootAsDict));
+        delete rootAsDict;
+
+        root->aliased             = aliased;
+        root->aliasExpansionLimit = 64 * (uint64_t)tdoc->size() + 4096;
+        clearAnchors();
+
+        syamlStat(stats.allocBytes += sizeof(RootNode) - sizeof(DictNode); stats.parseMs = msSince(t0);
+                  root->stats = stats;)
+        return root;
+    }
+
+    namespace {
+
+        // Lexes and parses JSON in the same pass. Each routine starts at the first character of what it
+        // parses, and pushes the tokens lex() would have made for it.
+        struct JsonParser {
+            Parser* parser;
+            TokenizedDoc* tdoc;
+            std::vector<Tok>& ts;
+            const char* s;
+            uint32_t N;
+            uint32_t i = 0;
+
+            // Children of the lists and dicts being parsed, innermost last. A container takes its own off
+            // the end when it is closed, so there is one allocation per container rather than two.
+            std::vector<Node*> items;
+            std::vector<std::pair<std::string, Node*>> members;
+
+            inline JsonParser(Parser* parser, TokenizedDoc* tdoc)
+                : parser(parser)
+                , tdoc(tdoc)
+                , ts(tdoc->tokens)
+                , s(tdoc->doc->src.data())
+                , N((uint32_t)tdoc->doc->src.length()) {
+            }
+            inline ~JsonParser() {
+                for (auto n : items) releaseNode(n);
+                for (auto& kv : members) releaseNode(kv.second);
+            }
+
+            [[noreturn]] void fail(const char* what) {
+                throw std::runtime_error(std::string { "not JSON: " } + what + " at byte " + std::to_string(i));
+            }
+
+            inline uint32_t next() const {
+                return (uint32_t)ts.size();
+            }
+            inline void punct(Tok::Lexeme l) {
+                ts.push_back(Tok { l, 0, i, i + 1 });
+                i++;
+            }
+
+            void space() {
+                while (i < N) {
+                    if (s[i] == ' ' or s[i] == '\t') {
+                        uint32_t i0 = i;
+                        while (i < N and (s[i] == ' ' or s[i] == '\t')) i++;
+                        ts.push_back(Tok { Tok::eWhitespace, i - i0, i0, i });
+                    } else if (s[i] == '\n') {
+                        punct(Tok::eNL);
+                    } else {
+                        return;
+                    }
+                }
+            }
+
+            // `n` is the number of escape sequences, as in lex(). memchr() finds the end of the common
+            // string without any much faster than a loop over its characters.
+            void string() {
+                uint32_t i0 = i++, n = 0;
+                const char* quote = nullptr;
+                while (true) {
+                    if (quote < s + i) {
+                        quote = (const char*)std::memchr(s + i, '"', N - i);
+                        if (!quote) fail("unterminated string");
+                    }
+                    auto esc = (const char*)std::memchr(s + i, '\\', quote - (s + i));
+                    if (!esc) break;
+                    i = (uint32_t)(esc - s);
+                    if (i + 1 == N or not is_escape(s[i + 1])) fail("bad escape sequence");
+                    n++;
+                    i += 2;
+                }
+                i = (uint32_t)(quote - s) + 1;
+                ts.push_back(Tok { Tok::eString, n, i0, i });
+            }
+
+            void number() {
+                uint32_t i0 = i;
+                auto digits = [&]() {
+                    if (i == N or not is_numer(s[i])) fail("expected a digit");
+                    while (i < N and is_numer(s[i])) i++;
+                };
+                if (s[i] == '-') i++;
+                if (i < N and s[i] == '0')
+                    i++;
+                else
+                    digits();
+                if (i < N and s[i] == '.') {
+                    i++;
+                    digits();
+                }
+                if (i < N and (s[i] == 'e' or s[i] == 'E')) {
+                    i++;
+                    if (i < N and (s[i] == '+' or s[i] == '-')) i++;
+                    digits();
+                }
+                ts.push_back(Tok { Tok::eNumber, 0, i0, i });
+            }
+
+            void word(const char* w, uint32_t len) {
+                if (N - i < len or std::memcmp(s + i, w, len) != 0) fail("unexpected character");
+                if (i + len < N and (is_alpha(s[i + len]) or is_numer(s[i + len]))) fail("unexpected character");
+                ts.push_back(Tok { Tok::eIdent, 0, i, i + len });
+                i += len;
+            }
+
+            Node* value() {
+                if (i == N) fail("expected a value, got the end");
+                uint32_t t = next();
+                switch (s[i]) {
+                case '{': return object();
+                case '[': return array();
+                case '"': string(); break;
+                case 't': word("true", 4); break;
+                case 'f': word("false", 5); break;
+                case 'n': word("null", 4); break;
+                default:
+                    if (s[i] != '-' and not is_numer(s[i])) fail("expected a value");
+                    number();
+                }
+                auto node = new ScalarNode(tdoc, SourceRange { t, t + 1 });
+                syamlStat(parser->stats.scalars++; parser->stats.allocBytes += sizeof(ScalarNode);
+                          parser->stats.maxDepth = std::max(parser->stats.maxDepth, parser->depth);)
+                return node;
+            }
+
+            Node* array() {
+                syamlStat(DepthStat depthStat(parser);)
+                uint32_t t0 = next();
+                size_t base = items.size();
+                punct(Tok::eOpenBrace);
+                space();
+                if (i < N and s[i] == ']') {
+                    punct(Tok::eCloseBrace);
+                } else {
+                    while (true) {
+                        items.push_back(value());
+                        space();
+                        if (i < N and s[i] == ',') {
+                            punct(Tok::eComma);
+                            space();
+                        } else if (i < N and s[i] == ']') {
+                            punct(Tok::eCloseBrace);
+                            break;
+                        } else {
+                            fail("expected ',' or ']'");
+                        }
+                    }
+                }
+                auto node = new ListNode(tdoc, SourceRange { t0, next() });
+                node->children.assign(items.begin() + base, items.end());
+                items.resize(base);
+                for (auto c : node->children) c->parent = node;
+                syamlStat(parser->stats.lists++;
+                          parser->stats.allocBytes += sizeof(ListNode) + node->children.capacity() * sizeof(Node*);)
+                return node;
+            }
+
+            Node* object() {
+                syamlStat(DepthStat depthStat(parser);)
+                uint32_t t0 = next();
+                size_t base = members.size();
+                punct(Tok::eOpenCurly);
+                space();
+                if (i < N and s[i] == '}') {
+                    punct(Tok::eCloseCurly);
+                } else {
+                    while (true) {
+                        if (i == N or s[i] != '"') fail("expected a key");
+                        string();
+                        const Tok& k = ts.back();
+                        std::string key(s + k.start + 1, k.end - k.start - 2);
+                        if (k.n) key = unescape(key);
+                        space();
+                        if (i == N or s[i] != ':') fail("expected ':'");
+                        punct(Tok::eColon);
+                        space();
+                        Node* v = value();
+                        members.emplace_back(std::move(key), v);
+                        space();
+                        if (i < N and s[i] == ',') {
+                            punct(Tok::eComma);
+                            space();
+                        } else if (i < N and s[i] == '}') {
+                            punct(Tok::eCloseCurly);
+                            break;
+                        } else {
+                            fail("expected ',' or '}'");
+                        }
+                    }
+                }
+                auto node      = new DictNode(tdoc, SourceRange { t0, next() });
+                node->fromFlow = true;
+                node->children.reserve(members.size() - base);
+                for (size_t k = base; k < members.size(); k++) node->children.push_back(std::move(members[k]));
+                members.resize(base);
+                for (auto& kv : node->children) kv.second->parent = node;
+                parser->numberKeys(node);
+                syamlStat(parser->stats.dicts++; parser->stats.allocBytes += sizeof(DictNode)
+                                                 + node->children.capacity() * sizeof(node->children[0]);)
+                return node;
+            }
+        };
+    }
+
+    RootNode* Parser::parseJson(TokenizedDoc* tdoc_) {
+        tdoc = tdoc_;
+        clearAnchors();
+        if (internKeys) tdoc->keys = std::make_shared<KeyTable>();
+        tdoc->tokens.clear();
+        syamlStat(stats = {}; depth = 0; auto t0 = std::chrono::steady_clock::now();)
+
+        JsonParser p(this, tdoc);
+        p.space();
+        if (p.i == p.N or p.s[p.i] != '{') p.fail("expected an object");
+        std::unique_ptr<Node> top(p.object());
+        p.space();
+        if (p.i != p.N) p.fail("expected the end");
+        tdoc->tokens.push_back(Tok { Tok::eEOF, 0, p.N, p.N });
+
+        // The root's range starts at the first token, like parse()'s.
+        top->tokRange.start = 0;
+        RootNode* root            = new RootNode(std::move(*(DictNode*)top.get()));
+        root->aliasExpansionLimit = 64 * (uint64_t)tdoc->size() + 4096;
+
+        syamlStat(stats.bytes = p.N; stats.tokens = tdoc->size(); stats.parseMs = msSince(t0);
+                  stats.allocBytes += tdoc->tokens.capacity() * sizeof(Tok) + sizeof(RootNode) - sizeof(DictNode);
+                  tdoc->stats = stats; root->stats = stats;)
+        return root;
+    }
+
+    namespace {
+        inline void print_line_debug(TokenizedDoc* tdoc, uint32_t startPosTok) {
+            // auto doc = tdoc->doc;
+            uint32_t startPos = tdoc->tokens[startPosTok].start;
+            auto doc          = tdoc->doc;
+            auto lines        = doc->linesAround(startPos);
+            int off           = doc->distanceFromStartOfLine(startPos);
+            // std::string tab = "\t";
+            std::string tab = "         ";
+            for (uint32_t i = 0; i < lines.size(); i++) {
+                char lineNo[8];
+                sprintf(lineNo, "% 4d", lines[i].first);
+                std::cout << tab << KBLU << lineNo << KNRM "| " << KWHT << lines[i].second << KNRM "\n";
+                if (i == lines.size() / 2) {
+                    std::cout << tab << "      ";
+                    for (int i = 0; i < off; i++) std::cout << " ";
+                    std::cout << KYEL "^" KNRM "\n";
+                }
+            }
+        }
+    }
+
+    Node* Parser::tryScalar() {
+        ParserGuard pg(this);
+
+        try {
+
+            Tok cur = peek();
+            while (cur == Tok::eWhitespace) cur = advance();
+
+            if (eof()) { throw std::runtime_error("tried scalar, but is eof"); }
+
+            cur = advance();
+
+            // if (cur == Tok::eString or cur == Tok::eNumber) {
+            if (cur == Tok::eString or cur == Tok::eNumber or cur == Tok::eIdent or cur == Tok::eBlockScalar) {
+                ScalarNode* newNode = new ScalarNode(tdoc, pg.currentRange());
+                syamlStat(stats.scalars++; stats.allocBytes += sizeof(ScalarNode);
+                          stats.maxDepth = std::max(stats.maxDepth, depth);)
+                return pg.accept(), newNode;
+            }
+        } catch (std::runtime_error& e) {
+            std::cout << " - In tryScalar(), starting here:\n";
+            print_line_debug(tdoc, pg.I0);
+            pg.reject();
+            throw e;
+        }
+
+        return pg.reject(), nullptr;
+    }
+
+    Node* Parser::tryList() {
+        ParserGuard pg(this);
+        syamlStat(DepthStat depthStat(this);)
+
+        std::vector<NodeUPtr> cs;
+
+        try {
+
+            while (peek() == Tok::eWhitespace) advance();
+
+            Tok open = advance();
+            if (open != Tok::eOpenBrace) return pg.reject(), nullptr;
+
+            if (eof()) { throw std::runtime_error("inside list, should've parsed something, got eof"); }
+
+            while (!eof()) {
+                while (peek() == Tok::eWhitespace or peek() == Tok::eNL) {
+                    while (peek() == Tok::eWhitespace) advance();
+                    while (peek() == Tok::eNL) advance();
+                }
+                Tok cur = peek();
+                if (eof()) { throw std::runtime_error("inside list, should've parsed something, got eof"); }
+
+                if (cur == Tok::eCloseBrace) {
+                    advance();
+                    break;
+                }
+
+                std::string anchor = takeAnchor();
+                Node* next         = tryAlias();
+                if (!next) next = tryList();
+                if (!next) next = tryFlowDict();
+                if (!next) next = tryScalar();
+
+                if (!next) {
+                    std::stringstream ss;
+                    cur = peek();
+                    cur.print(ss, *tdoc->doc);
+                    syamlPrintf("inside list, should've parsed list or scalar, peek() is %s\n",
+                                ss.str().c_str());
+                    throw std::runtime_error("inside list, should've parsed list or scalar");
+                }
+
+                cs.push_back(NodeUPtr { next });
+                if (anchor.size()) defineAnchor(anchor, next);
+
+				while (peek() == Tok::eWhitespace) advance();
+
+                Tok after = peek();
+                if (after == Tok::eCloseBrace) {
+                    advance();
+                    break;
+                } else if (after == Tok::eComma) {
+                    advance();
+                } else {
+                    throw std::runtime_error("inside list, should've parsed comma or ending ']'");
+                }
+            }
+        } catch (std::runtime_error& e) {
+            std::cout << " - In tryList(), starting here:\n";
+            print_line_debug(tdoc, pg.I0);
+            pg.reject();
+            throw e;
+        }
+
+        ListNode* newNode = new ListNode(tdoc, pg.currentRange());
+
+        for (auto& c : cs) newNode->children.push_back(c.release());
+        for (auto& c : newNode->children) c->parent = newNode;
+        syamlPrintf("return list with nitems=%zu\n", cs.size());
+        syamlStat(stats.lists++;
+                  stats.allocBytes += sizeof(ListNode) + newNode->children.capacity() * sizeof(Node*);)
+
+        return pg.accept(), newNode;
+    }
+
+    // A `{ k: v, ... }` map. Unlike the block routines this never backtracks: the first token decides
+    // whether it is a flow map, and after that anything unexpected is an error. Values are dispatched on
+    // their first token too, so documents of many compact rows parse about as fast as flow lists.
+    Node* Parser::tryFlowDict() {
+        ParserGuard pg(this);
+        syamlStat(DepthStat depthStat(this);)
+
+        std::vector<std::pair<std::string, NodeUPtr>> cs;
+
+        auto skipSpace = [this]() {
+            while (peek() == Tok::eWhitespace or peek() == Tok::eNL) advance();
+        };
+
+        try {
+
+            while (peek() == Tok::eWhitespace) advance();
+            if (peek() != Tok::eOpenCurly) return pg.reject(), nullptr;
+            advance();
+
+            while (true) {
+                skipSpace();
+                if (eof()) { throw std::runtime_error("inside flow map, expected a key or '}', got eof"); }
+                if (peek() == Tok::eCloseCurly) {
+                    advance();
+                    break;
+                }
+
+                Tok keyTok = advance();
+                if (keyTok != Tok::eIdent and keyTok != Tok::eString) {
+                    throw std::runtime_error("inside flow map, expected a key");
+                }
+                std::string key = keyTok == Tok::eString ? tdoc->doc->getRangeString({ keyTok.start, keyTok.end }, true)
+                                                         : tdoc->getTokenString(keyTok);
+                if (keyTok == Tok::eString and keyTok.n) key = unescape(key);
+                while (peek() == Tok::eWhitespace) advance();
+                if (advance() != Tok::eColon) { throw std::runtime_error("inside flow map, expected ':'"); }
+                skipSpace();
+
+                std::string anchor = takeAnchor();
+                Node* value        = nullptr;
+                switch (peek().lexeme) {
+                case Tok::eAlias: value = tryAlias(); break;
+                case Tok::eOpenBrace: value = tryList(); break;
+                case Tok::eOpenCurly: value = tryFlowDict(); break;
+                case Tok::eComma:
+                case Tok::eCloseCurly:
+                    value = new EmptyNode(tdoc, SourceRange { I, I });
+                    syamlStat(stats.empties++; stats.allocBytes += sizeof(EmptyNode);
+                              stats.maxDepth = std::max(stats.maxDepth, depth);)
+                    break;
+                default: value = tryScalar();
+                }
+                if (!value) { throw std::runtime_error("inside flow map, should've parsed a value"); }
+
+                cs.push_back({ std::move(key), NodeUPtr { value } });
+                if (anchor.size()) defineAnchor(anchor, value);
+
+                skipSpace();
+                Tok after = advance();
+                if (after == Tok::eCloseCurly) {
+                    break;
+                } else if (after != Tok::eComma) {
+                    throw std::runtime_error("inside flow map, should've parsed ',' or ending '}'");
+                }
+            }
+        } catch (std::runtime_error& e) {
+            std::cout << " - In tryFlowDict(), starting here:\n";
+            print_line_debug(tdoc, pg.I0);
+            pg.reject();
+            throw e;
+        }
+
+        DictNode* newNode = new DictNode(tdoc, pg.currentRange());
+        newNode->fromFlow = true;
+        newNode->children.reserve(cs.size());
+        for (auto& kv : cs) newNode->children.push_back({ std::move(kv.first), kv.second.release() });
+        for (auto& kv : newNode->children) kv.second->parent = newNode;
+        numberKeys(newNode);
+        syamlStat(stats.dicts++;
+                  stats.allocBytes += sizeof(DictNode) + newNode->children.capacity() * sizeof(newNode->children[0]);)
+
+        return pg.accept(), newNode;
+    }
+
+    Node* Parser::tryListFromDash() {
+        ParserGuard pg(this);
+        syamlStat(DepthStat depthStat(this);)
+
+        std::vector<NodeUPtr> cs;
+
+        try {
+
+            uint32_t indent = 0;
+            // Skip blank lines, including ones with only whitespace, whose whitespace is not the indent.
+            while (peek() == Tok::eNL or (peek() == Tok::eWhitespace and (*tdoc)[I + 1] == Tok::eNL)) {
+                indent = 0;
+                if (peek() == Tok::eWhitespace) advance();
+                advance();
+                if (peek() == Tok::eWhitespace) {
+                    // indent = advance().n;
+                    indent = peek().n;
+                    syamlPrintf("see indent %d\n", indent);
+                }
+            }
+            if (peek() == Tok::eWhitespace) {
+                // indent = advance().n;
+                indent = peek().n;
+                syamlPrintf("see indent %d\n", indent);
+            }
+
+            syamlPrintf("start tryListFromDash at I=%d\n", I);
+
+            while (!eof()) {
+
+                uint32_t thisIndent = 0;
+                uint32_t savedI     = I;
+                if (peek() == Tok::eWhitespace) { thisIndent = advance().n; }
+                while (peek() == Tok::eNL) {
+                    thisIndent = 0;
+                    advance();
+                    if (peek() == Tok::eWhitespace) { thisIndent = advance().n; }
+                }
+                if (eof()) break;
+
+                syamlPrintf(" - peek() '%s': this indent=%d, expected indent=%d\n",
+                            tdoc->getTokenString(peek()).c_str(), thisIndent, indent);
+                if (thisIndent < indent) {
+                    syamlPrintf(" - exiting tryListFromDash because indent was %d < %d\n", thisIndent,
+                                indent);
+
+                    // NOTE: This is really tricky: if we fail on this indent, we must **rewind
+                    // back to newline** if (thisIndent) I -= 1;
+                    I = savedI;
+
+                    break;
+                }
+
+                if (thisIndent > indent) {
+                    syamlPrintf("inside list from dash, higher indent...\n");
+                    I          = savedI;
+                    Node* next = nullptr;
+                    if (!next) next = tryListFromDash(); // FIXME: Is this correct?
+                    if (!next) next = tryDict();
+
+                    if (!next) {
+                        throw std::runtime_error("inside dashList with indent > expected, "
+                                                 "should've parsed list or dict");
+                    }
+                    cs.push_back(NodeUPtr { next });
+                    continue;
+                }
+
+                Tok open = advance();
+                if (open != Tok::eDash) {
+                    std::stringstream ss;
+                    open.print(ss, *tdoc->doc);
+                    syamlPrintf(" - exiting tryListFromDash, expected dash, got %s\n", ss.str().c_str());
+                    return pg.reject(), nullptr;
+                }
+
+                Tok cur = peek();
+                while (peek() == Tok::eWhitespace) cur = advance();
+                if (eof()) {
+                    throw std::runtime_error("inside dashList, should've parsed something, got eof");
+                }
+
+                if (cur == Tok::eCloseBrace) {
+                    advance();
+                    break;
+                }
+
+                std::string anchor = takeAnchor();
+                Node* next         = tryAlias();
+                if (!next) next = tryList();
+                if (!next) next = tryFlowDict();
+                if (!next) next = tryListFromDash();
+                if (!next) next = tryScalar();
+                if (!next) next = tryDict(); // WARNING: This may break.
+
+                if (!next) { throw std::runtime_error("inside dashList, should've parsed list or scalar"); }
+
+                cs.push_back(NodeUPtr { next });
+                if (anchor.size()) defineAnchor(anchor, next);
+
+                // throw std::runtime_error("nothing parse in inner dict");
+            }
+        } catch (std::runtime_error& e) {
+            std::cout << " - In tryListFromDash(), starting here:\n";
+            print_line_debug(tdoc, pg.I0);
+            pg.reject();
+            throw e;
+        }
+
+        ListNode* newNode = new ListNode(tdoc, pg.currentRange());
+        newNode->fromDash = true;
+
+        for (auto& c : cs) newNode->children.push_back(c.release());
+        for (auto& c : newNode->children) c->parent = newNode;
+        syamlPrintf("return list with nitems=%zu\n", cs.size());
+        syamlStat(stats.lists++;
+                  stats.allocBytes += sizeof(ListNode) + newNode->children.capacity() * sizeof(Node*);)
+
+        return pg.accept(), newNode;
+    }
+
+    void Parser::skipUntilNonEmptyLine() {
+        // Go from current position to end of line. If we see any non whitespace, stop.
+        while (peek() == Tok::eWhitespace) advance();
+        // Do the skipping process
+        int rollback = I;
+        while (peek() == Tok::eNL) {
+            advance();
+            rollback = I;
+            while (peek() == Tok::eWhitespace) advance();
+        }
+        I = rollback;
+    }
+
+    Node* Parser::tryDict() {
+        ParserGuard pg(this);
+        syamlStat(DepthStat depthStat(this);)
+
+        uint32_t indent = 0;
+        std::vector<std::pair<std::string, NodeUPtr>> cs;
+
+        try {
+
+            // Skip blank lines, including ones with only whitespace, whose whitespace is not the indent.
+            while (peek() == Tok::eNL or (peek() == Tok::eWhitespace and (*tdoc)[I + 1] == Tok::eNL)) {
+                indent = 0;
+                if (peek() == Tok::eWhitespace) advance();
+                advance();
+                if (peek() == Tok::eWhitespace) {
+                    // indent = advance().n;
+                    indent = peek().n;
+                    syamlPrintf("see indent %d\n", indent);
+                }
+            }
+            if (peek() == Tok::eWhitespace) {
+                // indent = advance().n;
+                indent = peek().n;
+                syamlPrintf("see indent %d\n", indent);
+            }
+
+            syamlPrintf("start tryDict at I=%d\n", I);
+
+            // An anchor on the value of entry `anchorAt`, defined once that entry has been parsed.
+            std::string anchor;
+            size_t anchorAt          = 0;
+            auto definePendingAnchor = [&]() {
+                if (anchor.size() and cs.size() > anchorAt) defineAnchor(anchor, cs[anchorAt].second.get());
+                anchor.clear();
+            };
+
+            while (!eof()) {
+                definePendingAnchor();
+
+                uint32_t thisIndent = 0;
+                uint32_t savedI     = I;
+                if (peek() == Tok::eWhitespace) { thisIndent = advance().n; }
+                while (peek() == Tok::eNL) {
+                    thisIndent = 0;
+                    advance();
+                    if (peek() == Tok::eWhitespace) { thisIndent = advance().n; }
+                }
+                syamlPrintf(" - next key '%s': this indent=%d, expected indent=%d\n",
+                            tdoc->getTokenString(peek()).c_str(), thisIndent, indent);
+                if (thisIndent < indent) {
+                    syamlPrintf(" - exiting tryDict because indent was %d < %d\n", thisIndent, indent);
+
+                    // NOTE: This is really tricky: if we fail on this indent, we must **rewind
+                    // back to newline** if (thisIndent) I -= 1;
+                    I = savedI;
+
+                    break;
+                }
+
+                if (eof()) { break; }
+
+                Tok keyTok = advance();
+                if (keyTok != Tok::eIdent) {
+                    syamlPrintf(" - keyTok @ %d not ident. fail tryDict\n", I - 1);
+                    return pg.reject(), nullptr;
+                }
+                syamlPrintf(" - keyTok @ %d = %s\n", I - 1, tdoc->getTokenString(keyTok).c_str());
+
+                Tok colon = advance();
+                if (colon != Tok::eColon) {
+                    syamlPrintf(" - missing colon. fail tryDict\n");
+                    return pg.reject(), nullptr;
+                }
+
+                while (peek() == Tok::eWhitespace) { advance(); }
+
+                anchor   = takeAnchor();
+                anchorAt = cs.size();
+                if (Node* alias = tryAlias()) {
+                    cs.push_back({ tdoc->getTokenString(keyTok), NodeUPtr { alias } });
+                    while (peek() == Tok::eWhitespace) { advance(); }
+                    while (peek() == Tok::eNL) { advance(); }
+                    continue;
+                }
+
+                if (eof()) { throw std::runtime_error("nope"); }
+
+                Tok cur = peek();
+
+                // We MUST be starting a list
+                if (cur == Tok::eOpenBrace) {
+                    // advance();
+                    Node* innerList = tryList();
+                    if (innerList) {
+                        while (peek() == Tok::eWhitespace) { advance(); }
+                        while (peek() == Tok::eNL) { advance(); }
+                        cs.push_back({ tdoc->getTokenString(keyTok), NodeUPtr { innerList } });
+                    } else
+                        throw std::runtime_error("looked like a list inside a map, but failed "
+                                                 "to parse the inner list");
+                    continue;
+                }
+
+                // We MUST be starting a flow map
+                if (cur == Tok::eOpenCurly) {
+                    Node* innerDict = tryFlowDict();
+                    while (peek() == Tok::eWhitespace) { advance(); }
+                    while (peek() == Tok::eNL) { advance(); }
+                    cs.push_back({ tdoc->getTokenString(keyTok), NodeUPtr { innerDict } });
+                    continue;
+                }
+
+                // We MUST be starting a list, map, or empty item
+                if (cur == Tok::eNL) {
+
+                    ParserGuard lookahead_pg(this);
+                    cur = peek();
+                    while (cur == Tok::eNL) {
+                        advance();
+                        cur = peek();
+                    }
+
+                    // For the inner dict/list, check that the indentation lines up (yes: must
+                    // do this here and not the recursive call)
+                    uint32_t innerIndent = 0;
+                    if (peek() == Tok::eWhitespace) {
+                        innerIndent = peek().n;
+                        advance();
+                    }
+                    if (innerIndent <= indent) {
+                        syamlPrintf("in tryDict(), innerIndent %d <= indent %d. This must mean "
+                                    "that the "
+                                    "current item '%s' is "
+                                    "empty.\n",
+                                    innerIndent, indent, tdoc->getTokenString(keyTok).c_str());
+                        cs.push_back({ tdoc->getTokenString(keyTok),
+                                       NodeUPtr { new EmptyNode(tdoc, lookahead_pg.currentRange()) } });
+                        syamlStat(stats.empties++; stats.allocBytes += sizeof(EmptyNode);
+                                  stats.maxDepth = std::max(stats.maxDepth, depth);)
+                        lookahead_pg.reject();
+                        continue;
+                    }
+
+                    // NOTE: Always reject `lookahead_pg` because tryDict/tryListFromDash wants
+                    // the whitespace to process itself.
+
+                    // We MUST be starting a new list
+                    if (peek() == Tok::eDash) {
+                        // lookahead_pg.accept();
+                        lookahead_pg.reject();
+
+                        while (peek() == Tok::eWhitespace) advance();
+
+                        Node* innerList = tryListFromDash();
+                        if (innerList) {
+                            cs.push_back({ tdoc->getTokenString(keyTok), NodeUPtr { innerList } });
+                        } else
+                            throw std::runtime_error("looked like a list (from dash) inside a map, "
+                                                     "but failed to parse the inner list");
+                        continue;
+                    }
+
+                    lookahead_pg.reject();
+                    {
+                        // We MUST be starting a new map
+                        while (peek() == Tok::eNL) advance();
+
+                        Node* innerDict = tryDict();
+                        if (innerDict) {
+                            cs.push_back({ tdoc->getTokenString(keyTok), NodeUPtr { innerDict } });
+                        } else {
+                            int rollback = I;
+                            while (peek() == Tok::eWhitespace) advance();
+                            if (eof()) {
+                                // ok.
+                                break;
+                            } else {
+                                I = rollback;
+                                throw std::runtime_error("looked like a map inside a map, but failed "
+                                                         "to parse the inner one");
+                            }
+                        }
+                        continue;
+                    }
+                }
+
+                // We MUST be starting a scalar
+                Node* innerScalar = tryScalar();
+                if (innerScalar) {
+                    while (peek() == Tok::eWhitespace) { advance(); }
+                    while (peek() == Tok::eNL) { advance(); }
+                    cs.push_back({ tdoc->getTokenString(keyTok), NodeUPtr { innerScalar } });
+                    continue;
+                } else
+                    throw std::runtime_error("looked like a scalar inside a map, but failed to "
+                                             "parse the inner scalar");
+
+                throw std::runtime_error("nothing parse in inner dict");
+            }
+            definePendingAnchor();
+        } catch (std::runtime_error& e) {
+            std::cout << " - In tryDict(), starting here:\n";
+            print_line_debug(tdoc, pg.I0);
+            pg.reject();
+            throw e;
+        }
+
+        if (cs.size()) {
+            DictNode* newNode = new DictNode(tdoc, pg.currentRange());
+            if constexpr (is_vector<decltype(newNode->children)>::value) {
+                for (auto& kv : cs) newNode->children.push_back({ kv.first, kv.second.release() });
+            } else {
+                // for (auto& kv : cs) newNode->children[kv.first] = kv.second.release();
+                syamlAssert(false);
+            }
+            for (auto& kv : newNode->children) kv.second->parent = newNode;
+            numberKeys(newNode);
+            syamlStat(stats.dicts++;
+                      stats.allocBytes += sizeof(DictNode) + newNode->children.capacity() * sizeof(newNode->children[0]);)
+            return pg.accept(), newNode;
+        } else
+            return pg.reject(), nullptr;
+    }
+
+    ListNode::~ListNode() {
+        for (auto c : children) releaseNode(c);
+        children.clear();
+    }
+    DictNode::~DictNode() {
+        for (auto kv : children) releaseNode(kv.second);
+        children.clear();
+    }
+    ScalarNode::~ScalarNode() {
+        delete materialized.load(std::memory_order_acquire);
+    }
+
+    std::string_view ScalarNode::view() const {
+        auto root = getRoot(false);
+        auto g    = root ? root->guard() : decltype(root->guard()) {};
+        return view_();
+    }
+    std::string_view ScalarNode::materialize(std::string text) const {
+        auto mine         = new std::string(std::move(text));
+        std::string* none = nullptr;
+        if (materialized.compare_exchange_strong(none, mine, std::memory_order_acq_rel)) return *mine;
+        delete mine;
+        return *none;
+    }
+
+    std::string_view ScalarNode::view_() const {
+        if (auto m = materialized.load(std::memory_order_acquire)) return *m;
+        if (setKind and setKind < eSetString) {
+            char buf[32];
+            return materialize(std::string { setText(buf) });
+        }
+        if (auto t = blockTok(); t and !expands()) {
+            auto b = BlockScalar::of(tdoc->doc->src, *t);
+            if (auto v = b.view()) return *v;
+            return materialize(b.text());
+        }
+        if (expands()) {
+            std::string text;
+            if (auto t = blockTok()) {
+                text = BlockScalar::of(tdoc->doc->src, *t).text();
+            } else {
+                auto [v, escaped] = quotedText();
+                text              = escaped ? unescape(v) : std::string { v };
+            }
+            return materialize(tdoc->expansion->expand(text));
+        }
+        auto [text, escaped] = quotedText();
+        if (not escaped) return text;
+        return materialize(unescape(text));
+    }
+
+    DictNode* Node::asDict() {
+        auto out = dynamic_cast<DictNode*>(this);
+        if (!out) throw std::runtime_error("bad cast to DictNode");
+        return out;
+    }
+    ListNode* Node::asList() {
+        auto out = dynamic_cast<ListNode*>(this);
+        if (!out) throw std::runtime_error("bad cast to ListNode");
+        return out;
+    }
+    ScalarNode* Node::asScalar() {
+        auto out = dynamic_cast<ScalarNode*>(this);
+        if (!out) throw std::runtime_error("bad cast to ScalarNode");
+        return out;
+    }
+
+    RootNode* Node::getRoot(bool required) const {
+        Node* node = const_cast<Node*>(this);
+        while (node->parent) node = node->parent;
+        RootNode* root = dynamic_cast<RootNode*>(node);
+        if (required) syamlAssert(root != nullptr, "getRoot() failed");
+        return root;
     }
 
-    RootNode* Parser::parse(TokenizedDoc* tdoc_) {
-        tdoc            = tdoc_;
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Hashing
+    //
+    // ---------------------------------------------------------------------------------------------------
 
-        auto rootAsDict = (DictNode*)tryDict();
-        syamlAssert(rootAsDict != nullptr);
+    namespace {
+        inline uint64_t hashMix(uint64_t h) {
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ull;
+            h ^= h >> 33;
+            return h;
+        }
+        inline uint64_t hashCombine(uint64_t seed, uint64_t v) {
+            return hashMix(seed ^ (v + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2)));
+        }
+        // Eight bytes at a time, read little-endian so the result does not depend on the platform.
+        inline uint64_t hashBytes(const char* p, size_t n, uint64_t seed) {
+            uint64_t h = hashCombine(seed, n);
+            while (n) {
+                uint64_t w = 0;
+                size_t k   = n < 8 ? n : 8;
+                for (size_t i = 0; i < k; i++) w |= (uint64_t)(uint8_t)p[i] << (8 * i);
+                h = hashCombine(h, w);
+                p += k;
+                n -= k;
+            }
+            return h;
+        }
 
-        RootNode* root = new RootNode(std::move(*rootAsDict));
-        delete rootAsDict;
+        enum HashTag : uint64_t { eHashEmpty = 1, eHashString, eHashWord, eHashInt, eHashFloat, eHashList, eHashDict };
+
+        // Numbers hash by value, as an int64 if they are integers, otherwise as a double.
+        inline uint64_t hashNumber(std::string_view s) {
+            const char* e = s.data() + s.length();
+            int64_t i;
+            auto ri = std::from_chars(s.data(), e, i);
+            if (ri.ptr == e and ri.ec == std::errc {}) return hashCombine(eHashInt, (uint64_t)i);
+            double d = 0;
+            std::from_chars(s.data(), e, d);
+            if (d == 0) d = 0; // -0
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            return hashCombine(eHashFloat, bits);
+        }
+    }
 
-        return root;
+    uint64_t Node::hash() const {
+        auto root = getRoot(false);
+        auto g    = root ? root->guard() : decltype(root->guard()) {};
+        return hash_();
     }
 
-    namespace {
-        inline void print_line_debug(TokenizedDoc* tdoc, uint32_t startPosTok) {
-            // auto doc = tdoc->doc;
-            uint32_t startPos = tdoc->tokens[startPosTok].start;
-            auto doc          = tdoc->doc;
-            auto lines        = doc->linesAround(startPos);
-            int off           = doc->distanceFromStartOfLine(startPos);
-            // std::string tab = "\t";
-            std::string tab = "         ";
-            for (uint32_t i = 0; i < lines.size(); i++) {
-                char lineNo[8];
-                sprintf(lineNo, "% 4d", lines[i].first);
-                std::cout << tab << KBLU << lineNo << KNRM "| " << KWHT << lines[i].second << KNRM "\n";
-                if (i == lines.size() / 2) {
-                    std::cout << tab << "      ";
-                    for (int i = 0; i < off; i++) std::cout << " ";
-                    std::cout << KYEL "^" KNRM "\n";
-                }
+    uint64_t Node::hash_() const {
+        if (hashValid.load(std::memory_order_acquire)) return cachedHash.load(std::memory_order_relaxed);
+
+        uint64_t h = 0;
+        if (auto d = dynamic_cast<const DictNode*>(this)) {
+            // Sum entries, so that the order of keys does not matter.
+            uint64_t sum = 0;
+            for (auto& kv : d->children)
+                sum += hashCombine(hashBytes(kv.first.data(), kv.first.length(), eHashDict), kv.second->hash_());
+            h = hashCombine(hashCombine(eHashDict, d->children.size()), sum);
+        } else if (auto l = dynamic_cast<const ListNode*>(this)) {
+            h = hashCombine(eHashList, l->children.size());
+            for (auto c : l->children) h = hashCombine(h, c->hash_());
+        } else if (auto sc = dynamic_cast<const ScalarNode*>(this)) {
+            std::string owned;
+            std::string_view str;
+            bool isString, isNumber;
+            char buf[32];
+            if (setKind) {
+                str      = sc->setText(buf);
+                isString = setKind == eSetString;
+                isNumber = setKind == eSetInt or setKind == eSetDouble
+                        or (setKind == eSetText and str.length() and (is_numer(str[0]) or str[0] == '-' or str[0] == '.'));
+            } else if (sc->isBlock()) {
+                str      = sc->view_();
+                isString = true;
+                isNumber = false;
+            } else if (sc->expands()) {
+                str      = sc->view_();
+                isString = tdoc->doc->src[(*tdoc)[tokRange.start].start] == '"';
+                isNumber = !isString and str.length() and (is_numer(str[0]) or str[0] == '-' or str[0] == '.');
+            } else {
+                const auto& t = (*tdoc)[tokRange.end - 1];
+                str           = std::string_view { tdoc->doc->src }.substr(t.start, t.end - t.start);
+                isString      = t.lexeme == Tok::eString;
+                isNumber      = t.lexeme == Tok::eNumber;
+                if (isString) str = str.substr(1, str.length() - 2);
+                if (isString and t.n) owned = unescape(str), str = owned;
             }
+            if (isNumber)
+                h = hashNumber(str);
+            else
+                h = hashBytes(str.data(), str.length(), isString ? eHashString : eHashWord);
+        } else {
+            h = eHashEmpty;
         }
+
+        cachedHash.store(h, std::memory_order_relaxed);
+        hashValid.store(true, std::memory_order_release);
+        return h;
     }
 
-    Node* Parser::tryScalar() {
-        ParserGuard pg(this);
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Incremental re-parsing
+    //
+    // ---------------------------------------------------------------------------------------------------
 
-        try {
+    namespace {
 
-            Tok cur = peek();
-            while (cur == Tok::eWhitespace) cur = advance();
+        // Pre-order walk. `f` returns false to skip a node's children.
+        template <class F> void visitNodes(Node* node, F&& f) {
+            if (!f(node)) return;
+            if (auto d = dynamic_cast<DictNode*>(node))
+                for (auto& kv : d->children) visitNodes(kv.second, f);
+            else if (auto l = dynamic_cast<ListNode*>(node))
+                for (auto c : l->children) visitNodes(c, f);
+        }
 
-            if (eof()) { throw std::runtime_error("tried scalar, but is eof"); }
+        constexpr uint32_t kNoTok = 0xffffffff;
 
-            cur = advance();
+        // A re-parseable unit of whole lines: an entry of a block dict, or an item of a dash list.
+        struct EditBlock {
+            Node* container;
+            uint32_t index; // into `container->children`
+            uint32_t start; // byte offset of the first line
+            uint32_t end;   // byte offset just past the last line
+            uint32_t indent;
+        };
 
-            // if (cur == Tok::eString or cur == Tok::eNumber) {
-            if (cur == Tok::eString or cur == Tok::eNumber or cur == Tok::eIdent) {
-                ScalarNode* newNode = new ScalarNode(tdoc, pg.currentRange());
-                return pg.accept(), newNode;
+        // Find the key (for a dict entry) or dash (for a list item) token introducing `value`.
+        // Only returns it if it is the first token on its line, otherwise `kNoTok`.
+        inline uint32_t introducerOf(const TokenizedDoc& td, const Node* value, bool inDict) {
+            if (value->tdoc != &td) return kNoTok; // from set()
+            uint32_t i = value->tokRange.start;
+            if (inDict) {
+                while (i > 0 and (td[i - 1] == Tok::eWhitespace or td[i - 1] == Tok::eNL)) i--;
+                if (i < 2 or td[i - 1] != Tok::eColon or td[i - 2] != Tok::eIdent) return kNoTok;
+                i -= 2;
+            } else {
+                while (i > 0 and td[i - 1] == Tok::eWhitespace) i--;
+                if (i < 1 or td[i - 1] != Tok::eDash) return kNoTok;
+                i -= 1;
             }
-        } catch (std::runtime_error& e) {
-            std::cout << " - In tryScalar(), starting here:\n";
-            print_line_debug(tdoc, pg.I0);
-            pg.reject();
-            throw e;
+            uint32_t j = i;
+            if (j > 0 and td[j - 1] == Tok::eWhitespace) j--;
+            if (j > 0 and td[j - 1] != Tok::eNL) return kNoTok;
+            return i;
         }
 
-        return pg.reject(), nullptr;
-    }
-
-    Node* Parser::tryList() {
-        ParserGuard pg(this);
+        inline uint32_t lineStartOf(const std::string& s, uint32_t i) {
+            while (i > 0 and s[i - 1] != '\n') i--;
+            return i;
+        }
 
-        using NodeUPtr = std::unique_ptr<Node>;
-        std::vector<NodeUPtr> cs;
+        inline uint32_t indentAt(const std::string& s, uint32_t lineStart) {
+            uint32_t i = lineStart;
+            while (i < s.length() and (s[i] == ' ' or s[i] == '\t')) i++;
+            return i - lineStart;
+        }
 
-        try {
+        // Indentation of the first line that is not blank or a comment, or `kNoTok` if there is none.
+        inline uint32_t firstContentIndent(const std::string& s) {
+            uint32_t ls = 0;
+            while (ls < s.length()) {
+                uint32_t ind = indentAt(s, ls);
+                char c       = ls + ind < s.length() ? s[ls + ind] : '\n';
+                if (c != '\n' and c != '#') return ind;
+                while (ls < s.length() and s[ls] != '\n') ls++;
+                ls++;
+            }
+            return kNoTok;
+        }
 
-            while (peek() == Tok::eWhitespace) advance();
+        // Collect the chain of blocks enclosing the edit, outermost first, by descending from `container`
+        // whose entries all end before the source byte `hi`.
+        void findEditBlocks(const TokenizedDoc& td, Node* container, uint32_t hi, const SourceEdit& edit,
+                            std::vector<EditBlock>& out) {
+            auto dict = dynamic_cast<DictNode*>(container);
+            auto list = dynamic_cast<ListNode*>(container);
+            if (list and !list->isFromDash()) return;
+            if (dict and dict->isFromFlow()) return;
+            if (!dict and !list) return;
+
+            const auto& src = td.doc->src;
+            uint32_t n      = dict ? dict->children.size() : list->children.size();
+            auto child      = [&](uint32_t k) { return dict ? dict->children[k].second : list->children[k]; };
+            auto entryStart = [&](uint32_t k) {
+                uint32_t t = introducerOf(td, child(k), dict != nullptr);
+                return t == kNoTok ? kNoTok : lineStartOf(src, td[t].start);
+            };
+            if (n == 0) return;
+
+            // Dicts are small and may be reordered by set(), so scan them. Lists may be huge: bisect.
+            uint32_t k = 0;
+            if (dict) {
+                uint32_t prev = 0;
+                for (uint32_t i = 0; i < n; i++) {
+                    uint32_t s = entryStart(i);
+                    if (s == kNoTok or s < prev) return;
+                    if (s <= edit.start) k = i;
+                    prev = s;
+                }
+            } else {
+                uint32_t l = 0, r = n;
+                while (r - l > 1) {
+                    uint32_t m = (l + r) / 2;
+                    uint32_t s = entryStart(m);
+                    if (s == kNoTok) return;
+                    if (s <= edit.start)
+                        l = m;
+                    else
+                        r = m;
+                }
+                k = l;
+            }
 
-            Tok open = advance();
-            if (open != Tok::eOpenBrace) return pg.reject(), nullptr;
+            uint32_t start = entryStart(k);
+            uint32_t end   = k + 1 < n ? entryStart(k + 1) : hi;
+            if (start == kNoTok or end == kNoTok or start > edit.start or edit.end > end or end > hi) return;
+            if (edit.start == end) return; // an insertion at `end` belongs to whatever follows
 
-            if (eof()) { throw std::runtime_error("inside list, should've parsed something, got eof"); }
+            out.push_back(EditBlock { container, k, start, end, indentAt(src, start) });
+            findEditBlocks(td, child(k), end, edit, out);
+        }
 
-            while (!eof()) {
-                while (peek() == Tok::eWhitespace or peek() == Tok::eNL) {
-                    while (peek() == Tok::eWhitespace) advance();
-                    while (peek() == Tok::eNL) advance();
+        // Re-parse `block` with `edit` applied and splice it into the tree. Returns false, having changed
+        // nothing, if the block cannot be parsed in isolation the same way the whole document would be.
+        bool spliceBlock(RootNode* root, const EditBlock& block, const SourceEdit& edit) {
+            TokenizedDoc& td = *root->tdoc;
+            std::string& src = td.doc->src;
+            auto dict        = dynamic_cast<DictNode*>(block.container);
+            auto list        = dynamic_cast<ListNode*>(block.container);
+
+            std::string text = src.substr(block.start, edit.start - block.start) + edit.text
+                               + src.substr(edit.end, block.end - edit.end);
+            if (block.end < src.length() and (text.empty() or text.back() != '\n')) return false;
+
+            // Parse the new block on its own.
+            uint32_t contentIndent = firstContentIndent(text);
+            if (contentIndent != kNoTok and contentIndent != block.indent) return false;
+
+            Document blockDoc(text);
+            TokenizedDoc blockTdoc;
+            std::unique_ptr<Node> parsed;
+            if (text.length()) {
+                try {
+                    blockTdoc = syaml::lex(&blockDoc);
+                    Parser p;
+                    p.tdoc = &blockTdoc;
+                    if (contentIndent != kNoTok) {
+                        parsed.reset(dict ? p.tryDict() : p.tryListFromDash());
+                        if (!parsed) return false;
+                    }
+                    while (p.peek() == Tok::eWhitespace or p.peek() == Tok::eNL) p.advance();
+                    if (!p.eof()) return false;
+                } catch (std::runtime_error&) {
+                    return false;
                 }
-                Tok cur = peek();
-                if (eof()) { throw std::runtime_error("inside list, should've parsed something, got eof"); }
+                blockTdoc.tokens.pop_back(); // eof
+            }
 
-                if (cur == Tok::eCloseBrace) {
-                    advance();
-                    break;
+            // Removing the only child would leave an empty container, which parses differently.
+            uint32_t nOld = dict ? dict->children.size() : list->children.size();
+            if (!parsed and nOld == 1) return false;
+
+            // Splice tokens.
+            auto byStart = [](const Tok& t, uint32_t i) { return t.start < i; };
+            uint32_t tokA = std::lower_bound(td.tokens.begin(), td.tokens.end(), block.start, byStart)
+                            - td.tokens.begin();
+            uint32_t tokB = std::lower_bound(td.tokens.begin(), td.tokens.end(), block.end, byStart)
+                            - td.tokens.begin();
+            uint32_t nNew       = blockTdoc.tokens.size();
+            int64_t tokDelta    = (int64_t)nNew - (int64_t)(tokB - tokA);
+            int64_t byteDelta   = (int64_t)text.length() - (int64_t)(block.end - block.start);
+
+            auto mapTok = [&](uint32_t i) -> uint32_t {
+                if (i <= tokA) return i;
+                if (i >= tokB) return (uint32_t)(i + tokDelta);
+                return tokA;
+            };
+            visitNodes(root, [&](Node* n) {
+                if (n->tdoc != &td or n->tokRange.end <= tokA) return false;
+                n->tokRange = { mapTok(n->tokRange.start), mapTok(n->tokRange.end) };
+                return true;
+            });
+
+            for (auto& t : blockTdoc.tokens) {
+                t.start += block.start;
+                t.end += block.start;
+            }
+            if (tokDelta > 0) td.tokens.insert(td.tokens.begin() + tokB, tokDelta, Tok {});
+            if (tokDelta < 0) td.tokens.erase(td.tokens.begin() + tokA, td.tokens.begin() + tokA - tokDelta);
+            std::copy(blockTdoc.tokens.begin(), blockTdoc.tokens.end(), td.tokens.begin() + tokA);
+            for (uint32_t i = tokA + nNew; i < td.tokens.size(); i++) {
+                td.tokens[i].start += byteDelta;
+                td.tokens[i].end += byteDelta;
+            }
+            src.replace(edit.start, edit.end - edit.start, edit.text);
+
+            // Splice nodes.
+            block.container->invalidateHash();
+            if (parsed)
+                visitNodes(parsed.get(), [&](Node* n) {
+                    n->tdoc     = &td;
+                    n->tokRange = { n->tokRange.start + tokA, n->tokRange.end + tokA };
+                    return true;
+                });
+            if (dict) {
+                releaseNode(dict->children[block.index].second);
+                dict->children.erase(dict->children.begin() + block.index);
+                dict->keyIds.clear();
+                if (parsed) {
+                    auto& cs = dynamic_cast<DictNode*>(parsed.get())->children;
+                    for (auto& kv : cs) kv.second->parent = dict;
+                    dict->children.insert(dict->children.begin() + block.index, cs.begin(), cs.end());
+                    cs.clear();
+                }
+            } else {
+                releaseNode(list->children[block.index]);
+                list->children.erase(list->children.begin() + block.index);
+                if (parsed) {
+                    auto& cs = dynamic_cast<ListNode*>(parsed.get())->children;
+                    for (auto c : cs) c->parent = list;
+                    list->children.insert(list->children.begin() + block.index, cs.begin(), cs.end());
+                    cs.clear();
                 }
+            }
+            return true;
+        }
+    }
 
-                Node* next = nullptr;
-                if (!next) next = tryList();
-                if (!next) next = tryScalar();
+    bool Parser::reparse(RootNode* root, const SourceEdit& edit) {
+        auto g           = root->guard();
+        TokenizedDoc& td = *root->tdoc;
+        syamlAssert(edit.start <= edit.end and edit.end <= td.doc->src.length(), "reparse(): bad edit range");
+
+        // A splice could drop an anchor that is aliased outside the block, or add an alias to one that
+        // is defined outside it, so documents with (or gaining) aliases are always parsed in full.
+        bool mayAlias = root->aliased or edit.text.find_first_of("&*") != std::string::npos
+                        or edit.text.find("<<") != std::string::npos;
+        std::vector<EditBlock> blocks;
+        if (not mayAlias) findEditBlocks(td, root, td.doc->src.length(), edit, blocks);
+        for (auto it = blocks.rbegin(); it != blocks.rend(); ++it)
+            if (spliceBlock(root, *it, edit)) return true;
+
+        // Fall back to re-parsing everything. Nothing is modified unless this succeeds.
+        std::string newSrc = td.doc->src;
+        newSrc.replace(edit.start, edit.end - edit.start, edit.text);
+        Document newDoc(newSrc);
+        TokenizedDoc newTdoc;
+        newTdoc.doc = &newDoc;
+        std::unique_ptr<RootNode> newRoot;
+        if (looksLikeJson(newDoc.src)) {
+            try {
+                newRoot.reset(Parser {}.parseJson(&newTdoc));
+            } catch (std::runtime_error&) {}
+        }
+        if (!newRoot) {
+            newTdoc = syaml::lex(&newDoc);
+            newRoot.reset(Parser {}.parse(&newTdoc));
+        }
 
-                if (!next) {
-                    std::stringstream ss;
-                    cur = peek();
-                    cur.print(ss, *tdoc->doc);
-                    syamlPrintf("inside list, should've parsed list or scalar, peek() is %s\n",
-                                ss.str().c_str());
-                    throw std::runtime_error("inside list, should've parsed list or scalar");
-                }
+        for (auto& kv : root->children) releaseNode(kv.second);
+        root->children = std::move(newRoot->children);
+        root->keyIds   = std::move(newRoot->keyIds);
+        newRoot->children.clear();
+        root->tokRange            = newRoot->tokRange;
+        root->dirty               = false;
+        root->hashValid           = false;
+        root->aliased             = newRoot->aliased;
+        root->aliasExpansionLimit = newRoot->aliasExpansionLimit;
+        root->fromFlow            = newRoot->fromFlow;
+        for (auto& kv : root->children) kv.second->parent = root;
+        // Shared (aliased) nodes are only walked the first time they are reached.
+        for (auto& kv : root->children)
+            visitNodes(kv.second, [&](Node* n) {
+                if (n->tdoc == &td) return false;
+                n->tdoc = &td;
+                return true;
+            });
+        td.tokens    = std::move(newTdoc.tokens);
+        td.doc->src  = std::move(newDoc.src);
+        return false;
+    }
 
-                cs.push_back(NodeUPtr { next });
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Owned documents & reloading
+    //
+    // ---------------------------------------------------------------------------------------------------
 
-				while (peek() == Tok::eWhitespace) advance();
+    namespace {
+        // Modification time and size, which change when a file is rewritten.
+        std::pair<int64_t, uint64_t> fileStamp(const std::string& path) {
+            std::error_code ec;
+            int64_t t   = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+            uint64_t sz = std::filesystem::file_size(path, ec);
+            return { t, ec ? 0 : sz };
+        }
 
-                Tok after = peek();
-                if (after == Tok::eCloseBrace) {
-                    advance();
-                    break;
-                } else if (after == Tok::eComma) {
-                    advance();
-                } else {
-                    throw std::runtime_error("inside list, should've parsed comma or ending ']'");
-                }
+        std::string readFile(const std::string& path) {
+            std::ifstream ifs(path);
+            syamlAssert(ifs.good(), "failed to open '", path, "'");
+            std::stringstream ss;
+            ss << ifs.rdbuf();
+            return ss.str();
+        }
+    }
+
+    ParsedDocument::ParsedDocument(const std::string& src, Syntax syntax, bool internKeys)
+        : doc(src) {
+        if (syntax == eJson or (syntax == eAuto and looksLikeJson(doc.src))) {
+            tdoc.doc = &doc;
+            try {
+                Parser parser;
+                parser.internKeys = internKeys;
+                root.reset(parser.parseJson(&tdoc));
+                return;
+            } catch (std::runtime_error&) {
+                if (syntax == eJson) throw;
             }
-        } catch (std::runtime_error& e) {
-            std::cout << " - In tryList(), starting here:\n";
-            print_line_debug(tdoc, pg.I0);
-            pg.reject();
-            throw e;
         }
+        tdoc = lex(&doc);
+        Parser parser;
+        parser.internKeys = internKeys;
+        root.reset(parser.parse(&tdoc));
+    }
 
-        ListNode* newNode = new ListNode(tdoc, pg.currentRange());
+    ParsedDocument::ParsedDocument(const std::string& src, std::shared_ptr<const Expansion> expansion,
+                                   const std::string& path)
+        : doc(src)
+        , expansion(std::move(expansion)) {
+        tdoc = lex(&doc);
+        if (this->expansion) this->expansion->prepare(tdoc, path);
+        root.reset(Parser {}.parse(&tdoc));
+        if (this->expansion) this->expansion->attach(tdoc, root.get());
+    }
 
-        for (auto& c : cs) newNode->children.push_back(c.release());
-        for (auto& c : newNode->children) c->parent = newNode;
-        syamlPrintf("return list with nitems=%zu\n", cs.size());
+    std::shared_ptr<ParsedDocument> ParsedDocument::fromFile(const std::string& path,
+                                                             std::shared_ptr<const Expansion> expansion) {
+        if (expansion) return std::make_shared<ParsedDocument>(readFile(path), std::move(expansion), path);
+        return std::make_shared<ParsedDocument>(readFile(path));
+    }
 
-        return pg.accept(), newNode;
+    DocumentCache& DocumentCache::global() {
+        static DocumentCache cache;
+        return cache;
     }
 
-    Node* Parser::tryListFromDash() {
-        ParserGuard pg(this);
+    std::shared_ptr<const RootNode> DocumentCache::get(const std::string& path) {
+        auto doc = load(path, nullptr, "");
+        return std::shared_ptr<const RootNode>(doc, doc->root.get());
+    }
 
-        using NodeUPtr = std::unique_ptr<Node>;
-        std::vector<NodeUPtr> cs;
+    std::shared_ptr<const ParsedDocument> DocumentCache::load(const std::string& path, const Expansion* expansion,
+                                                              const std::string& from) {
+        std::error_code ec;
+        std::string key = std::filesystem::weakly_canonical(path, ec).string();
+        if (ec) key = path;
+        std::string by = from.size() ? std::filesystem::weakly_canonical(from, ec).string() : "";
+        if (ec) by = from;
+
+        std::unique_lock<std::mutex> lck(mtx);
+
+        // `by` waits for `key` below, which never ends if `key` (or a file it is loading) waits for `by`.
+        if (by.size()) {
+            std::vector<std::string> stack { key };
+            std::unordered_set<std::string> seen;
+            while (stack.size()) {
+                std::string f = std::move(stack.back());
+                stack.pop_back();
+                if (f == by) throw std::runtime_error("include cycle: '" + by + "' includes '" + key + "', which includes it");
+                if (!seen.insert(f).second) continue;
+                for (auto [a, b] = waits.equal_range(f); a != b; ++a) stack.push_back(a->second);
+            }
+            waits.emplace(by, key);
+        }
+        struct Unwait {
+            DocumentCache* cache;
+            std::unique_lock<std::mutex>& lck;
+            const std::string &by, &key;
+            ~Unwait() {
+                if (by.empty()) return;
+                if (!lck.owns_lock()) lck.lock();
+                for (auto [a, b] = cache->waits.equal_range(by); a != b; ++a)
+                    if (a->second == key) {
+                        cache->waits.erase(a);
+                        break;
+                    }
+            }
+        } unwait { this, lck, by, key };
 
-        try {
+        if (entries.size() >= pruneAt) {
+            for (auto it = entries.begin(); it != entries.end();)
+                it = it->second.doc.expired() and !it->second.loading.valid() ? entries.erase(it) : std::next(it);
+            pruneAt = std::max<size_t>(64, 2 * entries.size());
+        }
+        Entry& e = entries[key];
+        if (e.loading.valid()) {
+            auto loading = e.loading;
+            lck.unlock();
+            return loading.get();
+        }
+        auto old   = e.doc.lock();
+        auto stamp = fileStamp(key);
+        if (old and stamp == e.stamp and not checkContent) {
+            bool fresh = true;
+            for (auto& [file, was] : old->tdoc.files) fresh = fresh and fileStamp(file) == was;
+            if (fresh) return old;
+        }
 
-            uint32_t indent = 0;
-            while (peek() == Tok::eNL) {
-                indent = 0;
-                advance();
-                if (peek() == Tok::eWhitespace) {
-                    // indent = advance().n;
-                    indent = peek().n;
-                    syamlPrintf("see indent %d\n", indent);
-                }
+        std::promise<std::shared_ptr<const ParsedDocument>> promise;
+        e.loading = promise.get_future().share();
+        lck.unlock();
+        std::shared_ptr<const ParsedDocument> doc;
+        try {
+            std::string src = readFile(key);
+            uint64_t hash   = std::hash<std::string_view> {}(src);
+            // A document without includes that has the same source is still good.
+            auto same = [&](const std::shared_ptr<const ParsedDocument>& d) {
+                return d and d->tdoc.files.empty() and d->expansion.get() == expansion and d->doc.src == src;
+            };
+            if (same(old)) {
+                doc = old;
+            } else if (!expansion) {
+                lck.lock();
+                for (auto [a, b] = byContent.equal_range(hash); a != b and !doc; ++a)
+                    if (auto d = a->second.lock(); same(d)) doc = d;
+                lck.unlock();
             }
-            if (peek() == Tok::eWhitespace) {
-                // indent = advance().n;
-                indent = peek().n;
-                syamlPrintf("see indent %d\n", indent);
+            if (!doc) {
+                std::shared_ptr<ParsedDocument> parsed;
+                if (expansion) {
+                    parsed = std::make_shared<ParsedDocument>(src, expansion->shared_from_this(), key);
+                    parsed->tdoc.files.insert(parsed->tdoc.files.begin(), { key, stamp });
+                } else {
+                    parsed = std::make_shared<ParsedDocument>(src);
+                }
+                parses_.fetch_add(1, std::memory_order_relaxed);
+                doc = parsed;
+                if (!expansion) {
+                    lck.lock();
+                    for (auto [a, b] = byContent.equal_range(hash); a != b;)
+                        a = a->second.expired() ? byContent.erase(a) : std::next(a);
+                    byContent.emplace(hash, doc);
+                    lck.unlock();
+                }
             }
+        } catch (...) {
+            auto error = std::current_exception();
+            try {
+                throw;
+            } catch (std::runtime_error& err) {
+                error = std::make_exception_ptr(std::runtime_error("in '" + key + "': " + err.what()));
+            } catch (...) {}
+            // Thrown either unlocked, or from a locked region above.
+            if (!lck.owns_lock()) lck.lock();
+            e.loading = {};
+            promise.set_exception(error);
+            std::rethrow_exception(error);
+        }
+        lck.lock();
+        e.doc     = doc;
+        e.stamp   = stamp;
+        e.loading = {};
+        promise.set_value(doc);
+        return doc;
+    }
 
-            syamlPrintf("start tryListFromDash at I=%d\n", I);
+    ReloadableDocument::ReloadableDocument(const std::string& path, std::chrono::milliseconds pollInterval,
+                                           std::shared_ptr<const Expansion> expansion,
+                                           std::function<void(const Version&)> onReload,
+                                           std::function<void(const std::string&)> onError)
+        : onReload(std::move(onReload))
+        , onError(std::move(onError))
+        , path(path)
+        , pollInterval(pollInterval)
+        , expansion(std::move(expansion)) {
+        lastStamp = stamp();
+        publish(ParsedDocument::fromFile(path, this->expansion));
+#ifdef __linux__
+        // Watch the directory rather than the file, so that editors replacing the file by a rename are seen.
+        // Set up before returning, so that no change made after construction can be missed. Only finished
+        // files count: closed after writing, or renamed into place. Not IN_CREATE, which comes before the
+        // contents are written, and would publish a prefix of them.
+        std::filesystem::path p(path);
+        std::string dir = p.has_parent_path() ? p.parent_path().string() : ".";
+        inotifyFd       = inotify_init1(IN_NONBLOCK);
+        wakeFd          = eventfd(0, EFD_NONBLOCK);
+        if (inotifyFd >= 0
+            and inotify_add_watch(inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            close(inotifyFd);
+            inotifyFd = -1;
+        }
+#endif
+        watcher = std::thread([this]() { watch(); });
+    }
 
-            while (!eof()) {
+    ReloadableDocument::~ReloadableDocument() {
+        stopping = true;
+#ifdef __linux__
+        if (wakeFd >= 0) {
+            uint64_t one = 1;
+            (void)!write(wakeFd, &one, sizeof(one));
+        }
+#endif
+        watcher.join();
+#ifdef __linux__
+        if (wakeFd >= 0) close(wakeFd);
+        if (inotifyFd >= 0) close(inotifyFd);
+#endif
+        delete current.load();
+    }
 
-                uint32_t thisIndent = 0;
-                uint32_t savedI     = I;
-                if (peek() == Tok::eWhitespace) { thisIndent = advance().n; }
-                while (peek() == Tok::eNL) {
-                    thisIndent = 0;
-                    advance();
-                    if (peek() == Tok::eWhitespace) { thisIndent = advance().n; }
-                }
-                if (eof()) break;
+    ReloadableDocument::Version ReloadableDocument::get() const {
+        uint64_t e;
+        while (true) {
+            e = epoch.load(std::memory_order_seq_cst);
+            readers[e & 1].fetch_add(1, std::memory_order_seq_cst);
+            if (epoch.load(std::memory_order_seq_cst) == e) break;
+            readers[e & 1].fetch_sub(1, std::memory_order_release);
+        }
+        Version out = current.load(std::memory_order_seq_cst)->doc;
+        readers[e & 1].fetch_sub(1, std::memory_order_release);
+        return out;
+    }
 
-                syamlPrintf(" - peek() '%s': this indent=%d, expected indent=%d\n",
-                            tdoc->getTokenString(peek()).c_str(), thisIndent, indent);
-                if (thisIndent < indent) {
-                    syamlPrintf(" - exiting tryListFromDash because indent was %d < %d\n", thisIndent,
-                                indent);
+    void ReloadableDocument::publish(Version doc) {
+        Published* old = current.exchange(new Published { std::move(doc) }, std::memory_order_seq_cst);
+        version_.fetch_add(1, std::memory_order_release);
+        if (!old) return;
 
-                    // NOTE: This is really tricky: if we fail on this indent, we must **rewind
-                    // back to newline** if (thisIndent) I -= 1;
-                    I = savedI;
+        // Readers that entered before the swap may still be copying `old->doc`.
+        uint64_t e = epoch.fetch_add(1, std::memory_order_seq_cst);
+        while (readers[e & 1].load(std::memory_order_acquire) != 0) std::this_thread::yield();
+        delete old;
+    }
 
-                    break;
+    bool ReloadableDocument::reload() {
+        std::lock_guard<std::mutex> lck(reloadMtx);
+        Version doc;
+        try {
+            doc = ParsedDocument::fromFile(path, expansion);
+        } catch (std::runtime_error& e) {
+            if (onError) onError(e.what());
+            return false;
+        }
+        publish(doc);
+        if (onReload) onReload(doc);
+        return true;
+    }
+
+    std::pair<int64_t, uint64_t> ReloadableDocument::stamp() const {
+        return fileStamp(path);
+    }
+
+    void ReloadableDocument::watch() {
+#ifdef __linux__
+        if (inotifyFd >= 0 and wakeFd >= 0) {
+            std::string name = std::filesystem::path(path).filename().string();
+            alignas(inotify_event) char buf[4096];
+            while (!stopping) {
+                pollfd fds[2] = { { inotifyFd, POLLIN, 0 }, { wakeFd, POLLIN, 0 } };
+                if (poll(fds, 2, -1) <= 0 or stopping) continue;
+                bool changed = false;
+                ssize_t n;
+                while ((n = read(inotifyFd, buf, sizeof(buf))) > 0) {
+                    for (char* c = buf; c < buf + n;) {
+                        auto ev = reinterpret_cast<inotify_event*>(c);
+                        if (ev->len and name == ev->name) changed = true;
+                        c += sizeof(inotify_event) + ev->len;
+                    }
                 }
+                if (changed) reload();
+            }
+            return;
+        }
+#endif
+
+        while (!stopping) {
+            std::this_thread::sleep_for(pollInterval);
+            auto s = stamp();
+            if (s != lastStamp) {
+                lastStamp = s;
+                reload();
+            }
+        }
+    }
+
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Expansion
+    //
+    // ---------------------------------------------------------------------------------------------------
+
+    namespace {
+        // A copy of `n`, a node of an included document, for the including one. Nodes that `n` shares
+        // (through aliases) are shared in the copy too.
+        Node* copyIncluded(const Node* n, Node* parent, std::unordered_map<const Node*, Node*>& copies) {
+            bool shared = n->refs.load(std::memory_order_relaxed) > 1;
+            if (shared) {
+                auto it = copies.find(n);
+                if (it != copies.end()) return retainNode(it->second);
+            }
+            Node* out;
+            if (auto d = dynamic_cast<const DictNode*>(n)) {
+                auto c      = new DictNode(d->tdoc, d->tokRange);
+                c->fromFlow = d->fromFlow;
+                c->keyIds   = d->keyIds;
+                c->children.reserve(d->children.size());
+                for (auto& kv : d->children) c->children.push_back({ kv.first, copyIncluded(kv.second, c, copies) });
+                out = c;
+            } else if (auto l = dynamic_cast<const ListNode*>(n)) {
+                auto c      = new ListNode(l->tdoc, l->tokRange);
+                c->fromDash = l->fromDash;
+                c->children.reserve(l->children.size());
+                for (auto child : l->children) c->children.push_back(copyIncluded(child, c, copies));
+                out = c;
+            } else if (auto sc = dynamic_cast<const ScalarNode*>(n)) {
+                auto c    = new ScalarNode(sc->tdoc, sc->tokRange);
+                c->setInt = sc->setInt;
+                out       = c;
+            } else {
+                out = new EmptyNode(n->tdoc, n->tokRange);
+            }
+            out->setKind  = n->setKind;
+            out->valueStr = n->valueStr;
+            out->dirty    = n->dirty;
+            out->parent   = parent;
+            if (shared) copies[n] = out;
+            return out;
+        }
+    }
 
-                if (thisIndent > indent) {
-                    syamlPrintf("inside list from dash, higher indent...\n");
-                    I          = savedI;
-                    Node* next = nullptr;
-                    if (!next) next = tryListFromDash(); // FIXME: Is this correct?
-                    if (!next) next = tryDict();
+    std::string Expansion::expand(std::string_view text) const {
+        std::string out;
+        out.reserve(text.size());
+        for (size_t i = 0; i < text.size();) {
+            size_t d = text.find('$', i);
+            out += text.substr(i, d - i);
+            if (d == std::string_view::npos) break;
+            if (text.substr(d, 3) == "$${") {
+                out += "${";
+                i = d + 3;
+                continue;
+            }
+            if (text.substr(d, 2) != "${") {
+                out += '$';
+                i = d + 1;
+                continue;
+            }
+            size_t e = text.find('}', d);
+            if (e == std::string_view::npos) throw std::runtime_error("unterminated '${' in '" + std::string { text } + "'");
+            std::string_view inner = text.substr(d + 2, e - d - 2);
+            size_t sep             = inner.find(":-");
+            std::string_view name  = inner.substr(0, sep);
+            if (auto v = variables ? variables(name) : std::nullopt)
+                out += *v;
+            else if (sep != std::string_view::npos)
+                out += inner.substr(sep + 2);
+            else
+                throw std::runtime_error("variable '" + std::string { name } + "' is not set");
+            i = e + 1;
+        }
+        return out;
+    }
 
-                    if (!next) {
-                        throw std::runtime_error("inside dashList with indent > expected, "
-                                                 "should've parsed list or dict");
-                    }
-                    cs.push_back(NodeUPtr { next });
-                    continue;
-                }
+    void Expansion::prepare(TokenizedDoc& tdoc, const std::string& path) const {
+        tdoc.expansion = this;
 
-                Tok open = advance();
-                if (open != Tok::eDash) {
-                    std::stringstream ss;
-                    open.print(ss, *tdoc->doc);
-                    syamlPrintf(" - exiting tryListFromDash, expected dash, got %s\n", ss.str().c_str());
-                    return pg.reject(), nullptr;
+        // Drop the tags and the spaces after them, keeping the tokens of the paths.
+        auto& ts = tdoc.tokens;
+        std::filesystem::path dir = std::filesystem::path(path).parent_path();
+        std::vector<std::pair<uint32_t, std::string>> found;
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < ts.size(); i++) {
+            if (ts[i] != Tok::eTag) {
+                ts[n++] = ts[i];
+                continue;
+            }
+            std::string tag = tdoc.getTokenString(ts[i]);
+            if (tag != "!include") throw std::runtime_error("unsupported tag '" + tag + "' at byte " + std::to_string(ts[i].start));
+            uint32_t j = i + 1;
+            while (j < ts.size() and ts[j] == Tok::eWhitespace) j++;
+            if (ts[j] != Tok::eString)
+                throw std::runtime_error("expected a quoted path after '!include' at byte " + std::to_string(ts[i].start));
+            std::string file = tdoc.doc->getRangeString({ ts[j].start, ts[j].end }, true);
+            file             = expand(ts[j].n ? unescape(file) : file);
+            found.push_back({ n, (dir / file).lexically_normal().string() });
+            i = j - 1;
+        }
+        ts.resize(n);
+        if (found.empty()) return;
+        syamlAssert(includes, "Expansion::prepare(): no include cache");
+        syamlAssert(!weak_from_this().expired(), "Expansion::prepare(): includes need an expansion made with std::make_shared");
+
+        // Load each file once, in parallel.
+        std::vector<std::string> files;
+        for (auto& f : found)
+            if (std::find(files.begin(), files.end(), f.second) == files.end()) files.push_back(f.second);
+        std::vector<std::shared_ptr<const ParsedDocument>> docs(files.size());
+        std::vector<std::exception_ptr> errors(files.size());
+        std::atomic<size_t> next { 0 };
+        auto work = [&]() {
+            for (size_t k; (k = next.fetch_add(1)) < files.size();) {
+                try {
+                    docs[k] = includes->load(files[k], this, path);
+                } catch (...) {
+                    errors[k] = std::current_exception();
                 }
+            }
+        };
+        std::vector<std::thread> pool;
+        for (size_t t = 1; t < std::min<size_t>(threads, files.size()); t++) pool.emplace_back(work);
+        work();
+        for (auto& t : pool) t.join();
+        for (auto& e : errors)
+            if (e) std::rethrow_exception(e);
+
+        for (auto& [tok, file] : found)
+            tdoc.includes[tok] = docs[std::find(files.begin(), files.end(), file) - files.begin()];
+        for (auto& d : docs)
+            for (auto& f : d->tdoc.files)
+                if (std::find(tdoc.files.begin(), tdoc.files.end(), f) == tdoc.files.end()) tdoc.files.push_back(f);
+    }
 
-                Tok cur = peek();
-                while (peek() == Tok::eWhitespace) cur = advance();
-                if (eof()) {
-                    throw std::runtime_error("inside dashList, should've parsed something, got eof");
-                }
+    void Expansion::attach(TokenizedDoc& tdoc, RootNode* root) const {
+        if (tdoc.includes.empty()) return;
+
+        // Scalars that are paths, by their (first) token, replaced by the included trees. Each file is
+        // copied once, and shared like an alias by all the places that include it.
+        std::unordered_map<const ParsedDocument*, Node*> copied;
+        auto replace = [&](Node*& slot, Node* parent) {
+            auto s = dynamic_cast<ScalarNode*>(slot);
+            if (!s or s->tdoc != &tdoc or s->tokRange.end <= s->tokRange.start) return false;
+            auto it = tdoc.includes.find(s->tokRange.start);
+            if (it == tdoc.includes.end()) return false;
+            const RootNode* included = it->second->root.get();
+            Node*& copy              = copied[it->second.get()];
+            if (copy) {
+                retainNode(copy);
+                root->aliased = true;
+            } else {
+                std::unordered_map<const Node*, Node*> copies;
+                copy = copyIncluded(included, parent, copies);
+                root->aliased = root->aliased or included->aliased;
+            }
+            // Every inclusion can be expanded by as<>(), as if it were a copy.
+            root->aliasExpansionLimit += included->aliasExpansionLimit;
+            releaseNode(slot);
+            slot = copy;
+            copy->markDirty();
+            parent->markDirty();
+            return true;
+        };
 
-                if (cur == Tok::eCloseBrace) {
-                    advance();
-                    break;
-                }
+        std::vector<Node*> stack { root };
+        std::unordered_set<const Node*> seen;
+        while (stack.size()) {
+            Node* n = stack.back();
+            stack.pop_back();
+            if (n->refs.load(std::memory_order_relaxed) > 1 and !seen.insert(n).second) continue;
+            if (auto d = dynamic_cast<DictNode*>(n)) {
+                for (auto& kv : d->children)
+                    if (!replace(kv.second, d)) stack.push_back(kv.second);
+            } else if (auto l = dynamic_cast<ListNode*>(n)) {
+                for (auto& c : l->children)
+                    if (!replace(c, l)) stack.push_back(c);
+            }
+        }
+        if (root->aliased) root->markAllDirty();
+    }
 
-                Node* next = nullptr;
-                if (!next) next = tryList();
-                if (!next) next = tryListFromDash();
-                if (!next) next = tryScalar();
-                if (!next) next = tryDict(); // WARNING: This may break.
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Snapshots
+    //
+    // ---------------------------------------------------------------------------------------------------
 
-                if (!next) { throw std::runtime_error("inside dashList, should've parsed list or scalar"); }
+    Snapshot::Snapshot(DictNode* root, std::shared_ptr<const void> source)
+        : root_(root)
+        , source(std::move(source)) {
+    }
 
-                cs.push_back(NodeUPtr { next });
+    Snapshot::Snapshot(std::shared_ptr<ParsedDocument> doc) {
+        // Share the children of the document's root, so that its nodes keep valid parents for as long as we
+        // hold the document.
+        auto lck = doc->root->guard();
+        root_    = new DictNode(doc->root->tdoc, doc->root->tokRange);
+        root_->keyIds = doc->root->keyIds;
+        for (auto& kv : doc->root->children) root_->children.push_back({ kv.first, retainNode(kv.second) });
+        source = std::move(doc);
+    }
 
-                // throw std::runtime_error("nothing parse in inner dict");
-            }
-        } catch (std::runtime_error& e) {
-            std::cout << " - In tryListFromDash(), starting here:\n";
-            print_line_debug(tdoc, pg.I0);
-            pg.reject();
-            throw e;
-        }
+    Snapshot::Snapshot(const Snapshot& o)
+        : root_(o.root_ ? (DictNode*)retainNode(o.root_) : nullptr)
+        , source(o.source) {
+    }
 
-        ListNode* newNode = new ListNode(tdoc, pg.currentRange());
-        newNode->fromDash = true;
+    Snapshot::Snapshot(Snapshot&& o)
+        : root_(o.root_)
+        , source(std::move(o.source)) {
+        o.root_ = nullptr;
+    }
 
-        for (auto& c : cs) newNode->children.push_back(c.release());
-        for (auto& c : newNode->children) c->parent = newNode;
-        syamlPrintf("return list with nitems=%zu\n", cs.size());
+    Snapshot& Snapshot::operator=(Snapshot o) {
+        std::swap(root_, o.root_);
+        std::swap(source, o.source);
+        return *this;
+    }
 
-        return pg.accept(), newNode;
+    Snapshot::~Snapshot() {
+        releaseNode(root_);
     }
 
-    void Parser::skipUntilNonEmptyLine() {
-        // Go from current position to end of line. If we see any non whitespace, stop.
-        while (peek() == Tok::eWhitespace) advance();
-        // Do the skipping process
-        int rollback = I;
-        while (peek() == Tok::eNL) {
-            advance();
-            rollback = I;
-            while (peek() == Tok::eWhitespace) advance();
+    DictNode* Snapshot::withPath(const Node* node, const std::vector<std::string>& path, size_t i, Node* leaf) {
+        auto d = dynamic_cast<const DictNode*>(node);
+        if (node and !d and !node->isEmpty()) {
+            releaseNode(leaf);
+            throw std::runtime_error("Snapshot::set() path goes through a non-dict at '" + path[i - 1] + "'");
         }
-        I = rollback;
-    }
 
-    Node* Parser::tryDict() {
-        ParserGuard pg(this);
+        if (path.empty()) {
+            releaseNode(leaf);
+            throw std::runtime_error("Snapshot::set() called with an empty path");
+        }
 
-        uint32_t indent = 0;
-        using NodeUPtr  = std::unique_ptr<Node>;
-        std::vector<std::pair<std::string, NodeUPtr>> cs;
+        auto out   = new DictNode();
+        out->dirty = true;
+        if (d) {
+            out->children.reserve(d->children.size() + 1);
+            for (auto& kv : d->children) out->children.push_back({ kv.first, retainNode(kv.second) });
+        }
 
+        auto it = std::find_if(out->children.begin(), out->children.end(),
+                               [&](const auto& kv) { return kv.first == path[i]; });
+        Node* value;
         try {
+            if (i + 1 < path.size())
+                value = withPath(it == out->children.end() ? nullptr : it->second, path, i + 1, leaf);
+            else {
+                // A node in a snapshot may only point to a parent that outlives it.
+                visitNodes(leaf, [](Node* n) {
+                    n->parent = nullptr;
+                    return true;
+                });
+                value = leaf;
+            }
+        } catch (...) {
+            releaseNode(out);
+            throw;
+        }
+        if (it != out->children.end()) {
+            releaseNode(it->second);
+            it->second = value;
+        } else
+            out->children.push_back({ path[i], value });
+        return out;
+    }
 
-            while (peek() == Tok::eNL) {
-                indent = 0;
-                advance();
-                if (peek() == Tok::eWhitespace) {
-                    // indent = advance().n;
-                    indent = peek().n;
-                    syamlPrintf("see indent %d\n", indent);
-                }
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Diffing
+    //
+    // ---------------------------------------------------------------------------------------------------
+
+    namespace {
+
+        struct Differ {
+            std::vector<DiffEntry> out;
+            std::string path;
+
+            // The source bytes a node was parsed from, if they still describe it.
+            static std::string_view sourceOf(const Node* n) {
+                if (!n->tdoc or n->dirty or n->setKind or n->tokRange.end <= n->tokRange.start)
+                    return {};
+                const auto& td = *n->tdoc;
+                uint32_t s = td[n->tokRange.start].start, e = td[n->tokRange.end - 1].end;
+                return std::string_view { td.doc->src }.substr(s, e - s);
             }
-            if (peek() == Tok::eWhitespace) {
-                // indent = advance().n;
-                indent = peek().n;
-                syamlPrintf("see indent %d\n", indent);
+
+            // Cheap check for subtrees that are equal. A false result means "don't know".
+            // Uses cached hashes if both have them, then the source bytes, and for subtrees changed by
+            // set() (which the source no longer describes) computes their hashes.
+            static bool identical(const Node* a, const Node* b) {
+                if (a == b) return true;
+                if (a->hashValid.load(std::memory_order_acquire) and b->hashValid.load(std::memory_order_acquire))
+                    return a->cachedHash.load(std::memory_order_relaxed) == b->cachedHash.load(std::memory_order_relaxed);
+                auto sa = sourceOf(a), sb = sourceOf(b);
+                if (sa.data() and sb.data()) return sa == sb;
+                return a->hash_() == b->hash_();
             }
 
-            syamlPrintf("start tryDict at I=%d\n", I);
+            static bool sameScalar(const ScalarNode* a, const ScalarNode* b) {
+                auto isString = [](const ScalarNode* n) {
+                    if (n->setKind) return n->setKind == Node::eSetString;
+                    return n->tdoc->doc->src[(*n->tdoc)[n->tokRange.start].start] == '"';
+                };
+                return isString(a) == isString(b) and a->toScalar<std::string>() == b->toScalar<std::string>();
+            }
 
-            while (!eof()) {
+            void emit(DiffEntry::Kind kind, const Node* a, const Node* b) {
+                out.push_back(DiffEntry { kind, path, a, b });
+            }
 
-                uint32_t thisIndent = 0;
-                uint32_t savedI     = I;
-                if (peek() == Tok::eWhitespace) { thisIndent = advance().n; }
-                while (peek() == Tok::eNL) {
-                    thisIndent = 0;
-                    advance();
-                    if (peek() == Tok::eWhitespace) { thisIndent = advance().n; }
-                }
-                syamlPrintf(" - next key '%s': this indent=%d, expected indent=%d\n",
-                            tdoc->getTokenString(peek()).c_str(), thisIndent, indent);
-                if (thisIndent < indent) {
-                    syamlPrintf(" - exiting tryDict because indent was %d < %d\n", thisIndent, indent);
+            void diff_(const Node* a, const Node* b) {
+                if (identical(a, b)) return;
 
-                    // NOTE: This is really tricky: if we fail on this indent, we must **rewind
-                    // back to newline** if (thisIndent) I -= 1;
-                    I = savedI;
+                auto da = dynamic_cast<const DictNode*>(a), db = dynamic_cast<const DictNode*>(b);
+                auto la = dynamic_cast<const ListNode*>(a), lb = dynamic_cast<const ListNode*>(b);
+                auto sa = dynamic_cast<const ScalarNode*>(a), sb = dynamic_cast<const ScalarNode*>(b);
 
-                    break;
+                if (da and db) return diffDicts(da, db);
+                if (la and lb) return diffLists(la, lb);
+                if (sa and sb) {
+                    if (!sameScalar(sa, sb)) emit(DiffEntry::eChanged, a, b);
+                    return;
                 }
+                if (a->isEmpty() and b->isEmpty()) return;
+                emit(DiffEntry::eChanged, a, b);
+            }
 
-                if (eof()) { break; }
-
-                Tok keyTok = advance();
-                if (keyTok != Tok::eIdent) {
-                    syamlPrintf(" - keyTok @ %d not ident. fail tryDict\n", I - 1);
-                    return pg.reject(), nullptr;
+            // Keys are matched by position first, since they rarely move, then by name.
+            void diffDicts(const DictNode* a, const DictNode* b) {
+                size_t n0  = path.length();
+                auto enter = [&](const std::string& k) {
+                    path.resize(n0);
+                    if (n0) path += '.';
+                    path += k;
+                };
+                const auto &ca = a->children, &cb = b->children;
+
+                std::vector<bool> matched(cb.size(), false);
+                std::unordered_map<std::string_view, size_t> bIndex;
+                auto findInB = [&](size_t i) -> size_t {
+                    const auto& k = ca[i].first;
+                    if (i < cb.size() and cb[i].first == k) return i;
+                    if (cb.size() <= 16) {
+                        for (size_t j = 0; j < cb.size(); j++)
+                            if (cb[j].first == k) return j;
+                        return cb.size();
+                    }
+                    if (bIndex.empty())
+                        for (size_t j = cb.size(); j-- > 0;) bIndex[cb[j].first] = j;
+                    auto it = bIndex.find(k);
+                    return it == bIndex.end() ? cb.size() : it->second;
+                };
+
+                for (size_t i = 0; i < ca.size(); i++) {
+                    enter(ca[i].first);
+                    size_t j = findInB(i);
+                    if (j < cb.size()) {
+                        matched[j] = true;
+                        diff_(ca[i].second, cb[j].second);
+                    } else
+                        emit(DiffEntry::eRemoved, ca[i].second, nullptr);
                 }
-                syamlPrintf(" - keyTok @ %d = %s\n", I - 1, tdoc->getTokenString(keyTok).c_str());
-
-                Tok colon = advance();
-                if (colon != Tok::eColon) {
-                    syamlPrintf(" - missing colon. fail tryDict\n");
-                    return pg.reject(), nullptr;
+                for (size_t j = 0; j < cb.size(); j++) {
+                    if (matched[j]) continue;
+                    enter(cb[j].first);
+                    emit(DiffEntry::eAdded, nullptr, cb[j].second);
                 }
+                path.resize(n0);
+            }
 
-                while (peek() == Tok::eWhitespace) { advance(); }
-
-                if (eof()) { throw std::runtime_error("nope"); }
-
-                Tok cur = peek();
-
-                // We MUST be starting a list
-                if (cur == Tok::eOpenBrace) {
-                    // advance();
-                    Node* innerList = tryList();
-                    if (innerList) {
-                        while (peek() == Tok::eWhitespace) { advance(); }
-                        while (peek() == Tok::eNL) { advance(); }
-                        cs.push_back({ tdoc->getTokenString(keyTok), NodeUPtr { innerList } });
-                    } else
-                        throw std::runtime_error("looked like a list inside a map, but failed "
-                                                 "to parse the inner list");
-                    continue;
+            // Items are matched by index, after trimming the common prefix and suffix, so that inserting or
+            // removing items only reports those items.
+            void diffLists(const ListNode* a, const ListNode* b) {
+                size_t n0  = path.length();
+                auto enter = [&](size_t i) {
+                    path.resize(n0);
+                    path += '[' + std::to_string(i) + ']';
+                };
+                const auto &ca = a->children, &cb = b->children;
+
+                size_t pre = 0;
+                while (pre < ca.size() and pre < cb.size() and identical(ca[pre], cb[pre])) pre++;
+                size_t suf = 0;
+                while (suf < ca.size() - pre and suf < cb.size() - pre
+                       and identical(ca[ca.size() - 1 - suf], cb[cb.size() - 1 - suf]))
+                    suf++;
+
+                size_t na = ca.size() - pre - suf, nb = cb.size() - pre - suf;
+                for (size_t i = 0; i < std::min(na, nb); i++) {
+                    enter(pre + i);
+                    diff_(ca[pre + i], cb[pre + i]);
+                }
+                for (size_t i = nb; i < na; i++) {
+                    enter(pre + i);
+                    emit(DiffEntry::eRemoved, ca[pre + i], nullptr);
+                }
+                for (size_t i = na; i < nb; i++) {
+                    enter(pre + i);
+                    emit(DiffEntry::eAdded, nullptr, cb[pre + i]);
                 }
+                path.resize(n0);
+            }
+        };
+    }
 
-                // We MUST be starting a list, map, or empty item
-                if (cur == Tok::eNL) {
+    std::vector<DiffEntry> diff(const Node* before, const Node* after) {
+        auto ra = before->getRoot(false), rb = after->getRoot(false);
+        std::unique_lock<std::mutex> ga, gb;
+        if (ra) ga = std::unique_lock<std::mutex>(ra->mtx, std::defer_lock);
+        if (rb and rb != ra) gb = std::unique_lock<std::mutex>(rb->mtx, std::defer_lock);
+        if (ga.mutex() and gb.mutex())
+            std::lock(ga, gb);
+        else if (ga.mutex())
+            ga.lock();
+        else if (gb.mutex())
+            gb.lock();
+
+        Differ d;
+        d.diff_(before, after);
+        return std::move(d.out);
+    }
 
-                    ParserGuard lookahead_pg(this);
-                    cur = peek();
-                    while (cur == Tok::eNL) {
-                        advance();
-                        cur = peek();
-                    }
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Validation
+    //
+    // ---------------------------------------------------------------------------------------------------
 
-                    // For the inner dict/list, check that the indentation lines up (yes: must
-                    // do this here and not the recursive call)
-                    uint32_t innerIndent = 0;
-                    if (peek() == Tok::eWhitespace) {
-                        innerIndent = peek().n;
-                        advance();
-                    }
-                    if (innerIndent <= indent) {
-                        syamlPrintf("in tryDict(), innerIndent %d <= indent %d. This must mean "
-                                    "that the "
-                                    "current item '%s' is "
-                                    "empty.\n",
-                                    innerIndent, indent, tdoc->getTokenString(keyTok).c_str());
-                        cs.push_back({ tdoc->getTokenString(keyTok),
-                                       NodeUPtr { new EmptyNode(tdoc, lookahead_pg.currentRange()) } });
-                        lookahead_pg.reject();
-                        continue;
-                    }
+    namespace {
 
-                    // NOTE: Always reject `lookahead_pg` because tryDict/tryListFromDash wants
-                    // the whitespace to process itself.
+        struct Validator {
+            std::vector<Violation> out;
+            std::string path;
+
+            // Whether nodes can be reached more than once. Shared nodes are then only checked once against
+            // each rule, so that aliasing the same subtree over and over can't make validation exponential.
+            bool aliased = false;
+            std::set<std::pair<const Node*, const Rule*>> checked;
+
+            // For each dict being checked, which of its rule's keys were seen. A stack shared by all
+            // dicts, so checking a huge document does not allocate per dict.
+            std::vector<uint8_t> seen;
+
+            // Start of each line of `lineDoc`, built on the first violation.
+            const Document* lineDoc = nullptr;
+            std::vector<uint32_t> lineStarts;
+
+            static const char* typeName(Rule::Type t) {
+                switch (t) {
+                case Rule::eAny: return "anything";
+                case Rule::eDict: return "a dict";
+                case Rule::eList: return "a list";
+                case Rule::eString: return "a string";
+                case Rule::eNumber: return "a number";
+                case Rule::eInteger: return "an integer";
+                case Rule::eBool: return "true or false";
+                }
+                return "";
+            }
+            static const char* kindOf(const Node* n) {
+                if (dynamic_cast<const DictNode*>(n)) return "a dict";
+                if (dynamic_cast<const ListNode*>(n)) return "a list";
+                if (dynamic_cast<const ScalarNode*>(n)) return "a scalar";
+                return "no value";
+            }
 
-                    // We MUST be starting a new list
-                    if (peek() == Tok::eDash) {
-                        // lookahead_pg.accept();
-                        lookahead_pg.reject();
+            // Where `n`, or its closest ancestor from the source, starts.
+            static std::pair<const Document*, uint32_t> sourceOf(const Node* n) {
+                for (; n; n = n->parent) {
+                    if (!n->tdoc or n->tokRange.end <= n->tokRange.start) continue;
+                    const auto& td = *n->tdoc;
+                    for (uint32_t i = n->tokRange.start; i < n->tokRange.end; i++)
+                        if (td[i] != Tok::eWhitespace and td[i] != Tok::eNL) return { td.doc, td[i].start };
+                }
+                return { nullptr, 0 };
+            }
 
-                        while (peek() == Tok::eWhitespace) advance();
+            // Where the key of `value` starts: the tokens before the colon in front of it, back to the
+            // start of the line (or the `{` or `,` of a flow dict).
+            static std::pair<const Document*, uint32_t> keyOf(const Node* value) {
+                if (!value->tdoc or value->tokRange.end <= value->tokRange.start) return sourceOf(value);
+                const auto& td = *value->tdoc;
+                uint32_t i     = value->tokRange.start;
+                while (i > 0 and (td[i - 1] == Tok::eWhitespace or td[i - 1] == Tok::eNL or td[i - 1] == Tok::eAnchor))
+                    i--;
+                if (i == 0 or td[i - 1] != Tok::eColon) return sourceOf(value);
+                int64_t at = -1;
+                for (i--; i > 0; i--) {
+                    const auto& t = td[i - 1];
+                    if (t == Tok::eNL or t == Tok::eComma or t == Tok::eOpenCurly or t == Tok::eDash) break;
+                    if (t != Tok::eWhitespace) at = t.start;
+                }
+                if (at < 0) return sourceOf(value);
+                return { td.doc, (uint32_t)at };
+            }
 
-                        Node* innerList = tryListFromDash();
-                        if (innerList) {
-                            cs.push_back({ tdoc->getTokenString(keyTok), NodeUPtr { innerList } });
-                        } else
-                            throw std::runtime_error("looked like a list (from dash) inside a map, "
-                                                     "but failed to parse the inner list");
-                        continue;
+            void report(std::pair<const Document*, uint32_t> at, std::string message) {
+                Violation v { path, std::move(message) };
+                if (at.first) {
+                    if (lineDoc != at.first) {
+                        lineDoc = at.first;
+                        lineStarts.assign(1, 0);
+                        for (uint32_t i = 0; i < lineDoc->src.length(); i++)
+                            if (lineDoc->src[i] == '\n') lineStarts.push_back(i + 1);
                     }
+                    auto line = std::upper_bound(lineStarts.begin(), lineStarts.end(), at.second) - lineStarts.begin();
+                    v.line    = (uint32_t)line;
+                    v.column  = at.second - lineStarts[line - 1] + 1;
+                }
+                out.push_back(std::move(v));
+            }
+            void report(const Node* n, std::string message) {
+                report(sourceOf(n), std::move(message));
+            }
 
-                    lookahead_pg.reject();
-                    {
-                        // We MUST be starting a new map
-                        while (peek() == Tok::eNL) advance();
+            static std::string number(double v) {
+                char buf[32];
+                auto end = std::to_chars(buf, buf + sizeof(buf), v).ptr;
+                return std::string(buf, end);
+            }
 
-                        Node* innerDict = tryDict();
-                        if (innerDict) {
-                            cs.push_back({ tdoc->getTokenString(keyTok), NodeUPtr { innerDict } });
-                        } else {
-                            int rollback = I;
-                            while (peek() == Tok::eWhitespace) advance();
-                            if (eof()) {
-                                // ok.
-                                break;
-                            } else {
-                                I = rollback;
-                                throw std::runtime_error("looked like a map inside a map, but failed "
-                                                         "to parse the inner one");
-                            }
-                        }
-                        continue;
+            void check(const Node* n, const Rule& r) {
+                if (aliased and n->refs.load(std::memory_order_relaxed) > 1 and not checked.emplace(n, &r).second) return;
+                if (r.type == Rule::eDict) {
+                    if (auto d = dynamic_cast<const DictNode*>(n)) return checkDict(d, r);
+                } else if (r.type == Rule::eList) {
+                    if (auto l = dynamic_cast<const ListNode*>(n)) return checkList(l, r);
+                } else if (auto s = dynamic_cast<const ScalarNode*>(n)) {
+                    return checkScalar(s, r);
+                } else if (r.type == Rule::eAny) {
+                    return;
+                }
+                report(n, std::string { "expected " } + typeName(r.type) + ", got " + kindOf(n));
+            }
+
+            void checkScalar(const ScalarNode* s, const Rule& r) {
+                std::string_view text = s->view_();
+                bool quoted           = s->setKind
+                                ? s->setKind == Node::eSetString
+                                : s->isBlock() or s->tdoc->doc->src[(*s->tdoc)[s->tokRange.start].start] == '"';
+                auto got              = [&]() { return std::string { ", got '" } + std::string { text } + "'"; };
+
+                double v = 0;
+                if (r.type == Rule::eNumber or r.type == Rule::eInteger) {
+                    // The same as as<double>() and as<int64_t>() accept, without a stringstream.
+                    std::string_view t = text.size() and text[0] == '+' ? text.substr(1) : text;
+                    std::from_chars_result res {};
+                    if (r.type == Rule::eNumber) {
+                        res = std::from_chars(t.data(), t.data() + t.size(), v);
+                        if (res.ec == std::errc {} and not std::isfinite(v)) res.ec = std::errc::invalid_argument;
+                    } else {
+                        int64_t i = 0;
+                        res       = std::from_chars(t.data(), t.data() + t.size(), i);
+                        v         = (double)i;
                     }
+                    if (quoted or t.empty() or res.ec != std::errc {} or res.ptr != t.data() + t.size())
+                        return report(s, std::string { "expected " } + typeName(r.type) + got());
+                    if (v < r.min) return report(s, "expected at least " + number(r.min) + got());
+                    if (v > r.max) return report(s, "expected at most " + number(r.max) + got());
+                } else if (r.type == Rule::eBool) {
+                    static const std::string_view bools[] = { "true", "false", "True", "False", "TRUE", "FALSE" };
+                    if (quoted or std::find(std::begin(bools), std::end(bools), text) == std::end(bools))
+                        return report(s, std::string { "expected " } + typeName(r.type) + got());
                 }
 
-                // We MUST be starting a scalar
-                Node* innerScalar = tryScalar();
-                if (innerScalar) {
-                    while (peek() == Tok::eWhitespace) { advance(); }
-                    while (peek() == Tok::eNL) { advance(); }
-                    cs.push_back({ tdoc->getTokenString(keyTok), NodeUPtr { innerScalar } });
-                    continue;
-                } else
-                    throw std::runtime_error("looked like a scalar inside a map, but failed to "
-                                             "parse the inner scalar");
+                if (r.values.size() and std::find(r.values.begin(), r.values.end(), text) == r.values.end()) {
+                    std::string msg = "expected one of ";
+                    for (size_t i = 0; i < r.values.size(); i++) msg += (i ? ", '" : "'") + r.values[i] + "'";
+                    report(s, msg + got());
+                }
+            }
 
-                throw std::runtime_error("nothing parse in inner dict");
+            void checkList(const ListNode* l, const Rule& r) {
+                size_t n = l->children.size();
+                if (n < r.minLength or n > r.maxLength) {
+                    std::string msg = r.minLength == r.maxLength ? "expected " + std::to_string(r.minLength)
+                                    : n < r.minLength            ? "expected at least " + std::to_string(r.minLength)
+                                                                 : "expected at most " + std::to_string(r.maxLength);
+                    report(l, msg + " items, got " + std::to_string(n));
+                }
+                if (not r.items) return;
+                size_t n0 = path.length();
+                char buf[24];
+                for (size_t i = 0; i < n; i++) {
+                    path.resize(n0);
+                    path += '[';
+                    path.append(buf, std::to_chars(buf, buf + sizeof(buf), i).ptr);
+                    path += ']';
+                    check(l->children[i], *r.items);
+                }
+                path.resize(n0);
             }
-        } catch (std::runtime_error& e) {
-            std::cout << " - In tryDict(), starting here:\n";
-            print_line_debug(tdoc, pg.I0);
-            pg.reject();
-            throw e;
-        }
 
-        if (cs.size()) {
-            DictNode* newNode = new DictNode(tdoc, pg.currentRange());
-            if constexpr (is_vector<decltype(newNode->children)>::value) {
-                for (auto& kv : cs) newNode->children.push_back({ kv.first, kv.second.release() });
-            } else {
-                // for (auto& kv : cs) newNode->children[kv.first] = kv.second.release();
-                syamlAssert(false);
+            void checkDict(const DictNode* d, const Rule& r) {
+                size_t n0 = path.length(), base = seen.size();
+                seen.resize(base + r.keys.size(), 0);
+                std::vector<const DictNode*> merged;
+                checkChildren(d, r, n0, base, merged);
+                for (size_t i = 0; i < r.keys.size(); i++) {
+                    if (seen[base + i] or not r.keys[i].second.required) continue;
+                    enter(n0, r.keys[i].first);
+                    report(d, "missing key '" + r.keys[i].first + "'");
+                }
+                path.resize(n0);
+                seen.resize(base);
             }
-            for (auto& kv : newNode->children) kv.second->parent = newNode;
-            return pg.accept(), newNode;
-        } else
-            return pg.reject(), nullptr;
-    }
 
-    ListNode::~ListNode() {
-        for (auto c : children) delete c;
-        children.clear();
-    }
-    DictNode::~DictNode() {
-        for (auto kv : children) delete kv.second;
-        children.clear();
-    }
-    ScalarNode::~ScalarNode() {
-    }
+            // Explicit keys first, so that they win over merged ones. Each dict is merged at most once,
+            // however many times it is aliased.
+            void checkChildren(const DictNode* d, const Rule& r, size_t n0, size_t base, std::vector<const DictNode*>& merged) {
+                bool merges = false;
+                for (auto& kv : d->children) {
+                    if (kv.first == "<<") {
+                        merges = true;
+                        continue;
+                    }
+                    enter(n0, kv.first);
+                    auto it = r.keyIndex.find(kv.first);
+                    if (it != r.keyIndex.end()) {
+                        // Keys with no value count as missing.
+                        if (seen[base + it->second] or kv.second->isEmpty()) continue;
+                        seen[base + it->second] = 1;
+                        check(kv.second, r.keys[it->second].second);
+                    } else if (r.items) {
+                        check(kv.second, *r.items);
+                    } else if (not r.allowUnknown) {
+                        report(keyOf(kv.second), "unknown key '" + kv.first + "'");
+                    }
+                }
+                path.resize(n0);
+                if (merges)
+                    d->forEachMerged([&](const DictNode* m) {
+                        if (std::find(merged.begin(), merged.end(), m) != merged.end()) return;
+                        merged.push_back(m);
+                        checkChildren(m, r, n0, base, merged);
+                    });
+            }
 
-    DictNode* Node::asDict() {
-        auto out = dynamic_cast<DictNode*>(this);
-        if (!out) throw std::runtime_error("bad cast to DictNode");
-        return out;
-    }
-    ListNode* Node::asList() {
-        auto out = dynamic_cast<ListNode*>(this);
-        if (!out) throw std::runtime_error("bad cast to ListNode");
-        return out;
-    }
-    ScalarNode* Node::asScalar() {
-        auto out = dynamic_cast<ScalarNode*>(this);
-        if (!out) throw std::runtime_error("bad cast to ScalarNode");
-        return out;
+            void enter(size_t n0, const std::string& k) {
+                path.resize(n0);
+                if (n0) path += '.';
+                path += k;
+            }
+        };
     }
 
-    RootNode* Node::getRoot(bool required) const {
-        Node* node = const_cast<Node*>(this);
-        while (node->parent) node = node->parent;
-        RootNode* root = dynamic_cast<RootNode*>(node);
-        if (required) syamlAssert(root != nullptr, "getRoot() failed");
-        return root;
+    std::vector<Violation> validate(const Node* node, const Rule& rule) {
+        auto root = node->getRoot(false);
+        auto g    = root ? root->guard() : decltype(root->guard()) {};
+        Validator v;
+        v.aliased = root ? root->aliased : true;
+        v.check(node, rule);
+        return std::move(v.out);
     }
 
     namespace {
@@ -1449,11 +5164,35 @@ self->children.end()) self->children.erase(oldIt);
             bool lastWasNl   = true;
             bool lastWasDash = false;
 
+            // Nodes that appear more than once in the tree (through aliases) are written once with an
+            // anchor and then as aliases, so the output stays proportional to the tree's unique nodes.
+            // Value is 0 for nodes seen once, -1 for ones seen again but not yet written, and the
+            // anchor's number once written.
+            std::unordered_map<const Node*, int> shared;
+            int anchors = 0;
+            void findShared(const Node* node);
+
         public:
             void serialize_(Node* node, int depth);
             std::string serialize(Node* node);
         };
 
+        void Serialization::findShared(const Node* node) {
+            // Only nodes with more than one reference can appear twice.
+            if (node->refs.load(std::memory_order_relaxed) > 1) {
+                auto it = shared.find(node);
+                if (it != shared.end()) {
+                    it->second = -1;
+                    return;
+                }
+                shared[node] = 0;
+            }
+            if (auto d = dynamic_cast<const DictNode*>(node))
+                for (auto& kv : d->children) findShared(kv.second);
+            else if (auto l = dynamic_cast<const ListNode*>(node))
+                for (auto c : l->children) findShared(c);
+        }
+
         void Serialization::serialize_(Node* node, int depth) {
 
             auto indent = [this](int depth) {
@@ -1472,9 +5211,40 @@ self->children.end()) self->children.erase(oldIt);
                 }
             };
 
+            if (shared.size()) {
+                auto it = shared.find(node);
+                if (it != shared.end() and it->second > 0) {
+                    ss << "*a" << it->second;
+                    lastWasDash = lastWasNl = false;
+                    return;
+                } else if (it != shared.end() and it->second < 0) {
+                    it->second = ++anchors;
+                    ss << "&a" << it->second << " ";
+                    lastWasDash = lastWasNl = false;
+                }
+            }
+
             auto d = dynamic_cast<DictNode*>(node);
             if (d == nullptr) d = dynamic_cast<RootNode*>(node);
-            if (d) {
+            if (d and d->isFromFlow()) {
+                ss << "{";
+                lastWasDash = lastWasNl = false;
+                for (uint32_t i = 0; i < d->children.size(); i++) {
+                    // Keys that would not lex as an ident came from a string.
+                    const auto& key = d->children[i].first;
+                    bool plain      = key == "<<"
+                               or (key.size() and is_alpha(key[0])
+                                   and std::all_of(key.begin(), key.end(), [](char c) { return is_alpha(c) or is_numer(c); }));
+                    if (plain)
+                        ss << key << ": ";
+                    else
+                        ss << quote(key) << ": ";
+                    serialize_(d->children[i].second, 1 + depth);
+                    if (i < d->children.size() - 1) ss << ", ";
+                }
+                ss << "}";
+                lastWasDash = lastWasNl = false;
+            } else if (d) {
                 newline();
                 for (auto kv : d->children) {
                     auto key   = kv.first;
@@ -1513,8 +5283,26 @@ self->children.end()) self->children.erase(oldIt);
                     }
                 }
             } else if (auto s = dynamic_cast<ScalarNode*>(node)) {
-                if (s->valueStr.length() != 0) {
-                    ss << s->valueStr;
+                if (s->setKind == Node::eSetString) {
+                    ss << quote(s->valueStr);
+                } else if (s->setKind) {
+                    char buf[32];
+                    ss << s->setText(buf);
+                } else if (auto t = s->blockTok()) {
+                    // Re-indent the block's lines to `depth`. An explicit indentation indicator is only
+                    // needed when the first line starts with spaces.
+                    auto b = BlockScalar::of(s->tdoc->doc->src, *t);
+                    bool first = true, indicator = false;
+                    b.forEachLine([&](std::string_view line) {
+                        if (first and line.size()) indicator = line[0] == ' ', first = false;
+                    });
+                    ss << b.style;
+                    if (indicator) ss << 4;
+                    if (b.chomp) ss << b.chomp;
+                    b.forEachLine([&](std::string_view line) {
+                        ss << "\n";
+                        if (line.size()) indent(depth), ss << line;
+                    });
                 } else {
                     ss << s->tdoc->getTokenRangeString(s->tokRange);
                 }
@@ -1528,6 +5316,8 @@ self->children.end()) self->children.erase(oldIt);
         }
 
         std::string Serialization::serialize(Node* root) {
+            findShared(root);
+            for (auto it = shared.begin(); it != shared.end();) it = it->second ? std::next(it) : shared.erase(it);
             serialize_(root, 0);
             return ss.str();
         }
@@ -1539,9 +5329,692 @@ self->children.end()) self->children.erase(oldIt);
         return s.serialize(root);
     }
 
+    namespace {
+
+        // A scalar's value, read from its text the way as<T>() would: plain scalars by YAML's core schema,
+        // and quoted and block scalars as strings. `text` is unescaped, and in the source when possible.
+        struct ScalarValue {
+            enum Kind { eNull, eBool, eInt, eFloat, eString } kind;
+            std::string_view text;
+            int64_t i = 0;
+            double d  = 0;
+
+            static ScalarValue of(const ScalarNode* s) {
+                std::string_view text = s->view_();
+                bool quoted           = s->setKind
+                                ? s->setKind == Node::eSetString
+                                : s->isBlock() or s->tdoc->doc->src[(*s->tdoc)[s->tokRange.start].start] == '"';
+                if (quoted) return { eString, text };
+                if (s->setKind == Node::eSetInt) return { eInt, text, s->setInt };
+                if (s->setKind == Node::eSetBool) return { eBool, text, s->setInt };
+                if (s->setKind == Node::eSetDouble and std::isfinite(s->setDouble)) return { eFloat, text, 0, s->setDouble };
+                if (text == "null" or text == "Null" or text == "NULL" or text == "~") return { eNull, text };
+                if (text == "true" or text == "True" or text == "TRUE") return { eBool, text, 1 };
+                if (text == "false" or text == "False" or text == "FALSE") return { eBool, text, 0 };
+
+                std::string_view t = text.size() and text[0] == '+' ? text.substr(1) : text;
+                const char* end    = t.data() + t.size();
+                if (t.empty() or not(is_numer(t[0]) or t[0] == '-' or t[0] == '.')) return { eString, text };
+                ScalarValue v { eInt, text };
+                auto r = std::from_chars(t.data(), end, v.i);
+                if (r.ec == std::errc {} and r.ptr == end) return v;
+                r = std::from_chars(t.data(), end, v.d);
+                if (r.ec != std::errc {} or r.ptr != end or not std::isfinite(v.d)) return { eString, text };
+                v.kind = eFloat;
+                return v;
+            }
+        };
+
+        // Whether `d` has `<<` keys.
+        inline bool hasMerges(const DictNode* d) {
+            for (auto& kv : d->children)
+                if (kv.first == "<<") return true;
+            return false;
+        }
+
+        // The entries of a dict with `<<` keys, resolved like toMap() does: explicit keys win over merged
+        // ones, and earlier merges over later ones. Each dict in `merged` is visited once, however many
+        // times it is aliased, and its keys are charged to the alias budget.
+        void mergedEntries(const DictNode* d, std::vector<std::pair<const std::string*, const Node*>>& out,
+                           std::unordered_set<std::string_view>& seen, std::vector<const DictNode*>& merged) {
+            for (auto& kv : d->children)
+                if (kv.first != "<<" and seen.insert(kv.first).second) out.push_back({ &kv.first, kv.second });
+            d->forEachMerged([&](const DictNode* m) {
+                if (std::find(merged.begin(), merged.end(), m) != merged.end()) return;
+                merged.push_back(m);
+                spendAliasExpansion(m->children.size());
+                mergedEntries(m, out, seen, merged);
+            });
+        }
+
+        // Calls `f(key, value)` for each entry of `d`, after `count(n)` with how many there are.
+        template <class C, class F> void forEachEntry(const DictNode* d, C&& count, F&& f) {
+            spendAliasExpansion(d->children.size());
+            if (not hasMerges(d)) {
+                count(d->children.size());
+                for (auto& kv : d->children) f(kv.first, kv.second);
+                return;
+            }
+            std::vector<std::pair<const std::string*, const Node*>> entries;
+            std::unordered_set<std::string_view> seen;
+            std::vector<const DictNode*> merged;
+            mergedEntries(d, entries, seen, merged);
+            spendAliasExpansion(entries.size());
+            count(entries.size());
+            for (auto& kv : entries) f(*kv.first, kv.second);
+        }
+
+        // Checks that `s` is a number as JSON spells it, which is stricter than YAML (no `.5` or `1.`).
+        bool isJsonNumber(std::string_view s) {
+            size_t i    = 0, n = s.size();
+            auto digits = [&]() {
+                size_t i0 = i;
+                while (i < n and is_numer(s[i])) i++;
+                return i > i0;
+            };
+            if (i < n and s[i] == '-') i++;
+            if (i < n and s[i] == '0')
+                i++;
+            else if (not digits())
+                return false;
+            if (i < n and s[i] == '.') {
+                i++;
+                if (not digits()) return false;
+            }
+            if (i < n and (s[i] == 'e' or s[i] == 'E')) {
+                i++;
+                if (i < n and (s[i] == '+' or s[i] == '-')) i++;
+                if (not digits()) return false;
+            }
+            return i == n;
+        }
+
+        struct JsonWriter {
+            OutBuffer& out;
+
+            // Runs of characters that need no escaping are written in one go.
+            void string(std::string_view s) {
+                static const char hex[] = "0123456789abcdef";
+                out.put('"');
+                size_t run = 0;
+                for (size_t i = 0; i < s.size(); i++) {
+                    unsigned char c = s[i];
+                    if (c >= 0x20 and c != '"' and c != '\\') continue;
+                    out.write(s.data() + run, i - run);
+                    run = i + 1;
+                    switch (c) {
+                    case '"': out.write("\\\"", 2); break;
+                    case '\\': out.write("\\\\", 2); break;
+                    case '\n': out.write("\\n", 2); break;
+                    case '\t': out.write("\\t", 2); break;
+                    case '\r': out.write("\\r", 2); break;
+                    default: {
+                        char u[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+                        out.write(u, 6);
+                    }
+                    }
+                }
+                out.write(s.data() + run, s.size() - run);
+                out.put('"');
+            }
+
+            void scalar(const ScalarNode* s) {
+                auto v = ScalarValue::of(s);
+                switch (v.kind) {
+                case ScalarValue::eNull: return out.write("null", 4);
+                case ScalarValue::eBool: return v.i ? out.write("true", 4) : out.write("false", 5);
+                case ScalarValue::eString: return string(v.text);
+                case ScalarValue::eInt:
+                case ScalarValue::eFloat:
+                    if (isJsonNumber(v.text)) return out.write(v.text);
+                    char buf[32];
+                    auto end = v.kind == ScalarValue::eInt ? std::to_chars(buf, buf + sizeof(buf), v.i).ptr
+                                                           : std::to_chars(buf, buf + sizeof(buf), v.d).ptr;
+                    return out.write(buf, end - buf);
+                }
+            }
+
+            void node(const Node* n) {
+                if (auto d = dynamic_cast<const DictNode*>(n)) {
+                    out.put('{');
+                    bool first = true;
+                    forEachEntry(d, [](size_t) {}, [&](const std::string& k, const Node* v) {
+                        if (not first) out.put(',');
+                        first = false;
+                        string(k);
+                        out.put(':');
+                        node(v);
+                    });
+                    out.put('}');
+                } else if (auto l = dynamic_cast<const ListNode*>(n)) {
+                    spendAliasExpansion(l->children.size());
+                    out.put('[');
+                    for (size_t i = 0; i < l->children.size(); i++) {
+                        if (i) out.put(',');
+                        node(l->children[i]);
+                    }
+                    out.put(']');
+                } else if (auto s = dynamic_cast<const ScalarNode*>(n)) {
+                    scalar(s);
+                } else {
+                    out.write("null", 4);
+                }
+            }
+        };
+
+        // See https://github.com/msgpack/msgpack/blob/master/spec.md. Every value is written in the
+        // smallest format that holds it.
+        struct MsgPackWriter {
+            OutBuffer& out;
+
+            // `tag` followed by the `bytes` low bytes of `v`, big-endian.
+            void tagged(uint8_t tag, uint64_t v, int bytes) {
+                char buf[9] = { (char)tag };
+                for (int k = 0; k < bytes; k++) buf[1 + k] = (char)(v >> (8 * (bytes - 1 - k)));
+                out.write(buf, 1 + bytes);
+            }
+            // The header of a string, array or map of `n` items. `fix` is the tag of the form that holds
+            // the size in its low bits, up to `fixMax`. `tag16` is that of the form with a 16-bit size, and
+            // the 32-bit one comes right after it.
+            void header(size_t n, uint8_t fix, size_t fixMax, uint8_t tag16) {
+                if (n <= fixMax)
+                    out.put((char)(fix | n));
+                else if (n <= 0xffff)
+                    tagged(tag16, n, 2);
+                else
+                    tagged(tag16 + 1, n, 4);
+            }
+
+            void string(std::string_view s) {
+                if (s.size() < 32)
+                    out.put((char)(0xa0 | s.size()));
+                else if (s.size() <= 0xff)
+                    tagged(0xd9, s.size(), 1);
+                else
+                    header(s.size(), 0, 0, 0xda);
+                out.write(s);
+            }
+
+            void integer(int64_t i) {
+                if (i >= 0) {
+                    if (i < 128) return out.put((char)i);
+                    if (i <= 0xff) return tagged(0xcc, i, 1);
+                    if (i <= 0xffff) return tagged(0xcd, i, 2);
+                    if (i <= 0xffffffffll) return tagged(0xce, i, 4);
+                    return tagged(0xcf, i, 8);
+                }
+                if (i >= -32) return out.put((char)i);
+                if (i >= INT8_MIN) return tagged(0xd0, (uint64_t)i, 1);
+                if (i >= INT16_MIN) return tagged(0xd1, (uint64_t)i, 2);
+                if (i >= INT32_MIN) return tagged(0xd2, (uint64_t)i, 4);
+                return tagged(0xd3, (uint64_t)i, 8);
+            }
+
+            void scalar(const ScalarNode* s) {
+                auto v = ScalarValue::of(s);
+                switch (v.kind) {
+                case ScalarValue::eNull: return out.put((char)0xc0);
+                case ScalarValue::eBool: return out.put((char)(v.i ? 0xc3 : 0xc2));
+                case ScalarValue::eString: return string(v.text);
+                case ScalarValue::eInt: return integer(v.i);
+                case ScalarValue::eFloat: {
+                    uint64_t bits;
+                    std::memcpy(&bits, &v.d, sizeof(bits));
+                    return tagged(0xcb, bits, 8);
+                }
+                }
+            }
+
+            void node(const Node* n) {
+                if (auto d = dynamic_cast<const DictNode*>(n)) {
+                    forEachEntry(d, [&](size_t count) { header(count, 0x80, 15, 0xde); },
+                                 [&](const std::string& k, const Node* v) {
+                                     string(k);
+                                     node(v);
+                                 });
+                } else if (auto l = dynamic_cast<const ListNode*>(n)) {
+                    spendAliasExpansion(l->children.size());
+                    header(l->children.size(), 0x90, 15, 0xdc);
+                    for (auto c : l->children) node(c);
+                } else if (auto s = dynamic_cast<const ScalarNode*>(n)) {
+                    scalar(s);
+                } else {
+                    out.put((char)0xc0);
+                }
+            }
+        };
+
+        // Locks the root, and for documents with aliases limits how far they may expand, like as() does.
+        template <class F> size_t emit(const Node* node, OutBuffer& out, F&& f) {
+            auto root = node->getRoot(false);
+            auto g    = root ? root->guard() : decltype(root->guard()) {};
+            AliasExpansionScope budget(root);
+            f();
+            out.finish();
+            return out.total;
+        }
+    }
+
+    size_t toJson(const Node* node, OutBuffer& out) {
+        return emit(node, out, [&]() { JsonWriter { out }.node(node); });
+    }
+
+    size_t toMsgPack(const Node* node, OutBuffer& out) {
+        return emit(node, out, [&]() { MsgPackWriter { out }.node(node); });
+    }
+
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Queries
+    //
+    // ---------------------------------------------------------------------------------------------------
+
+    namespace {
+
+        struct QueryParser {
+            std::string_view s;
+            size_t i = 0;
+
+            [[noreturn]] void fail(const char* expected) const {
+                throw std::runtime_error("bad query '" + std::string { s } + "': expected " + expected + " at character " +
+                                         std::to_string(i + 1));
+            }
+            void skipSpace() {
+                while (i < s.size() and (s[i] == ' ' or s[i] == '\t')) i++;
+            }
+            bool eat(char c) {
+                if (i >= s.size() or s[i] != c) return false;
+                i++;
+                return true;
+            }
+            void expect(char c) {
+                char what[] = "' '";
+                what[1]     = c;
+                if (not eat(c)) fail(what);
+            }
+
+            // Keys without quotes end at anything that could be the rest of the query.
+            std::string key() {
+                size_t b = i;
+                while (i < s.size() and not std::strchr(".[]*?@ \t=!<>\"'", s[i])) i++;
+                if (i == b) fail("a key");
+                return std::string { s.substr(b, i - b) };
+            }
+            std::string quoted() {
+                char q = s[i++];
+                std::string out;
+                for (;; i++) {
+                    if (i == s.size()) fail(q == '"' ? "'\"'" : "'''");
+                    if (s[i] == q) {
+                        // Like YAML, single-quoted strings write a quote as two.
+                        if (q == '\'' and i + 1 < s.size() and s[i + 1] == '\'') {
+                            out += s[i++];
+                            continue;
+                        }
+                        break;
+                    }
+                    if (q == '"' and s[i] == '\\' and i + 1 < s.size()) out += s[i++];
+                    out += s[i];
+                }
+                i++;
+                return q == '"' ? unescape(out) : out;
+            }
+            int64_t index() {
+                int64_t v = 0;
+                auto r    = std::from_chars(s.data() + i, s.data() + s.size(), v);
+                if (r.ec != std::errc {}) fail("an index");
+                i = r.ptr - s.data();
+                return v;
+            }
+
+            // `[...]`, with the `[` already read. Filters only in `steps`, not in their paths.
+            Query::Step bracket(bool filters) {
+                Query::Step st;
+                skipSpace();
+                if (i < s.size() and (s[i] == '"' or s[i] == '\'')) {
+                    st.key = Key(quoted());
+                } else if (i < s.size() and (s[i] == '-' or is_numer(s[i]))) {
+                    st.kind  = Query::Step::eIndex;
+                    st.index = index();
+                } else if (filters and eat('*')) {
+                    st.kind = Query::Step::eAll;
+                } else if (filters and eat('?')) {
+                    st.kind   = Query::Step::eFilter;
+                    st.filter = filter();
+                } else {
+                    fail(filters ? "a key, an index, '*' or '?'" : "a key or an index");
+                }
+                skipSpace();
+                expect(']');
+                return st;
+            }
+
+            // Steps until the end, or anything else that can't continue a path.
+            std::vector<Query::Step> path(bool filters) {
+                std::vector<Query::Step> out;
+                bool first = true;
+                while (i < s.size()) {
+                    if (eat('[')) {
+                        out.push_back(bracket(filters));
+                    } else if (filters and (s[i] == '*' or (s[i] == '.' and i + 1 < s.size() and s[i + 1] == '*'))) {
+                        i += s[i] == '.' ? 2 : 1;
+                        out.emplace_back().kind = Query::Step::eAll;
+                    } else if (eat('.') or (first and not std::strchr(" \t=!<>]", s[i]))) {
+                        out.emplace_back().key = Key(key());
+                    } else {
+                        break;
+                    }
+                    first = false;
+                }
+                return out;
+            }
+
+            Query::Filter filter() {
+                Query::Filter f;
+                skipSpace();
+                eat('@');
+                f.path = path(false);
+                skipSpace();
+                static const std::pair<std::string_view, Query::Filter::Op> ops[] = {
+                    { "==", Query::Filter::eEq }, { "!=", Query::Filter::eNe }, { "<=", Query::Filter::eLe },
+                    { ">=", Query::Filter::eGe }, { "<", Query::Filter::eLt },  { ">", Query::Filter::eGt },
+                };
+                for (auto& [text, op] : ops)
+                    if (s.substr(i, text.size()) == text) {
+                        f.op = op;
+                        i += text.size();
+                        break;
+                    }
+                if (f.op == Query::Filter::eExists) return f;
+                skipSpace();
+                if (i < s.size() and (s[i] == '"' or s[i] == '\'')) {
+                    f.text = quoted();
+                    return f;
+                }
+                size_t b = i;
+                while (i < s.size() and not std::strchr(" \t]", s[i])) i++;
+                f.text = std::string { s.substr(b, i - b) };
+                if (f.text == "true" or f.text == "false") {
+                    f.literal = Query::Filter::eBool;
+                } else if (f.text == "null") {
+                    f.literal = Query::Filter::eNull;
+                } else {
+                    auto r = std::from_chars(f.text.data(), f.text.data() + f.text.size(), f.number);
+                    if (f.text.empty() or r.ec != std::errc {} or r.ptr != f.text.data() + f.text.size()) {
+                        i = b;
+                        fail("a number, a string, true, false or null");
+                    }
+                    f.literal = Query::Filter::eNumber;
+                }
+                return f;
+            }
+        };
+    }
+
+    Query::Query(std::string_view expr) {
+        QueryParser p { expr };
+        p.skipSpace();
+        p.eat('$');
+        steps = p.path(true);
+        p.skipSpace();
+        if (p.i != expr.size()) p.fail("'.', '[' or the end");
+    }
+
+    // Values of different types are only ever unequal. Keys with no value are null, and paths that lead
+    // nowhere have no type at all.
+    bool Query::matches(const Node* item, const Filter& f) const {
+        const Node* n = item;
+        for (auto& s : f.path)
+            if (not n or not(n = child(n, s))) break;
+        if (f.op == Filter::eExists) return n and not n->isEmpty();
+
+        int cmp   = 2; // 2 when the types differ
+        auto sign = [](auto a, auto b) { return a < b ? -1 : b < a ? 1 : 0; };
+        if (n and n->isEmpty()) {
+            if (f.literal == Filter::eNull) cmp = 0;
+        } else if (auto s = dynamic_cast<const ScalarNode*>(n)) {
+            auto v = ScalarValue::of(s);
+            switch (f.literal) {
+            case Filter::eNumber:
+                if (v.kind == ScalarValue::eInt) cmp = sign((double)v.i, f.number);
+                if (v.kind == ScalarValue::eFloat) cmp = sign(v.d, f.number);
+                break;
+            case Filter::eString:
+                if (v.kind == ScalarValue::eString) cmp = sign(v.text, std::string_view { f.text });
+                break;
+            case Filter::eBool:
+                if (v.kind == ScalarValue::eBool) cmp = sign(v.i, int64_t(f.text == "true"));
+                break;
+            case Filter::eNull:
+                if (v.kind == ScalarValue::eNull) cmp = 0;
+                break;
+            }
+        }
+        switch (f.op) {
+        case Filter::eEq: return cmp == 0;
+        case Filter::eNe: return cmp != 0;
+        case Filter::eLt: return cmp == -1;
+        case Filter::eLe: return cmp == -1 or cmp == 0;
+        case Filter::eGt: return cmp == 1;
+        case Filter::eGe: return cmp == 1 or cmp == 0;
+        default: return false;
+        }
+    }
+
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Batched changes
+    //
+    // ---------------------------------------------------------------------------------------------------
+
+    Batch& Batch::add(Kind kind, std::string_view path, Node* value) {
+        NodeUPtr owned { value };
+        QueryParser p { path };
+        auto steps = p.path(false);
+        if (p.i != path.size()) p.fail("'.', '[' or the end");
+        if (kind == eSet and steps.empty()) throw std::runtime_error("Batch::set() called with an empty path");
+        ops.push_back({ kind, std::move(steps), std::move(owned) });
+        return *this;
+    }
+
+    void Batch::commit() {
+        auto ops  = std::move(this->ops);
+        auto root = target->getRoot(false);
+        auto g    = root ? root->guard() : decltype(root->guard()) {};
+
+        // Containers whose children changed, marked dirty once at the end. Replaced values are released
+        // at the end too, so that no node allocated meanwhile can reuse the address of an indexed dict.
+        std::vector<Node*> changed;
+        std::vector<NodeUPtr> replaced;
+        std::unordered_map<const DictNode*, std::unordered_map<std::string, size_t>> indexes;
+        auto done = [&]() {
+            if (root and root->aliased)
+                root->markAllDirty();
+            else
+                for (auto n : changed) n->markDirty();
+        };
+
+        // The slot of `s` in `n`, or nullptr for a missing key. Small dicts are scanned.
+        auto find = [&](Node* n, const Query::Step& s, const std::string& where) -> Node** {
+            if (s.kind == Query::Step::eKey) {
+                auto d = dynamic_cast<DictNode*>(n);
+                if (not d) throw std::runtime_error("Batch: '" + where + "' is not a dict");
+                auto& cs = d->children;
+                if (cs.size() < 16 and not indexes.count(d)) {
+                    for (auto& kv : cs)
+                        if (kv.first == s.key.str()) return &kv.second;
+                    return nullptr;
+                }
+                auto& index = indexes[d];
+                if (index.empty())
+                    for (size_t k = 0; k < cs.size(); k++) index.emplace(cs[k].first, k);
+                auto it = index.find(s.key.str());
+                return it == index.end() ? nullptr : &cs[it->second].second;
+            }
+            auto l = dynamic_cast<ListNode*>(n);
+            if (not l) throw std::runtime_error("Batch: '" + where + "' is not a list");
+            int64_t i = s.index < 0 ? s.index + (int64_t)l->children.size() : s.index;
+            if (i < 0 or i >= (int64_t)l->children.size())
+                throw std::runtime_error("Batch: '" + where + "' has no item " + std::to_string(s.index));
+            return &l->children[i];
+        };
+        auto insert = [&](Node* n, const std::string& key) -> Node** {
+            auto d = static_cast<DictNode*>(n);
+            if (auto it = indexes.find(d); it != indexes.end()) it->second.emplace(key, d->children.size());
+            d->children.push_back({ key, nullptr });
+            return &d->children.back().second;
+        };
+
+        try {
+            for (auto& op : ops) {
+                Node* n = target;
+                std::string where;
+                for (size_t i = 0; i < op.path.size(); i++) {
+                    auto& s      = op.path[i];
+                    Node** child = find(n, s, where);
+                    where += s.kind == Query::Step::eKey ? (where.empty() ? "" : ".") + s.key.str() : "[" + std::to_string(s.index) + "]";
+                    bool last = i + 1 == op.path.size();
+                    if (last and op.kind == eSet) {
+                        if (not child) child = insert(n, s.key.str());
+                        replaced.emplace_back(*child);
+                        *child = op.value.release();
+                    } else if (not child or (*child)->isEmpty()) {
+                        // Missing on the way: a dict for the next key, or the list to append to.
+                        if (not last and op.path[i + 1].kind != Query::Step::eKey)
+                            throw std::runtime_error("Batch: '" + where + "' is not a list");
+                        if (not child) child = insert(n, s.key.str());
+                        replaced.emplace_back(*child);
+                        *child = last ? (Node*)new ListNode(nullptr, SourceRange {}) : new DictNode();
+                    } else {
+                        n = *child;
+                        continue;
+                    }
+                    (*child)->parent = n;
+                    changed.push_back(n);
+                    n = *child;
+                }
+                if (op.kind == eAppend) {
+                    auto l = dynamic_cast<ListNode*>(n);
+                    if (not l) throw std::runtime_error("Batch: '" + where + "' is not a list");
+                    op.value->parent = l;
+                    l->children.push_back(op.value.release());
+                    changed.push_back(l);
+                }
+            }
+        } catch (...) {
+            done();
+            throw;
+        }
+        done();
+    }
+
+
+    // ---------------------------------------------------------------------------------------------------
+    //
+    //   Overlays
+    //
+    // ---------------------------------------------------------------------------------------------------
+
+    Overlay::View Overlay::View::get(const char* k) const {
+        View out;
+        for (auto n : nodes) {
+            auto d = dynamic_cast<const DictNode*>(n);
+            if (not d) break;
+            auto v = d->find(k);
+            if (not v) continue;
+            // A dict merges with the dicts below it, and anything else hides them.
+            if (dynamic_cast<const DictNode*>(v))
+                out.nodes.push_back(v);
+            else {
+                if (out.nodes.empty()) out.nodes.push_back(v);
+                break;
+            }
+        }
+        return out;
+    }
+
+    Overlay::View Overlay::View::get(uint32_t i) const {
+        View out;
+        auto l = nodes.size() ? dynamic_cast<const ListNode*>(nodes[0]) : nullptr;
+        if (l and i < l->children.size()) out.nodes.push_back(l->children[i]);
+        return out;
+    }
+
+    Overlay& Overlay::push(std::shared_ptr<const ParsedDocument> layer) {
+        return push(std::shared_ptr<const RootNode>(layer, layer->root.get()));
+    }
+
+    Overlay& Overlay::push(std::shared_ptr<const RootNode> layer) {
+        layers.push_back(std::move(layer));
+        return *this;
+    }
+
+    Overlay::View Overlay::root() const {
+        View out;
+        for (size_t i = layers.size(); i--;) out.nodes.push_back(layers[i].get());
+        return out;
+    }
+
+    Snapshot Overlay::flatten() const {
+        auto top = root();
+        auto locks = lockAll(top.nodes);
+        auto merged = static_cast<DictNode*>(merge(top.nodes));
+        return Snapshot(merged, std::make_shared<std::vector<std::shared_ptr<const RootNode>>>(layers));
+    }
+
+    Node* Overlay::merge(const std::vector<const Node*>& dicts) {
+        // Keys in the order of the lowest layer that has them, each with its values from the top layer down.
+        // Of keys repeated in a dict, the first counts, like for find().
+        std::vector<std::pair<std::string_view, std::vector<const Node*>>> entries;
+        std::vector<size_t> lastLayer;
+        std::unordered_map<std::string_view, size_t> index;
+        for (size_t i = dicts.size(); i--;)
+            forEachEntry(static_cast<const DictNode*>(dicts[i]), [](size_t) {}, [&](const std::string& k, const Node* v) {
+                auto [it, added] = index.emplace(k, entries.size());
+                if (added) {
+                    entries.push_back({ k, {} });
+                    lastLayer.push_back(i + 1);
+                }
+                if (lastLayer[it->second] == i) return;
+                lastLayer[it->second] = i;
+                auto& values = entries[it->second].second;
+                values.insert(values.begin(), v);
+            });
+
+        NodeUPtr out { new DictNode() };
+        auto d   = static_cast<DictNode*>(out.get());
+        d->dirty = true;
+        d->children.reserve(entries.size());
+        for (auto& [k, values] : entries) {
+            // The dicts from the top down to the first other value, or that value alone.
+            size_t n = 0;
+            while (n < values.size() and dynamic_cast<const DictNode*>(values[n])) n++;
+            values.resize(std::max<size_t>(n, 1));
+            Node* v = values.size() == 1 ? retainNode(values[0]) : merge(values);
+            if (not v->parent) v->parent = d;
+            d->children.push_back({ std::string { k }, v });
+        }
+        return out.release();
+    }
+
+    std::vector<std::unique_lock<std::mutex>> Overlay::lockAll(const std::vector<const Node*>& nodes) {
+        std::vector<RootNode*> roots;
+        for (auto n : nodes)
+            if (auto r = n->getRoot(false)) roots.push_back(r);
+        std::sort(roots.begin(), roots.end());
+        roots.erase(std::unique(roots.begin(), roots.end()), roots.end());
+        std::vector<std::unique_lock<std::mutex>> locks;
+        for (auto r : roots) locks.push_back(r->guard());
+        return locks;
+    }
+
 #else
 
     std::string serialize(Node* root);
+    std::vector<DiffEntry> diff(const Node* before, const Node* after);
+    std::vector<Violation> validate(const Node* node, const Rule& rule);
+    size_t toJson(const Node* node, OutBuffer& out);
+    size_t toMsgPack(const Node* node, OutBuffer& out);
 
 #endif
 